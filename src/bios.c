@@ -0,0 +1,315 @@
+#include "bios.h"
+#include "cpu.h"
+#include "mem.h"
+#include "nds.h"
+
+#include <inttypes.h>
+#include <string.h>
+#include <stdio.h>
+
+/*
+ * high level emulation of the bios swi
+ * the routines games spend time in (copies, decompression, crc, maths)
+ * are run natively, everything else goes through the real bios code
+ * cycle costs are rough estimates of the bios loops, added to the wait
+ * states of the memory accesses
+ */
+
+#define SWI_CYCLES 20 /* exception entry, dispatch and return */
+
+/* page mapping addr in host memory, *len clamped to its contiguous part */
+static const struct mem_page *span(struct cpu *cpu, uint32_t addr, uint32_t *len, bool write)
+{
+	struct mem *mem = cpu->mem;
+	if (addr >= MEM_PAGES_END)
+		return NULL;
+	const struct mem_page *page = cpu->arm9
+	                            ? &mem->arm9_pages[addr >> MEM_PAGE_SHIFT]
+	                            : &mem->arm7_pages[addr >> MEM_PAGE_SHIFT];
+	if (!(write ? page->write : page->ptr != NULL))
+		return NULL;
+	uint32_t avail = MEM_PAGE_SIZE - (addr & MEM_PAGE_MASK);
+	if (page->mask + 1 - (addr & page->mask) < avail)
+		avail = page->mask + 1 - (addr & page->mask);
+	if (*len > avail)
+		*len = avail;
+	if (write && page->code != MEM_CODE_NONE)
+	{
+		uint32_t code = page->code + (addr & page->mask);
+		for (uint32_t i = code >> MEM_CODE_PAGE_SHIFT; i <= (code + *len - 1) >> MEM_CODE_PAGE_SHIFT; ++i)
+		{
+			if (mem->code_pages[i])
+				mem_code_invalidate(mem, i);
+		}
+	}
+	return page;
+}
+
+static uint32_t get(struct cpu *cpu, uint32_t addr, uint32_t size)
+{
+	if (size == 4)
+		return cpu->get32(cpu->mem, addr, MEM_DATA_SEQ);
+	return cpu->get16(cpu->mem, addr, MEM_DATA_SEQ);
+}
+
+static void set(struct cpu *cpu, uint32_t addr, uint32_t v, uint32_t size)
+{
+	if (size == 4)
+		cpu->set32(cpu->mem, addr, v, MEM_DATA_SEQ);
+	else
+		cpu->set16(cpu->mem, addr, v, MEM_DATA_SEQ);
+}
+
+/* forward copy (or fill) of count units of size bytes, in host memory
+ * where both sides allow it, through the memory handlers elsewhere
+ */
+static void transfer(struct cpu *cpu, uint32_t dst, uint32_t src, uint32_t count,
+                     uint32_t size, bool fill, uint32_t unit_cycles)
+{
+	struct nds *nds = cpu->mem->nds;
+	uint32_t v = 0;
+	if (fill)
+		v = get(cpu, src, size);
+	while (count)
+	{
+		uint32_t len = count * size;
+		const struct mem_page *dpage = span(cpu, dst, &len, true);
+		const struct mem_page *spage = NULL;
+		if (dpage && !fill)
+			spage = span(cpu, src, &len, false);
+		if (!dpage || (!fill && !spage))
+		{
+			if (!fill)
+				v = get(cpu, src, size);
+			set(cpu, dst, v, size);
+			cpu->instr_delay += unit_cycles;
+			if (!fill)
+				src += size;
+			dst += size;
+			count--;
+			continue;
+		}
+		uint32_t n = len / size;
+		uint8_t *d = &dpage->ptr[dst & dpage->mask];
+		uint32_t cycles = mem_wait_cycles[dpage->wait][size / 2][MEM_DATA_SEQ] + unit_cycles;
+		if (fill)
+		{
+			for (uint32_t i = 0; i < n; ++i)
+			{
+				if (size == 4)
+					((uint32_t*)d)[i] = v;
+				else
+					((uint16_t*)d)[i] = v;
+			}
+		}
+		else
+		{
+			const uint8_t *s = &spage->ptr[src & spage->mask];
+			if (d > s && d < s + len)
+			{
+				/* the bios copies forward: overlapping data gets repeated */
+				for (uint32_t i = 0; i < len; ++i)
+					d[i] = s[i];
+			}
+			else
+			{
+				memmove(d, s, len);
+			}
+			cycles += mem_wait_cycles[spage->wait][size / 2][MEM_DATA_SEQ];
+			src += len;
+		}
+		cpu->instr_delay += n * cycles;
+		dst += len;
+		count -= n;
+		if (cpu->arm9)
+			nds->arm7->idle = 0;
+		else
+			nds->arm9->idle = 0;
+	}
+}
+
+static void swi_waitbyloop(struct cpu *cpu)
+{
+	/* subs r0, r0, #1; bgt */
+	int32_t n = cpu_get_reg(cpu, 0);
+	if (n > 0)
+		cpu->instr_delay += n * 4;
+	cpu_set_reg(cpu, 0, 0);
+}
+
+static bool swi_div(struct cpu *cpu)
+{
+	int64_t num = (int32_t)cpu_get_reg(cpu, 0);
+	int64_t den = (int32_t)cpu_get_reg(cpu, 1);
+	if (!den)
+		return false; /* the bios never returns: let it */
+	int64_t quo = num / den;
+	cpu_set_reg(cpu, 0, quo);
+	cpu_set_reg(cpu, 1, num % den);
+	cpu_set_reg(cpu, 3, quo < 0 ? -quo : quo);
+	cpu->instr_delay += 80;
+	return true;
+}
+
+static void swi_cpuset(struct cpu *cpu)
+{
+	uint32_t src = cpu_get_reg(cpu, 0);
+	uint32_t dst = cpu_get_reg(cpu, 1);
+	uint32_t cnt = cpu_get_reg(cpu, 2);
+	uint32_t size = (cnt & (1 << 26)) ? 4 : 2;
+	src &= ~(size - 1);
+	dst &= ~(size - 1);
+	transfer(cpu, dst, src, cnt & 0x1FFFFF, size, cnt & (1 << 24), 4);
+}
+
+static void swi_cpufastset(struct cpu *cpu)
+{
+	uint32_t src = cpu_get_reg(cpu, 0) & ~3;
+	uint32_t dst = cpu_get_reg(cpu, 1) & ~3;
+	uint32_t cnt = cpu_get_reg(cpu, 2);
+	/* ldm / stm of 8 words */
+	transfer(cpu, dst, src, ((cnt & 0x1FFFFF) + 7) & ~7, 4, cnt & (1 << 24), 1);
+}
+
+static void swi_sqrt(struct cpu *cpu)
+{
+	uint32_t v = cpu_get_reg(cpu, 0);
+	uint32_t res = 0;
+	uint32_t bit = 1UL << 30;
+	while (bit > v)
+		bit >>= 2;
+	while (bit)
+	{
+		if (v >= res + bit)
+		{
+			v -= res + bit;
+			res = (res >> 1) + bit;
+		}
+		else
+		{
+			res >>= 1;
+		}
+		bit >>= 2;
+	}
+	cpu_set_reg(cpu, 0, res);
+	cpu->instr_delay += 64;
+}
+
+static void swi_getcrc16(struct cpu *cpu)
+{
+	uint32_t crc = cpu_get_reg(cpu, 0) & 0xFFFF;
+	uint32_t addr = cpu_get_reg(cpu, 1) & ~1;
+	uint32_t len = cpu_get_reg(cpu, 2) / 2;
+	uint16_t v = 0;
+	for (uint32_t i = 0; i < len; ++i)
+	{
+		v = cpu->get16(cpu->mem, addr + i * 2, MEM_DATA_SEQ);
+		/* the bios goes by nibbles with a table, which gives the same crc */
+		crc ^= v;
+		for (uint32_t j = 0; j < 16; ++j)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+	cpu_set_reg(cpu, 0, crc);
+	cpu_set_reg(cpu, 3, v);
+	cpu->instr_delay += len * 20;
+}
+
+static void swi_lz77(struct cpu *cpu)
+{
+	struct mem *mem = cpu->mem;
+	uint32_t src = cpu_get_reg(cpu, 0);
+	uint32_t dst = cpu_get_reg(cpu, 1);
+	uint32_t len = cpu->get32(mem, src & ~3, MEM_DATA_NSEQ) >> 8;
+	uint32_t end = dst + len;
+	src += 4;
+	while (dst < end)
+	{
+		uint8_t flags = cpu->get8(mem, src++, MEM_DATA_SEQ);
+		for (uint32_t i = 0; i < 8 && dst < end; ++i, flags <<= 1)
+		{
+			if (!(flags & 0x80))
+			{
+				cpu->set8(mem, dst++, cpu->get8(mem, src++, MEM_DATA_SEQ), MEM_DATA_SEQ);
+				cpu->instr_delay += 4;
+				continue;
+			}
+			uint8_t b0 = cpu->get8(mem, src++, MEM_DATA_SEQ);
+			uint8_t b1 = cpu->get8(mem, src++, MEM_DATA_SEQ);
+			uint32_t disp = (((b0 & 0xF) << 8) | b1) + 1;
+			uint32_t n = (b0 >> 4) + 3;
+			for (uint32_t j = 0; j < n && dst < end; ++j, ++dst)
+				cpu->set8(mem, dst, cpu->get8(mem, dst - disp, MEM_DATA_SEQ), MEM_DATA_SEQ);
+			cpu->instr_delay += 8 + n * 4;
+		}
+	}
+}
+
+static void swi_rl(struct cpu *cpu)
+{
+	struct mem *mem = cpu->mem;
+	uint32_t src = cpu_get_reg(cpu, 0);
+	uint32_t dst = cpu_get_reg(cpu, 1);
+	uint32_t len = cpu->get32(mem, src & ~3, MEM_DATA_NSEQ) >> 8;
+	uint32_t end = dst + len;
+	src += 4;
+	while (dst < end)
+	{
+		uint8_t flag = cpu->get8(mem, src++, MEM_DATA_SEQ);
+		if (flag & 0x80)
+		{
+			uint32_t n = (flag & 0x7F) + 3;
+			uint8_t v = cpu->get8(mem, src++, MEM_DATA_SEQ);
+			for (uint32_t i = 0; i < n && dst < end; ++i)
+				cpu->set8(mem, dst++, v, MEM_DATA_SEQ);
+			cpu->instr_delay += 8 + n * 3;
+		}
+		else
+		{
+			uint32_t n = (flag & 0x7F) + 1;
+			for (uint32_t i = 0; i < n && dst < end; ++i)
+				cpu->set8(mem, dst++, cpu->get8(mem, src++, MEM_DATA_SEQ), MEM_DATA_SEQ);
+			cpu->instr_delay += 8 + n * 4;
+		}
+	}
+}
+
+/* run swi nn natively, false if the bios code has to run it */
+bool bios_swi(struct cpu *cpu, uint8_t nn)
+{
+#if 0
+	printf("[%s] swi %02" PRIx8 "\n", cpu->arm9 ? "ARM9" : "ARM7", nn);
+#endif
+	switch (nn)
+	{
+		case 0x03:
+			swi_waitbyloop(cpu);
+			break;
+		case 0x09:
+			if (!swi_div(cpu))
+				return false;
+			break;
+		case 0x0B:
+			swi_cpuset(cpu);
+			break;
+		case 0x0C:
+			swi_cpufastset(cpu);
+			break;
+		case 0x0D:
+			swi_sqrt(cpu);
+			break;
+		case 0x0E:
+			swi_getcrc16(cpu);
+			break;
+		case 0x11:
+			swi_lz77(cpu);
+			break;
+		case 0x14:
+			swi_rl(cpu);
+			break;
+		/* 0x12, 0x13 and 0x15 read their input through guest callbacks */
+		default:
+			return false;
+	}
+	cpu->instr_delay += SWI_CYCLES;
+	return true;
+}
@@ -0,0 +1,11 @@
+#ifndef BIOS_H
+#define BIOS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct cpu;
+
+bool bios_swi(struct cpu *cpu, uint8_t nn);
+
+#endif
@@ -2,6 +2,8 @@
 #include "mem.h"
 #include "nds.h"
 #include "cpu/instr.h"
+#include "cpu/cache.h"
+#include "cpu/jit.h"
 
 #include <inttypes.h>
 #include <stdlib.h>
@@ -48,50 +50,13 @@ void cpu_del(struct cpu *cpu)
 {
 	if (!cpu)
 		return;
+	cpu_cache_del(cpu->cache);
+#ifdef ENABLE_JIT
+	cpu_jit_del(cpu->jit);
+#endif
 	free(cpu);
 }
 
-static bool check_arm_cond(struct cpu *cpu, uint32_t cond)
-{
-	switch (cond & 0xF)
-	{
-		case 0x0:
-			return CPU_GET_FLAG_Z(cpu);
-		case 0x1:
-			return !CPU_GET_FLAG_Z(cpu);
-		case 0x2:
-			return CPU_GET_FLAG_C(cpu);
-		case 0x3:
-			return !CPU_GET_FLAG_C(cpu);
-		case 0x4:
-			return CPU_GET_FLAG_N(cpu);
-		case 0x5:
-			return !CPU_GET_FLAG_N(cpu);
-		case 0x6:
-			return CPU_GET_FLAG_V(cpu);
-		case 0x7:
-			return !CPU_GET_FLAG_V(cpu);
-		case 0x8:
-			return CPU_GET_FLAG_C(cpu) && !CPU_GET_FLAG_Z(cpu);
-		case 0x9:
-			return !CPU_GET_FLAG_C(cpu) || CPU_GET_FLAG_Z(cpu);
-		case 0xA:
-			return CPU_GET_FLAG_N(cpu) == CPU_GET_FLAG_V(cpu);
-		case 0xB:
-			return CPU_GET_FLAG_N(cpu) != CPU_GET_FLAG_V(cpu);
-		case 0xC:
-			return !CPU_GET_FLAG_Z(cpu) && CPU_GET_FLAG_N(cpu) == CPU_GET_FLAG_V(cpu);
-		case 0xD:
-			return CPU_GET_FLAG_Z(cpu) || CPU_GET_FLAG_N(cpu) != CPU_GET_FLAG_V(cpu);
-		case 0xE:
-			return true;
-		case 0xF:
-			return false;
-	}
-	/* unreachable */
-	return false;
-}
-
 static void print_regs(struct cpu *cpu)
 {
 	printf("r00=%08" PRIx32 " r01=%08" PRIx32 " r02=%08" PRIx32 " r03=%08" PRIx32 " "
@@ -231,6 +196,10 @@ void cpu_update_irq_state(struct cpu *cpu)
 		reg_ie = mem_arm7_get_reg32(cpu->mem, MEM_ARM7_REG_IE);
 	}
 	cpu->irq_line = reg_ie & reg_if;
+	cpu->idle = 0;
+	/* blocks are left at the store, the irq is taken at the next one */
+	if (cpu->irq_line)
+		cpu->block_exit = 1;
 	if (cpu->state == CPU_STATE_RUN)
 		cpu->irq_wait = 0;
 	else
@@ -278,7 +247,7 @@ static bool decode_instruction(struct cpu *cpu)
 		}
 		else
 		{
-			if (!check_arm_cond(cpu, cpu->instr_opcode >> 28))
+			if (!cpu_check_arm_cond(cpu, cpu->instr_opcode >> 28))
 			{
 				if (cpu->debug)
 					print_instr(cpu, "SKIP", cpu_instr_arm[((cpu->instr_opcode >> 16) & 0xFF0) | ((cpu->instr_opcode >> 4) & 0xF)]);
@@ -303,6 +272,21 @@ void cpu_cycle(struct cpu *cpu)
 	handle_interrupt(cpu);
 	if (cpu->state != CPU_STATE_RUN)
 		return;
+	switch (cpu->debug ? CPU_EXEC_INTERPRETER : cpu->exec)
+	{
+		case CPU_EXEC_INTERPRETER:
+			break;
+		case CPU_EXEC_CACHED:
+			if (cpu_cache_run(cpu->cache))
+				return;
+			break;
+		case CPU_EXEC_JIT:
+#ifdef ENABLE_JIT
+			if (cpu_jit_run(cpu->jit))
+				return;
+#endif
+			break;
+	}
 	if (!decode_instruction(cpu))
 		return;
 	if (cpu->debug)
@@ -310,6 +294,60 @@ void cpu_cycle(struct cpu *cpu)
 	cpu->instr->exec(cpu);
 }
 
+void cpu_set_exec(struct cpu *cpu, enum cpu_exec exec)
+{
+	switch (exec)
+	{
+		case CPU_EXEC_INTERPRETER:
+			break;
+		case CPU_EXEC_JIT:
+#ifdef ENABLE_JIT
+			if (!cpu->jit)
+				cpu->jit = cpu_jit_new(cpu);
+			if (cpu->jit)
+				break;
+#endif
+			printf("[ARM%c] jit unavailable, using cached interpreter\n",
+			       cpu->arm9 ? '9' : '7');
+			exec = CPU_EXEC_CACHED;
+			/* FALLTHROUGH */
+		case CPU_EXEC_CACHED:
+			if (!cpu->cache)
+				cpu->cache = cpu_cache_new(cpu);
+			if (cpu->cache)
+				break;
+			printf("[ARM%c] failed to create code cache\n",
+			       cpu->arm9 ? '9' : '7');
+			exec = CPU_EXEC_INTERPRETER;
+			break;
+	}
+	cpu->exec = exec;
+}
+
+void cpu_invalidate_code(struct cpu *cpu, uint32_t page)
+{
+	if (cpu->cache)
+		cpu_cache_invalidate(cpu->cache, page);
+#ifdef ENABLE_JIT
+	if (cpu->jit)
+		cpu_jit_invalidate(cpu->jit, page);
+#else
+	(void)page;
+#endif
+	cpu->block_exit = 1;
+}
+
+void cpu_flush_code(struct cpu *cpu)
+{
+	if (cpu->cache)
+		cpu_cache_flush(cpu->cache);
+#ifdef ENABLE_JIT
+	if (cpu->jit)
+		cpu_jit_flush(cpu->jit);
+#endif
+	cpu->block_exit = 1;
+}
+
 void cpu_update_mode(struct cpu *cpu)
 {
 	for (size_t i = 0; i < 16; ++i)
@@ -432,6 +470,8 @@ static void update_itcm(struct cpu *cpu)
 	{
 		cpu->mem->itcm_base = 0xFFFFFFFF;
 		cpu->mem->itcm_mask = 0;
+		mem_arm9_update_pages(cpu->mem);
+		cpu_flush_code(cpu);
 		return;
 	}
 	cpu->mem->itcm_base = 0;
@@ -441,6 +481,8 @@ static void update_itcm(struct cpu *cpu)
 	if (size > 23)
 		size = 23;
 	cpu->mem->itcm_mask = (0x200 << size) - 1;
+	mem_arm9_update_pages(cpu->mem);
+	cpu_flush_code(cpu);
 #if 0
 	printf("itcm: 0x%08" PRIx32 " / 0x%08" PRIx32 "\n",
 	       cpu->mem->itcm_base, cpu->mem->itcm_mask);
@@ -453,6 +495,8 @@ static void update_dtcm(struct cpu *cpu)
 	{
 		cpu->mem->dtcm_base = 0xFFFFFFFF;
 		cpu->mem->dtcm_mask = 0;
+		mem_arm9_update_pages(cpu->mem);
+		cpu_flush_code(cpu);
 		return;
 	}
 	cpu->mem->dtcm_base = cpu->cp15.dtcm & 0xFFFFF000;
@@ -462,6 +506,8 @@ static void update_dtcm(struct cpu *cpu)
 	if (size > 23)
 		size = 23;
 	cpu->mem->dtcm_mask = (0x200 << size) - 1;
+	mem_arm9_update_pages(cpu->mem);
+	cpu_flush_code(cpu);
 #if 0
 	printf("dtcm: 0x%08" PRIx32 " / 0x%08" PRIx32 "\n",
 	       cpu->mem->dtcm_base, cpu->mem->dtcm_mask);
@@ -5,6 +5,8 @@
 #include <stdbool.h>
 
 struct cpu_instr;
+struct cpu_cache;
+struct cpu_jit;
 struct mem;
 
 #define CPU_DEBUG_BASE    (1 << 0) /* print instr name */
@@ -88,6 +90,13 @@ enum cpu_state
 	CPU_STATE_STOP,
 };
 
+enum cpu_exec
+{
+	CPU_EXEC_INTERPRETER,
+	CPU_EXEC_CACHED,
+	CPU_EXEC_JIT,
+};
+
 struct cp15
 {
 	uint32_t midr;
@@ -130,6 +139,13 @@ struct cpu
 	uint32_t irq_line;
 	uint16_t next_thumb;
 	int has_next_thumb;
+	enum cpu_exec exec;
+	struct cpu_cache *cache;
+	struct cpu_jit *jit;
+	int block_exit; /* set when the running block must stop (code write, remap, irq) */
+	int idle; /* spinning in an idle loop, not run until something changes */
+	int idle_veto; /* the running block read a register with side effects */
+	int hle_bios; /* run the supported swi natively instead of the bios */
 };
 
 struct cpu *cpu_new(struct mem *mem, int arm9);
@@ -139,6 +155,10 @@ void cpu_cycle(struct cpu *cpu);
 void cpu_update_mode(struct cpu *cpu);
 void cpu_update_irq_state(struct cpu *cpu);
 
+void cpu_set_exec(struct cpu *cpu, enum cpu_exec exec);
+void cpu_invalidate_code(struct cpu *cpu, uint32_t page);
+void cpu_flush_code(struct cpu *cpu);
+
 uint32_t cp15_read(struct cpu *cpu, uint8_t cn, uint8_t cm, uint8_t cp);
 void cp15_write(struct cpu *cpu, uint8_t cn, uint8_t cm, uint8_t cp, uint32_t v);
 
@@ -159,4 +179,45 @@ static inline void cpu_inc_pc(struct cpu *cpu, uint32_t v)
 	*cpu->regs.rptr[CPU_REG_PC] += v;
 }
 
+static inline bool cpu_check_arm_cond(struct cpu *cpu, uint32_t cond)
+{
+	switch (cond & 0xF)
+	{
+		case 0x0:
+			return CPU_GET_FLAG_Z(cpu);
+		case 0x1:
+			return !CPU_GET_FLAG_Z(cpu);
+		case 0x2:
+			return CPU_GET_FLAG_C(cpu);
+		case 0x3:
+			return !CPU_GET_FLAG_C(cpu);
+		case 0x4:
+			return CPU_GET_FLAG_N(cpu);
+		case 0x5:
+			return !CPU_GET_FLAG_N(cpu);
+		case 0x6:
+			return CPU_GET_FLAG_V(cpu);
+		case 0x7:
+			return !CPU_GET_FLAG_V(cpu);
+		case 0x8:
+			return CPU_GET_FLAG_C(cpu) && !CPU_GET_FLAG_Z(cpu);
+		case 0x9:
+			return !CPU_GET_FLAG_C(cpu) || CPU_GET_FLAG_Z(cpu);
+		case 0xA:
+			return CPU_GET_FLAG_N(cpu) == CPU_GET_FLAG_V(cpu);
+		case 0xB:
+			return CPU_GET_FLAG_N(cpu) != CPU_GET_FLAG_V(cpu);
+		case 0xC:
+			return !CPU_GET_FLAG_Z(cpu) && CPU_GET_FLAG_N(cpu) == CPU_GET_FLAG_V(cpu);
+		case 0xD:
+			return CPU_GET_FLAG_Z(cpu) || CPU_GET_FLAG_N(cpu) != CPU_GET_FLAG_V(cpu);
+		case 0xE:
+			return true;
+		case 0xF:
+			return false;
+	}
+	/* unreachable */
+	return false;
+}
+
 #endif
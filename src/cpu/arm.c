@@ -1,6 +1,7 @@
 #include "instr.h"
 #include "../cpu.h"
 #include "../mem.h"
+#include "../bios.h"
 
 #include <inttypes.h>
 #include <stdlib.h>
@@ -1476,6 +1477,11 @@ ARM_INSTR(mrc,
 
 ARM_INSTR(swi,
 {
+	if (cpu->hle_bios && bios_swi(cpu, (cpu->instr_opcode >> 16) & 0xFF))
+	{
+		cpu_inc_pc(cpu, 4);
+		return;
+	}
 	cpu->regs.spsr_modes[1] = cpu->regs.cpsr;
 	CPU_SET_MODE(cpu, CPU_MODE_SVC);
 	cpu_update_mode(cpu);
@@ -0,0 +1,441 @@
+#ifndef CPU_BLOCK_H
+#define CPU_BLOCK_H
+
+#include "../cpu.h"
+#include "../mem.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * helpers shared by the block based executors (cache & jit)
+ * a block is a run of guest instructions in a single code page, ending
+ * on the first instruction that can change the pc or the cpu mode
+ */
+
+#define BLOCK_INSTR_MAX 64
+
+static inline bool block_arm_end(uint32_t opcode)
+{
+	if (opcode >> 25 == 0x7D)
+		return true;
+	switch ((opcode >> 25) & 0x7)
+	{
+		case 0x0:
+		case 0x1:
+			if ((opcode & 0x0DB0F000) == 0x0120F000) /* msr can switch the mode */
+				return true;
+			return ((opcode >> 12) & 0xF) == CPU_REG_PC;
+		case 0x2:
+		case 0x3:
+			if ((opcode & (1 << 25)) && (opcode & 0x10))
+				return true;
+			return (opcode & (1 << 20)) && ((opcode >> 12) & 0xF) == CPU_REG_PC;
+		case 0x4:
+			return (opcode & (1 << 20)) && (opcode & (1 << CPU_REG_PC));
+	}
+	return true;
+}
+
+static inline bool block_arm_store(uint32_t opcode)
+{
+	switch ((opcode >> 25) & 0x7)
+	{
+		case 0x0:
+			return (opcode & 0x90) == 0x90 && !(opcode & (1 << 20));
+		case 0x2:
+		case 0x3:
+		case 0x4:
+			return !(opcode & (1 << 20));
+	}
+	return false;
+}
+
+static inline bool block_thumb_end(uint16_t opcode)
+{
+	if ((opcode & 0xFC00) == 0x4400 && (opcode & 0x87) == 0x87)
+		return true;
+	if ((opcode & 0xFF00) == 0x4700)
+		return true;
+	if ((opcode & 0xFE00) == 0xBC00 && (opcode & 0x100))
+		return true;
+	if ((opcode & 0xFF00) == 0xBE00)
+		return true;
+	return opcode >= 0xD000 && (opcode & 0xF800) != 0xF000;
+}
+
+static inline bool block_thumb_store(uint16_t opcode)
+{
+	switch (opcode >> 12)
+	{
+		case 0x5:
+		case 0x6:
+		case 0x7:
+		case 0x8:
+		case 0x9:
+		case 0xC:
+			return !(opcode & 0x800);
+		case 0xB:
+			return (opcode & 0xFE00) == 0xB400;
+	}
+	return false;
+}
+
+/* cached code address of pc, MEM_CODE_NONE if it can't be cached */
+static inline uint32_t block_code_addr(struct cpu *cpu, uint32_t pc)
+{
+	if (cpu->arm9)
+		return mem_arm9_code_addr(cpu->mem, pc);
+	return mem_arm7_code_addr(cpu->mem, pc);
+}
+
+/* fetch an opcode, returning the wait cycles instead of applying them */
+static inline uint32_t block_fetch(struct cpu *cpu, uint32_t pc, int size, int32_t *cycles)
+{
+	enum mem_type type = cpu->arm9 ? MEM_CODE_NSEQ : MEM_CODE_SEQ;
+	int32_t delay = cpu->instr_delay;
+	uint32_t v;
+	if (size == 32)
+		v = cpu->get32(cpu->mem, pc, type);
+	else
+		v = cpu->get16(cpu->mem, pc, type);
+	*cycles = cpu->instr_delay - delay;
+	cpu->instr_delay = delay;
+	return v;
+}
+
+/*
+ * idle loop detection
+ *
+ * a block branching back to its own start, made only of loads and alu ops
+ * whose results don't depend on values the loop itself produced, reaches a
+ * fixed point after one iteration: it can't do anything new until memory,
+ * an irq or an event changes
+ *
+ * registers are tracked as bits 0-15, flags as bits 16-19
+ */
+
+#define BLOCK_FLAG_N (1 << 16)
+#define BLOCK_FLAG_Z (1 << 17)
+#define BLOCK_FLAG_C (1 << 18)
+#define BLOCK_FLAG_V (1 << 19)
+#define BLOCK_FLAGS  (BLOCK_FLAG_N | BLOCK_FLAG_Z | BLOCK_FLAG_C | BLOCK_FLAG_V)
+
+struct block_idle
+{
+	uint32_t def; /* always written so far */
+	uint32_t written;
+	uint32_t live_in; /* read before being written */
+};
+
+static inline void block_idle_access(struct block_idle *idle, uint32_t reads,
+                                     uint32_t writes, bool always)
+{
+	reads &= ~(1 << CPU_REG_PC);
+	idle->live_in |= reads & ~idle->def;
+	idle->written |= writes;
+	if (always)
+		idle->def |= writes;
+}
+
+static inline uint32_t block_cond_flags(uint32_t cond)
+{
+	static const uint32_t flags[16] =
+	{
+		BLOCK_FLAG_Z, BLOCK_FLAG_Z,
+		BLOCK_FLAG_C, BLOCK_FLAG_C,
+		BLOCK_FLAG_N, BLOCK_FLAG_N,
+		BLOCK_FLAG_V, BLOCK_FLAG_V,
+		BLOCK_FLAG_C | BLOCK_FLAG_Z, BLOCK_FLAG_C | BLOCK_FLAG_Z,
+		BLOCK_FLAG_N | BLOCK_FLAG_V, BLOCK_FLAG_N | BLOCK_FLAG_V,
+		BLOCK_FLAG_N | BLOCK_FLAG_Z | BLOCK_FLAG_V, BLOCK_FLAG_N | BLOCK_FLAG_Z | BLOCK_FLAG_V,
+		0, 0,
+	};
+	return flags[cond & 0xF];
+}
+
+static inline bool block_idle_arm(struct block_idle *idle, uint32_t opcode)
+{
+	uint32_t cond = opcode >> 28;
+	uint32_t rn = (opcode >> 16) & 0xF;
+	uint32_t rd = (opcode >> 12) & 0xF;
+	uint32_t rm = opcode & 0xF;
+	uint32_t reads = block_cond_flags(cond);
+	uint32_t writes = 0;
+	if (cond == 0xF || rd == CPU_REG_PC)
+		return false;
+	switch ((opcode >> 26) & 0x3)
+	{
+		case 0x0:
+		{
+			if (!(opcode & (1 << 25)) && (opcode & 0x90) == 0x90)
+			{
+				/* ldrh / ldrsb / ldrsh without writeback */
+				if (!(opcode & 0x60) || !(opcode & (1 << 20))
+				 || !(opcode & (1 << 24)) || (opcode & (1 << 21)))
+					return false;
+				reads |= 1 << rn;
+				if (!(opcode & (1 << 22)))
+					reads |= 1 << rm;
+				writes |= 1 << rd;
+				break;
+			}
+			uint32_t alu = (opcode >> 21) & 0xF;
+			bool s = opcode & (1 << 20);
+			if (alu >= 0x8 && alu <= 0xB && !s) /* msr / mrs / bx... */
+				return false;
+			bool carry_out = false;
+			if (opcode & (1 << 25))
+			{
+				carry_out = (opcode >> 8) & 0xF;
+			}
+			else
+			{
+				reads |= 1 << rm;
+				if (opcode & 0x10)
+				{
+					reads |= 1 << ((opcode >> 8) & 0xF);
+					carry_out = true;
+				}
+				else if ((opcode >> 7) & 0x1F)
+				{
+					carry_out = true;
+				}
+				else if (((opcode >> 5) & 0x3) == 0x3) /* rrx */
+				{
+					reads |= BLOCK_FLAG_C;
+					carry_out = true;
+				}
+				else if ((opcode >> 5) & 0x3) /* lsr / asr #32 */
+				{
+					carry_out = true;
+				}
+			}
+			if (alu != 0xD && alu != 0xF)
+				reads |= 1 << rn;
+			if (alu < 0x8 || alu > 0xB)
+				writes |= 1 << rd;
+			if (alu >= 0x5 && alu <= 0x7)
+				reads |= BLOCK_FLAG_C;
+			if (s)
+			{
+				switch (alu)
+				{
+					case 0x2:
+					case 0x3:
+					case 0x4:
+					case 0x5:
+					case 0x6:
+					case 0x7:
+					case 0xA:
+					case 0xB:
+						writes |= BLOCK_FLAGS;
+						break;
+					default:
+						writes |= BLOCK_FLAG_N | BLOCK_FLAG_Z;
+						if (carry_out)
+						{
+							/* a shift by register may leave it untouched */
+							block_idle_access(idle, 0, BLOCK_FLAG_C, false);
+						}
+						break;
+				}
+			}
+			break;
+		}
+		case 0x1:
+			/* ldr / ldrb without writeback */
+			if (!(opcode & (1 << 20)) || !(opcode & (1 << 24))
+			 || (opcode & (1 << 21)))
+				return false;
+			if ((opcode & (1 << 25)) && (opcode & 0x10))
+				return false;
+			reads |= 1 << rn;
+			if (opcode & (1 << 25))
+				reads |= 1 << rm;
+			writes |= 1 << rd;
+			break;
+		default:
+			return false;
+	}
+	block_idle_access(idle, reads, writes, cond == 0xE);
+	return true;
+}
+
+static inline bool block_idle_thumb(struct block_idle *idle, uint16_t opcode)
+{
+	uint32_t rd = opcode & 0x7;
+	uint32_t rs = (opcode >> 3) & 0x7;
+	uint32_t ro = (opcode >> 6) & 0x7;
+	uint32_t reads = 0;
+	uint32_t writes = 0;
+	switch (opcode >> 11)
+	{
+		case 0x00: /* lsl */
+			reads = 1 << rs;
+			writes = (1 << rd) | BLOCK_FLAG_N | BLOCK_FLAG_Z;
+			if ((opcode >> 6) & 0x1F)
+				writes |= BLOCK_FLAG_C;
+			break;
+		case 0x01: /* lsr */
+		case 0x02: /* asr */
+			reads = 1 << rs;
+			writes = (1 << rd) | BLOCK_FLAG_N | BLOCK_FLAG_Z | BLOCK_FLAG_C;
+			break;
+		case 0x03: /* add / sub */
+			reads = 1 << rs;
+			if (!(opcode & (1 << 10)))
+				reads |= 1 << ro;
+			writes = (1 << rd) | BLOCK_FLAGS;
+			break;
+		case 0x04: /* mov imm */
+			writes = (1 << ((opcode >> 8) & 0x7)) | BLOCK_FLAG_N | BLOCK_FLAG_Z;
+			break;
+		case 0x05: /* cmp imm */
+			reads = 1 << ((opcode >> 8) & 0x7);
+			writes = BLOCK_FLAGS;
+			break;
+		case 0x06: /* add imm */
+		case 0x07: /* sub imm */
+			reads = 1 << ((opcode >> 8) & 0x7);
+			writes = reads | BLOCK_FLAGS;
+			break;
+		case 0x08:
+			if (opcode & (1 << 10))
+			{
+				/* hi registers ops, pc writes already end the block */
+				rd |= (opcode >> 4) & 0x8;
+				rs |= (opcode >> 3) & 0x8;
+				switch ((opcode >> 8) & 0x3)
+				{
+					case 0x0:
+						reads = (1 << rd) | (1 << rs);
+						writes = 1 << rd;
+						break;
+					case 0x1:
+						reads = (1 << rd) | (1 << rs);
+						writes = BLOCK_FLAGS;
+						break;
+					case 0x2:
+						reads = 1 << rs;
+						writes = 1 << rd;
+						break;
+					default:
+						return false;
+				}
+				break;
+			}
+			reads = (1 << rd) | (1 << rs);
+			switch ((opcode >> 6) & 0xF)
+			{
+				case 0x0: /* and */
+				case 0x1: /* eor */
+				case 0xC: /* orr */
+				case 0xE: /* bic */
+					writes = (1 << rd) | BLOCK_FLAG_N | BLOCK_FLAG_Z;
+					break;
+				case 0x2: /* lsl */
+				case 0x3: /* lsr */
+				case 0x4: /* asr */
+				case 0x7: /* ror */
+					writes = (1 << rd) | BLOCK_FLAG_N | BLOCK_FLAG_Z;
+					block_idle_access(idle, 0, BLOCK_FLAG_C, false);
+					break;
+				case 0x5: /* adc */
+				case 0x6: /* sbc */
+					reads |= BLOCK_FLAG_C;
+					writes = (1 << rd) | BLOCK_FLAGS;
+					break;
+				case 0x8: /* tst */
+					writes = BLOCK_FLAG_N | BLOCK_FLAG_Z;
+					break;
+				case 0x9: /* neg */
+					reads = 1 << rs;
+					writes = (1 << rd) | BLOCK_FLAGS;
+					break;
+				case 0xA: /* cmp */
+				case 0xB: /* cmn */
+					writes = BLOCK_FLAGS;
+					break;
+				case 0xD: /* mul */
+					writes = (1 << rd) | BLOCK_FLAG_N | BLOCK_FLAG_Z;
+					break;
+				case 0xF: /* mvn */
+					reads = 1 << rs;
+					writes = (1 << rd) | BLOCK_FLAG_N | BLOCK_FLAG_Z;
+					break;
+			}
+			break;
+		case 0x09: /* ldr pc relative */
+			writes = 1 << ((opcode >> 8) & 0x7);
+			break;
+		case 0x0A:
+		case 0x0B: /* load / store register offset */
+			if (!(opcode & (1 << 9)) && !(opcode & (1 << 11)))
+				return false;
+			if ((opcode & (1 << 9)) && (opcode & 0x0C00) == 0)
+				return false;
+			reads = (1 << rs) | (1 << ro);
+			writes = 1 << rd;
+			break;
+		case 0x0D:
+		case 0x0F:
+		case 0x11: /* load immediate offset */
+			reads = 1 << rs;
+			writes = 1 << rd;
+			break;
+		case 0x13: /* ldr sp relative */
+			reads = 1 << CPU_REG_SP;
+			writes = 1 << ((opcode >> 8) & 0x7);
+			break;
+		default:
+			return false;
+	}
+	block_idle_access(idle, reads, writes, true);
+	return true;
+}
+
+/* whether the block (ending in a branch) loops on itself without side effects */
+static inline bool block_idle_end(struct block_idle *idle, uint32_t opcode,
+                                  uint32_t offset, bool thumb)
+{
+	int32_t target;
+	uint32_t cond;
+	if (thumb)
+	{
+		if ((opcode & 0xF000) == 0xD000)
+		{
+			cond = (opcode >> 8) & 0xF;
+			if (cond >= 0xE)
+				return false;
+			target = offset + 4 + (int32_t)(int8_t)opcode * 2;
+		}
+		else if ((opcode & 0xF800) == 0xE000)
+		{
+			cond = 0xE;
+			target = offset + 4 + ((int32_t)(opcode << 21) >> 20);
+		}
+		else
+		{
+			return false;
+		}
+	}
+	else
+	{
+		if ((opcode & 0x0F000000) != 0x0A000000 || opcode >> 28 == 0xF)
+			return false;
+		cond = opcode >> 28;
+		target = offset + 8 + ((int32_t)(opcode << 8) >> 6);
+	}
+	if (target)
+		return false;
+	block_idle_access(idle, block_cond_flags(cond), 0, false);
+	return !(idle->live_in & idle->written);
+}
+
+static inline uint32_t block_hash(uint32_t pc, uint32_t mode, uint32_t size)
+{
+	return ((pc >> 1) ^ (pc >> 13) ^ mode) & (size - 1);
+}
+
+#endif
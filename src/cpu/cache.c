@@ -0,0 +1,249 @@
+#include "cache.h"
+#include "block.h"
+#include "instr.h"
+#include "../cpu.h"
+#include "../mem.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * cached interpreter
+ *
+ * blocks are decoded once into a list of handlers with their opcode,
+ * condition and fetch cycles, then executed without going through
+ * the fetch & decode of the interpreter
+ * a block stops as soon as the pc leaves the expected path or a store
+ * halted the cpu / invalidated code
+ */
+
+#define CACHE_BLOCKS_MAX 0x4000
+#define CACHE_INSTRS_MAX (CACHE_BLOCKS_MAX * 16)
+#define CACHE_HASH_SIZE  0x1000
+
+struct cache_instr
+{
+	void (*exec)(struct cpu *cpu);
+	uint32_t opcode;
+	int32_t cycles;
+	uint8_t cond;
+	uint8_t store;
+};
+
+struct cache_block
+{
+	uint32_t pc;
+	uint32_t mode;
+	uint32_t end;
+	uint32_t instrs_nb;
+	bool idle;
+	struct cache_instr *instrs;
+	struct cache_block *hash_next;
+	struct cache_block *page_next;
+};
+
+struct cpu_cache
+{
+	struct cpu *cpu;
+	struct cache_block *blocks;
+	uint32_t blocks_nb;
+	struct cache_instr *instrs;
+	uint32_t instrs_nb;
+	struct cache_block *hash[CACHE_HASH_SIZE];
+	struct cache_block *pages[MEM_CODE_PAGES];
+};
+
+struct cpu_cache *cpu_cache_new(struct cpu *cpu)
+{
+	struct cpu_cache *cache = calloc(sizeof(*cache), 1);
+	if (!cache)
+		return NULL;
+
+	cache->cpu = cpu;
+	cache->blocks = malloc(sizeof(*cache->blocks) * CACHE_BLOCKS_MAX);
+	cache->instrs = malloc(sizeof(*cache->instrs) * CACHE_INSTRS_MAX);
+	if (!cache->blocks || !cache->instrs)
+	{
+		cpu_cache_del(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+void cpu_cache_del(struct cpu_cache *cache)
+{
+	if (!cache)
+		return;
+	free(cache->blocks);
+	free(cache->instrs);
+	free(cache);
+}
+
+void cpu_cache_flush(struct cpu_cache *cache)
+{
+	memset(cache->hash, 0, sizeof(cache->hash));
+	memset(cache->pages, 0, sizeof(cache->pages));
+	cache->blocks_nb = 0;
+	cache->instrs_nb = 0;
+}
+
+void cpu_cache_invalidate(struct cpu_cache *cache, uint32_t page)
+{
+	struct cache_block *block = cache->pages[page];
+	cache->pages[page] = NULL;
+	for (; block; block = block->page_next)
+	{
+		struct cache_block **it = &cache->hash[block_hash(block->pc, block->mode, CACHE_HASH_SIZE)];
+		while (*it != block)
+			it = &(*it)->hash_next;
+		*it = block->hash_next;
+	}
+}
+
+static struct cache_block *decode(struct cpu_cache *cache, uint32_t pc, uint32_t mode)
+{
+	struct cpu *cpu = cache->cpu;
+	uint32_t addr = block_code_addr(cpu, pc);
+	if (addr == MEM_CODE_NONE)
+		return NULL;
+	if (cache->blocks_nb == CACHE_BLOCKS_MAX
+	 || cache->instrs_nb + BLOCK_INSTR_MAX > CACHE_INSTRS_MAX)
+		cpu_cache_flush(cache);
+	uint32_t page = addr >> MEM_CODE_PAGE_SHIFT;
+	uint32_t page_end = (pc | ((1 << MEM_CODE_PAGE_SHIFT) - 1)) + 1;
+	struct cache_block *block = &cache->blocks[cache->blocks_nb++];
+	block->pc = pc;
+	block->mode = mode;
+	block->instrs = &cache->instrs[cache->instrs_nb];
+	block->instrs_nb = 0;
+	bool thumb = mode & CPU_FLAG_T;
+	bool has_next = false;
+	uint16_t next = 0;
+	struct block_idle idle = {0};
+	bool idle_ok = true;
+	block->idle = false;
+	while (block->instrs_nb < BLOCK_INSTR_MAX && pc < page_end)
+	{
+		struct cache_instr *instr = &block->instrs[block->instrs_nb];
+		int32_t cycles;
+		bool end;
+		if (thumb)
+		{
+			uint16_t opcode;
+			if (has_next)
+			{
+				opcode = next;
+				has_next = false;
+				cycles = 0;
+			}
+			else if (pc & 2)
+			{
+				opcode = block_fetch(cpu, pc, 16, &cycles);
+			}
+			else
+			{
+				uint32_t v = block_fetch(cpu, pc, 32, &cycles);
+				opcode = v & 0xFFFF;
+				next = v >> 16;
+				has_next = true;
+			}
+			instr->exec = cpu_instr_thumb[opcode >> 6]->exec;
+			instr->opcode = opcode;
+			instr->cond = 0xE;
+			instr->store = block_thumb_store(opcode);
+			end = block_thumb_end(opcode);
+			if (end)
+				block->idle = idle_ok && block_idle_end(&idle, opcode, pc - block->pc, true);
+			else if (idle_ok)
+				idle_ok = block_idle_thumb(&idle, opcode);
+			pc += 2;
+		}
+		else
+		{
+			uint32_t opcode = block_fetch(cpu, pc, 32, &cycles);
+			if (opcode >> 25 == 0x7D)
+			{
+				instr->exec = cpu_instr_blx_imm->exec;
+				instr->cond = 0xE;
+			}
+			else
+			{
+				instr->exec = cpu_instr_arm[((opcode >> 16) & 0xFF0) | ((opcode >> 4) & 0xF)]->exec;
+				instr->cond = opcode >> 28;
+			}
+			instr->opcode = opcode;
+			instr->store = block_arm_store(opcode);
+			end = block_arm_end(opcode);
+			if (end)
+				block->idle = idle_ok && block_idle_end(&idle, opcode, pc - block->pc, false);
+			else if (idle_ok)
+				idle_ok = block_idle_arm(&idle, opcode);
+			pc += 4;
+		}
+		if (block->instrs_nb) /* the first instruction is the cpu_cycle call itself */
+			cycles++;
+		instr->cycles = cycles;
+		block->instrs_nb++;
+		if (end)
+			break;
+	}
+	block->end = pc;
+	cache->instrs_nb += block->instrs_nb;
+	uint32_t key = block_hash(block->pc, mode, CACHE_HASH_SIZE);
+	block->hash_next = cache->hash[key];
+	cache->hash[key] = block;
+	block->page_next = cache->pages[page];
+	cache->pages[page] = block;
+	mem_code_add(cpu->mem, page);
+	return block;
+}
+
+bool cpu_cache_run(struct cpu_cache *cache)
+{
+	struct cpu *cpu = cache->cpu;
+	uint32_t pc = cpu_get_reg(cpu, CPU_REG_PC);
+	uint32_t mode = cpu->regs.cpsr & 0x3F;
+	struct cache_block *block = cache->hash[block_hash(pc, mode, CACHE_HASH_SIZE)];
+	while (block && (block->pc != pc || block->mode != mode))
+		block = block->hash_next;
+	if (!block)
+	{
+		block = decode(cache, pc, mode);
+		if (!block)
+			return false;
+	}
+	uint32_t size = (mode & CPU_FLAG_T) ? 2 : 4;
+	uint32_t *reg_pc = &cpu->regs.r[CPU_REG_PC];
+	cpu->has_next_thumb = 0;
+	cpu->block_exit = 0;
+	cpu->idle_veto = 0;
+	uint32_t i;
+	for (i = 0; i < block->instrs_nb; ++i)
+	{
+		const struct cache_instr *instr = &block->instrs[i];
+		/* the cycles given by nds_cycles are used up (a thumb word
+		 * fetch isn't split)
+		 */
+		if (i && cpu->instr_delay >= 0 && !((mode & CPU_FLAG_T) && (pc & 2)))
+		{
+			*reg_pc = pc;
+			break;
+		}
+		cpu->instr_delay += instr->cycles;
+		*reg_pc = pc;
+		pc += size;
+		if (!cpu_check_arm_cond(cpu, instr->cond))
+			continue;
+		cpu->instr_opcode = instr->opcode;
+		instr->exec(cpu);
+		if (*reg_pc != pc)
+			break;
+		if (instr->store && (cpu->state != CPU_STATE_RUN || cpu->block_exit))
+			break;
+	}
+	if (i == block->instrs_nb)
+		*reg_pc = pc;
+	if (block->idle && *reg_pc == block->pc && !cpu->idle_veto)
+		cpu->idle = 1;
+	return true;
+}
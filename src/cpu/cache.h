@@ -0,0 +1,17 @@
+#ifndef CPU_CACHE_H
+#define CPU_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct cpu;
+struct cpu_cache;
+
+struct cpu_cache *cpu_cache_new(struct cpu *cpu);
+void cpu_cache_del(struct cpu_cache *cache);
+
+bool cpu_cache_run(struct cpu_cache *cache);
+void cpu_cache_invalidate(struct cpu_cache *cache, uint32_t page);
+void cpu_cache_flush(struct cpu_cache *cache);
+
+#endif
@@ -0,0 +1,978 @@
+#define _GNU_SOURCE
+
+#include "jit.h"
+#include "block.h"
+#include "instr.h"
+#include "../cpu.h"
+#include "../mem.h"
+
+#ifdef ENABLE_FASTMEM
+# include "../fastmem.h"
+# include <signal.h>
+# include <ucontext.h>
+#endif
+
+#include <sys/mman.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+/*
+ * x86-64 block translator
+ *
+ * each block instruction either gets native code (simple alu ops) or a call to
+ * its interpreter handler, surrounded by the bookkeeping the interpreter
+ * would have done (pc, fetch cycles, condition)
+ * the generated function returns as soon as the pc leaves the expected
+ * path, a store halted the cpu / invalidated code / raised an irq, or the
+ * cycles it was given are used up
+ *
+ * rbx holds the struct cpu pointer for the whole block
+ *
+ * with fastmem, immediate offset loads / stores access the host view of the
+ * guest address space directly; each access is recorded as a site with an
+ * out of line call to the interpreter handler, where the SIGSEGV handler
+ * sends faulting ones (io, unmapped or code pages): the handler itself only
+ * moves rip, the access being done again on the slow path
+ */
+
+#define JIT_CODE_SIZE   (8 * 1024 * 1024)
+#define JIT_BLOCKS_MAX  0x10000
+#define JIT_HASH_SIZE   0x1000
+#define JIT_INSTR_CODE  288 /* max host bytes per guest instruction */
+#define JIT_SITES_MAX   0x20000
+#define JIT_FASTMEM_MAX 64 /* jits with a fastmem view in the process */
+#define JIT_BLOCK_CODE  (BLOCK_INSTR_MAX * JIT_INSTR_CODE + 64)
+
+#define OFF_REG(n)  (offsetof(struct cpu, regs.r) + (n) * 4)
+#define OFF_CPSR    offsetof(struct cpu, regs.cpsr)
+#define OFF_OPCODE  offsetof(struct cpu, instr_opcode)
+#define OFF_DELAY   offsetof(struct cpu, instr_delay)
+#define OFF_STATE   offsetof(struct cpu, state)
+#define OFF_EXIT    offsetof(struct cpu, block_exit)
+
+struct jit_site
+{
+	uint32_t code; /* offset of the faulting instruction */
+	uint32_t slow; /* offset of the interpreter handler call */
+};
+
+struct jit_block
+{
+	uint32_t pc;
+	uint32_t mode;
+	bool idle;
+	void (*code)(struct cpu *cpu);
+	struct jit_block *hash_next;
+	struct jit_block *page_next;
+};
+
+struct cpu_jit
+{
+	struct cpu *cpu;
+	uint8_t *code;
+	uint32_t code_pos;
+	uint8_t *ptr; /* emit pointer */
+	struct jit_block *blocks;
+	uint32_t blocks_nb;
+	struct jit_block *hash[JIT_HASH_SIZE];
+	struct jit_block *pages[MEM_CODE_PAGES];
+	uint8_t *view; /* fastmem guest address space, NULL if unavailable */
+	const uint8_t (*view_cycles)[MEM_PAGES];
+	struct jit_site *sites;
+	uint32_t sites_nb;
+};
+
+#ifdef ENABLE_FASTMEM
+
+/* the handler is installed once for all the instances: it finds the jit
+ * from the faulting code in a table that is only locked to be changed
+ */
+struct fastmem_slot
+{
+	uint8_t *code;
+	struct cpu_jit *jit;
+};
+
+static struct fastmem_slot fastmem_slots[JIT_FASTMEM_MAX];
+static struct sigaction fastmem_prev;
+static bool fastmem_installed;
+static int fastmem_lock;
+
+static void lock_slots(void)
+{
+	while (__atomic_exchange_n(&fastmem_lock, 1, __ATOMIC_ACQUIRE))
+		;
+}
+
+static void unlock_slots(void)
+{
+	__atomic_store_n(&fastmem_lock, 0, __ATOMIC_RELEASE);
+}
+
+static const struct jit_site *find_site(struct cpu_jit *jit, uint32_t code)
+{
+	uint32_t lo = 0;
+	uint32_t hi = jit->sites_nb;
+	while (lo < hi)
+	{
+		uint32_t mid = (lo + hi) / 2;
+		if (jit->sites[mid].code < code)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == jit->sites_nb || jit->sites[lo].code != code)
+		return NULL;
+	return &jit->sites[lo];
+}
+
+static void fastmem_fault(int sig, siginfo_t *info, void *ctx)
+{
+	ucontext_t *uc = ctx;
+	uint8_t *rip = (uint8_t*)uc->uc_mcontext.gregs[REG_RIP];
+	for (size_t i = 0; i < JIT_FASTMEM_MAX; ++i)
+	{
+		uint8_t *code = __atomic_load_n(&fastmem_slots[i].code, __ATOMIC_ACQUIRE);
+		if (!code || rip < code || rip >= code + JIT_CODE_SIZE)
+			continue;
+		/* the faulting thread is running this jit: it can't be deleted */
+		struct cpu_jit *jit = __atomic_load_n(&fastmem_slots[i].jit, __ATOMIC_ACQUIRE);
+		const struct jit_site *site = find_site(jit, rip - code);
+		if (!site)
+			break;
+		uc->uc_mcontext.gregs[REG_RIP] = (greg_t)&code[site->slow];
+		return;
+	}
+	/* not a guest access */
+	if (fastmem_prev.sa_flags & SA_SIGINFO)
+	{
+		fastmem_prev.sa_sigaction(sig, info, ctx);
+		return;
+	}
+	if (fastmem_prev.sa_handler != SIG_DFL && fastmem_prev.sa_handler != SIG_IGN)
+	{
+		fastmem_prev.sa_handler(sig);
+		return;
+	}
+	/* the fault happens again and terminates the process */
+	signal(SIGSEGV, SIG_DFL);
+}
+
+static bool install_handler(void)
+{
+	if (fastmem_installed)
+		return true;
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = fastmem_fault;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGSEGV, &action, &fastmem_prev))
+		return false;
+	fastmem_installed = true;
+	return true;
+}
+
+static void fastmem_init(struct cpu_jit *jit)
+{
+	struct fastmem *fastmem = jit->cpu->mem->fastmem;
+	if (!fastmem)
+		return;
+	jit->sites = malloc(sizeof(*jit->sites) * JIT_SITES_MAX);
+	if (!jit->sites)
+		return;
+	lock_slots();
+	size_t i;
+	for (i = 0; i < JIT_FASTMEM_MAX; ++i)
+	{
+		if (!fastmem_slots[i].jit)
+			break;
+	}
+	if (i == JIT_FASTMEM_MAX || !install_handler())
+	{
+		unlock_slots();
+		printf("failed to install fastmem handler\n");
+		free(jit->sites);
+		jit->sites = NULL;
+		return;
+	}
+	__atomic_store_n(&fastmem_slots[i].jit, jit, __ATOMIC_RELEASE);
+	__atomic_store_n(&fastmem_slots[i].code, jit->code, __ATOMIC_RELEASE);
+	unlock_slots();
+	jit->view = fastmem->views[jit->cpu->arm9 ? 1 : 0];
+	jit->view_cycles = fastmem->cycles[jit->cpu->arm9 ? 1 : 0];
+}
+
+static void fastmem_fini(struct cpu_jit *jit)
+{
+	if (!jit->view)
+		return;
+	lock_slots();
+	for (size_t i = 0; i < JIT_FASTMEM_MAX; ++i)
+	{
+		if (fastmem_slots[i].jit != jit)
+			continue;
+		__atomic_store_n(&fastmem_slots[i].code, NULL, __ATOMIC_RELEASE);
+		__atomic_store_n(&fastmem_slots[i].jit, NULL, __ATOMIC_RELEASE);
+	}
+	unlock_slots();
+	free(jit->sites);
+}
+
+#endif
+
+struct cpu_jit *cpu_jit_new(struct cpu *cpu)
+{
+#if defined(__x86_64__)
+	struct cpu_jit *jit = calloc(sizeof(*jit), 1);
+	if (!jit)
+		return NULL;
+
+	jit->cpu = cpu;
+	jit->blocks = malloc(sizeof(*jit->blocks) * JIT_BLOCKS_MAX);
+	if (!jit->blocks)
+	{
+		free(jit);
+		return NULL;
+	}
+	jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+	                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->code == MAP_FAILED)
+	{
+		printf("failed to map jit memory\n");
+		free(jit->blocks);
+		free(jit);
+		return NULL;
+	}
+#ifdef ENABLE_FASTMEM
+	fastmem_init(jit);
+#endif
+	return jit;
+#else
+	(void)cpu;
+	return NULL;
+#endif
+}
+
+void cpu_jit_del(struct cpu_jit *jit)
+{
+	if (!jit)
+		return;
+#ifdef ENABLE_FASTMEM
+	fastmem_fini(jit);
+#endif
+	munmap(jit->code, JIT_CODE_SIZE);
+	free(jit->blocks);
+	free(jit);
+}
+
+void cpu_jit_flush(struct cpu_jit *jit)
+{
+	memset(jit->hash, 0, sizeof(jit->hash));
+	memset(jit->pages, 0, sizeof(jit->pages));
+	jit->blocks_nb = 0;
+	jit->code_pos = 0;
+	jit->sites_nb = 0;
+}
+
+void cpu_jit_invalidate(struct cpu_jit *jit, uint32_t page)
+{
+	struct jit_block *block = jit->pages[page];
+	jit->pages[page] = NULL;
+	for (; block; block = block->page_next)
+	{
+		struct jit_block **it = &jit->hash[block_hash(block->pc, block->mode, JIT_HASH_SIZE)];
+		while (*it != block)
+			it = &(*it)->hash_next;
+		*it = block->hash_next;
+	}
+}
+
+static void emit8(struct cpu_jit *jit, uint8_t v)
+{
+	*(jit->ptr++) = v;
+}
+
+static void emit32(struct cpu_jit *jit, uint32_t v)
+{
+	memcpy(jit->ptr, &v, 4);
+	jit->ptr += 4;
+}
+
+static void emit64(struct cpu_jit *jit, uint64_t v)
+{
+	memcpy(jit->ptr, &v, 8);
+	jit->ptr += 8;
+}
+
+static void emit_bytes(struct cpu_jit *jit, const uint8_t *data, size_t size)
+{
+	memcpy(jit->ptr, data, size);
+	jit->ptr += size;
+}
+
+/* op dword [rbx + off] with a 32 bits immediate */
+static void emit_mem_imm(struct cpu_jit *jit, uint8_t op, uint8_t modrm, uint32_t off, uint32_t v)
+{
+	emit8(jit, op);
+	emit8(jit, modrm);
+	emit32(jit, off);
+	emit32(jit, v);
+}
+
+/* op reg, dword [rbx + off] or op dword [rbx + off], reg */
+static void emit_mem_reg(struct cpu_jit *jit, uint8_t op, uint8_t reg, uint32_t off)
+{
+	emit8(jit, op);
+	emit8(jit, 0x83 | (reg << 3));
+	emit32(jit, off);
+}
+
+#define REG_EAX 0
+#define REG_ECX 1
+#define REG_EDX 2
+
+#define emit_store_imm(jit, off, v) emit_mem_imm(jit, 0xC7, 0x83, off, v) /* mov */
+#define emit_add_imm(jit, off, v)   emit_mem_imm(jit, 0x81, 0x83, off, v) /* add */
+#define emit_cmp_imm(jit, off, v)   emit_mem_imm(jit, 0x81, 0xBB, off, v) /* cmp */
+#define emit_load(jit, reg, off)    emit_mem_reg(jit, 0x8B, reg, off)     /* mov reg, [] */
+#define emit_store(jit, reg, off)   emit_mem_reg(jit, 0x89, reg, off)     /* mov [], reg */
+#define emit_or_load(jit, reg, off) emit_mem_reg(jit, 0x0B, reg, off)     /* or reg, [] */
+
+static void emit_prologue(struct cpu_jit *jit)
+{
+	static const uint8_t code[] =
+	{
+		0x53,             /* push rbx */
+		0x48, 0x89, 0xFB, /* mov rbx, rdi */
+	};
+	emit_bytes(jit, code, sizeof(code));
+}
+
+static void emit_epilogue(struct cpu_jit *jit)
+{
+	static const uint8_t code[] =
+	{
+		0x5B, /* pop rbx */
+		0xC3, /* ret */
+	};
+	emit_bytes(jit, code, sizeof(code));
+}
+
+/* leave the block if the last jcc condition isn't met */
+static void emit_exit_unless(struct cpu_jit *jit, uint8_t jcc)
+{
+	emit8(jit, jcc);
+	emit8(jit, 0x02);
+	emit_epilogue(jit);
+}
+
+static void emit_call(struct cpu_jit *jit, void (*fn)(struct cpu *cpu))
+{
+	static const uint8_t mov_rdi[] = {0x48, 0x89, 0xDF}; /* mov rdi, rbx */
+	static const uint8_t call_rax[] = {0xFF, 0xD0}; /* call rax */
+	emit_bytes(jit, mov_rdi, sizeof(mov_rdi));
+	emit8(jit, 0x48); /* mov rax, imm64 */
+	emit8(jit, 0xB8);
+	emit64(jit, (uint64_t)(uintptr_t)fn);
+	emit_bytes(jit, call_rax, sizeof(call_rax));
+}
+
+static void emit_handler(struct cpu_jit *jit, const struct cpu_instr *instr,
+                         uint32_t opcode, uint32_t next_pc, bool store)
+{
+	emit_store_imm(jit, OFF_OPCODE, opcode);
+	emit_call(jit, instr->exec);
+	emit_cmp_imm(jit, OFF_REG(CPU_REG_PC), next_pc);
+	emit_exit_unless(jit, 0x74); /* je */
+	if (store)
+	{
+		emit_load(jit, REG_EAX, OFF_STATE);
+		emit_or_load(jit, REG_EAX, OFF_EXIT);
+		emit_exit_unless(jit, 0x74); /* je */
+	}
+}
+
+/* leave the block before the instruction at pc once the cycles given by
+ * nds_cycles are used up
+ */
+static void emit_budget(struct cpu_jit *jit, uint32_t pc)
+{
+	emit_cmp_imm(jit, OFF_DELAY, 0);
+	emit8(jit, 0x7C); /* jl over the exit */
+	emit8(jit, 0x0C);
+	emit_store_imm(jit, OFF_REG(CPU_REG_PC), pc);
+	emit_epilogue(jit);
+}
+
+/* emit a jump taken when the arm condition fails, return the rel32 to patch */
+static uint8_t *emit_jcc32(struct cpu_jit *jit, uint8_t jcc)
+{
+	emit8(jit, 0x0F);
+	emit8(jit, jcc + 0x10);
+	uint8_t *rel = jit->ptr;
+	emit32(jit, 0);
+	return rel;
+}
+
+static void patch_rel32(uint8_t *rel, uint8_t *dst)
+{
+	int32_t v = dst - (rel + 4);
+	memcpy(rel, &v, 4);
+}
+
+static void emit_test_eax(struct cpu_jit *jit, uint32_t v)
+{
+	emit8(jit, 0xA9);
+	emit32(jit, v);
+}
+
+static void emit_nv_ecx(struct cpu_jit *jit)
+{
+	static const uint8_t code[] =
+	{
+		0x89, 0xC1,             /* mov ecx, eax */
+		0xC1, 0xE1, 0x03,       /* shl ecx, 3 */
+		0x31, 0xC1,             /* xor ecx, eax */
+		0xF7, 0xC1, 0x00, 0x00, /* test ecx, N */
+		0x00, 0x80,
+	};
+	emit_bytes(jit, code, sizeof(code));
+}
+
+static size_t emit_cond(struct cpu_jit *jit, uint32_t cond, uint8_t **fixups)
+{
+	emit_load(jit, REG_EAX, OFF_CPSR);
+	switch (cond)
+	{
+		case 0x0: /* EQ */
+			emit_test_eax(jit, CPU_FLAG_Z);
+			fixups[0] = emit_jcc32(jit, 0x74);
+			return 1;
+		case 0x1: /* NE */
+			emit_test_eax(jit, CPU_FLAG_Z);
+			fixups[0] = emit_jcc32(jit, 0x75);
+			return 1;
+		case 0x2: /* CS */
+			emit_test_eax(jit, CPU_FLAG_C);
+			fixups[0] = emit_jcc32(jit, 0x74);
+			return 1;
+		case 0x3: /* CC */
+			emit_test_eax(jit, CPU_FLAG_C);
+			fixups[0] = emit_jcc32(jit, 0x75);
+			return 1;
+		case 0x4: /* MI */
+			emit_test_eax(jit, CPU_FLAG_N);
+			fixups[0] = emit_jcc32(jit, 0x74);
+			return 1;
+		case 0x5: /* PL */
+			emit_test_eax(jit, CPU_FLAG_N);
+			fixups[0] = emit_jcc32(jit, 0x75);
+			return 1;
+		case 0x6: /* VS */
+			emit_test_eax(jit, CPU_FLAG_V);
+			fixups[0] = emit_jcc32(jit, 0x74);
+			return 1;
+		case 0x7: /* VC */
+			emit_test_eax(jit, CPU_FLAG_V);
+			fixups[0] = emit_jcc32(jit, 0x75);
+			return 1;
+		case 0x8: /* HI */
+		case 0x9: /* LS */
+			emit8(jit, 0x25); /* and eax, C | Z */
+			emit32(jit, CPU_FLAG_C | CPU_FLAG_Z);
+			emit8(jit, 0x3D); /* cmp eax, C */
+			emit32(jit, CPU_FLAG_C);
+			fixups[0] = emit_jcc32(jit, cond == 0x8 ? 0x75 : 0x74);
+			return 1;
+		case 0xA: /* GE */
+			emit_nv_ecx(jit);
+			fixups[0] = emit_jcc32(jit, 0x75);
+			return 1;
+		case 0xB: /* LT */
+			emit_nv_ecx(jit);
+			fixups[0] = emit_jcc32(jit, 0x74);
+			return 1;
+		case 0xC: /* GT */
+			emit_test_eax(jit, CPU_FLAG_Z);
+			fixups[0] = emit_jcc32(jit, 0x75);
+			emit_nv_ecx(jit);
+			fixups[1] = emit_jcc32(jit, 0x75);
+			return 2;
+		case 0xD: /* LE */
+		{
+			emit_test_eax(jit, CPU_FLAG_Z);
+			emit8(jit, 0x75); /* jne over the N != V test */
+			uint8_t *rel = jit->ptr;
+			emit8(jit, 0);
+			emit_nv_ecx(jit);
+			fixups[0] = emit_jcc32(jit, 0x74);
+			*rel = jit->ptr - (rel + 1);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static uint32_t reg_off(struct cpu_jit *jit, uint32_t reg)
+{
+	return (uint8_t*)jit->cpu->regs.rptr[reg] - (uint8_t*)jit->cpu;
+}
+
+/* data processing without flags, pc not involved */
+static bool emit_arm_alu(struct cpu_jit *jit, uint32_t opcode)
+{
+	if ((opcode >> 26) & 0x3)
+		return false;
+	if (opcode & (1 << 20))
+		return false;
+	uint32_t alu = (opcode >> 21) & 0xF;
+	uint32_t rd = (opcode >> 12) & 0xF;
+	uint32_t rn = (opcode >> 16) & 0xF;
+	switch (alu)
+	{
+		case 0x0: /* AND */
+		case 0x1: /* EOR */
+		case 0x2: /* SUB */
+		case 0x3: /* RSB */
+		case 0x4: /* ADD */
+		case 0xC: /* ORR */
+		case 0xE: /* BIC */
+			if (rn == CPU_REG_PC)
+				return false;
+			break;
+		case 0xD: /* MOV */
+		case 0xF: /* MVN */
+			break;
+		default:
+			return false;
+	}
+	if (rd == CPU_REG_PC)
+		return false;
+	if (opcode & (1 << 25))
+	{
+		uint32_t shift = ((opcode >> 8) & 0xF) * 2;
+		uint32_t v = opcode & 0xFF;
+		if (shift)
+			v = (v >> shift) | (v << (32 - shift));
+		emit8(jit, 0xB9); /* mov ecx, imm32 */
+		emit32(jit, v);
+	}
+	else
+	{
+		if (opcode & 0x10)
+			return false;
+		uint32_t rm = opcode & 0xF;
+		uint32_t shift = (opcode >> 7) & 0x1F;
+		if (rm == CPU_REG_PC)
+			return false;
+		if (((opcode >> 5) & 0x3) == 0x3 && !shift) /* RRX */
+			return false;
+		emit_load(jit, REG_ECX, reg_off(jit, rm));
+		switch ((opcode >> 5) & 0x3)
+		{
+			case 0x0: /* LSL */
+				if (!shift)
+					break;
+				emit8(jit, 0xC1);
+				emit8(jit, 0xE1);
+				emit8(jit, shift);
+				break;
+			case 0x1: /* LSR */
+				if (!shift)
+				{
+					emit8(jit, 0x31); /* xor ecx, ecx */
+					emit8(jit, 0xC9);
+					break;
+				}
+				emit8(jit, 0xC1);
+				emit8(jit, 0xE9);
+				emit8(jit, shift);
+				break;
+			case 0x2: /* ASR */
+				emit8(jit, 0xC1);
+				emit8(jit, 0xF9);
+				emit8(jit, shift ? shift : 31);
+				break;
+			case 0x3: /* ROR */
+				emit8(jit, 0xC1);
+				emit8(jit, 0xC9);
+				emit8(jit, shift);
+				break;
+		}
+	}
+	if (alu != 0xD && alu != 0xF)
+		emit_load(jit, REG_EAX, reg_off(jit, rn));
+	switch (alu)
+	{
+		case 0x0:
+			emit8(jit, 0x21); /* and eax, ecx */
+			emit8(jit, 0xC8);
+			break;
+		case 0x1:
+			emit8(jit, 0x31); /* xor eax, ecx */
+			emit8(jit, 0xC8);
+			break;
+		case 0x2:
+			emit8(jit, 0x29); /* sub eax, ecx */
+			emit8(jit, 0xC8);
+			break;
+		case 0x3:
+			emit8(jit, 0x29); /* sub ecx, eax */
+			emit8(jit, 0xC1);
+			emit8(jit, 0x89); /* mov eax, ecx */
+			emit8(jit, 0xC8);
+			break;
+		case 0x4:
+			emit8(jit, 0x01); /* add eax, ecx */
+			emit8(jit, 0xC8);
+			break;
+		case 0xC:
+			emit8(jit, 0x09); /* or eax, ecx */
+			emit8(jit, 0xC8);
+			break;
+		case 0xD:
+			emit8(jit, 0x89); /* mov eax, ecx */
+			emit8(jit, 0xC8);
+			break;
+		case 0xE:
+			emit8(jit, 0xF7); /* not ecx */
+			emit8(jit, 0xD1);
+			emit8(jit, 0x21); /* and eax, ecx */
+			emit8(jit, 0xC8);
+			break;
+		case 0xF:
+			emit8(jit, 0xF7); /* not ecx */
+			emit8(jit, 0xD1);
+			emit8(jit, 0x89); /* mov eax, ecx */
+			emit8(jit, 0xC8);
+			break;
+	}
+	emit_store(jit, REG_EAX, reg_off(jit, rd));
+	return true;
+}
+
+/* access at the guest address in ecx through the fastmem view, unaligned
+ * and faulting ones go to the interpreter handler
+ */
+static void emit_fastmem(struct cpu_jit *jit, const struct cpu_instr *instr, uint32_t opcode,
+                         uint32_t next_pc, uint32_t reg, uint8_t size, bool store, uint8_t delay)
+{
+	static const uint8_t wait_states[] =
+	{
+		0x89, 0xCA,             /* mov edx, ecx */
+		0xC1, 0xEA, 0x0C,       /* shr edx, 12 */
+	};
+	static const uint8_t movzx_edx[] = {0x0F, 0xB6, 0x14, 0x10}; /* movzx edx, byte [rax + rdx] */
+	uint8_t *unaligned = NULL;
+	if (size > 8)
+	{
+		emit8(jit, 0xF7); /* test ecx, size - 1 */
+		emit8(jit, 0xC1);
+		emit32(jit, size / 8 - 1);
+		unaligned = emit_jcc32(jit, 0x75);
+	}
+	if (store)
+		emit_load(jit, REG_EDX, reg);
+	emit8(jit, 0x48); /* mov rax, imm64 */
+	emit8(jit, 0xB8);
+	emit64(jit, (uint64_t)(uintptr_t)jit->view);
+	struct jit_site *site = &jit->sites[jit->sites_nb++];
+	site->code = jit->ptr - jit->code;
+	switch (size)
+	{
+		case 8:
+			if (store)
+				emit_bytes(jit, (const uint8_t[]){0x88, 0x14, 0x08}, 3); /* mov [rax + rcx], dl */
+			else
+				emit_bytes(jit, (const uint8_t[]){0x0F, 0xB6, 0x04, 0x08}, 4); /* movzx eax, byte [rax + rcx] */
+			break;
+		case 16:
+			if (store)
+				emit_bytes(jit, (const uint8_t[]){0x66, 0x89, 0x14, 0x08}, 4); /* mov [rax + rcx], dx */
+			else
+				emit_bytes(jit, (const uint8_t[]){0x0F, 0xB7, 0x04, 0x08}, 4); /* movzx eax, word [rax + rcx] */
+			break;
+		case 32:
+			if (store)
+				emit_bytes(jit, (const uint8_t[]){0x89, 0x14, 0x08}, 3); /* mov [rax + rcx], edx */
+			else
+				emit_bytes(jit, (const uint8_t[]){0x8B, 0x04, 0x08}, 3); /* mov eax, [rax + rcx] */
+			break;
+	}
+	if (!store)
+		emit_store(jit, REG_EAX, reg);
+	emit_bytes(jit, wait_states, sizeof(wait_states));
+	emit8(jit, 0x48); /* mov rax, imm64 */
+	emit8(jit, 0xB8);
+	emit64(jit, (uint64_t)(uintptr_t)jit->view_cycles[size / 16]);
+	emit_bytes(jit, movzx_edx, sizeof(movzx_edx));
+	if (delay)
+	{
+		emit8(jit, 0x83); /* add edx, imm8 */
+		emit8(jit, 0xC2);
+		emit8(jit, delay);
+	}
+	emit_mem_reg(jit, 0x01, REG_EDX, OFF_DELAY); /* add [], edx */
+	if (store)
+	{
+		emit_load(jit, REG_EAX, OFF_STATE);
+		emit_or_load(jit, REG_EAX, OFF_EXIT);
+		emit_exit_unless(jit, 0x74); /* je */
+	}
+	/* the guest registers are untouched until the access is done: the
+	 * handler runs the whole instruction again
+	 */
+	emit8(jit, 0xE9); /* jmp rel32 */
+	uint8_t *done = jit->ptr;
+	emit32(jit, 0);
+	site->slow = jit->ptr - jit->code;
+	if (unaligned)
+		patch_rel32(unaligned, jit->ptr);
+	emit_handler(jit, instr, opcode, next_pc, store);
+	patch_rel32(done, jit->ptr);
+}
+
+/* ldr / str / ldrb / strb with an immediate offset and no writeback */
+static bool emit_arm_mem(struct cpu_jit *jit, uint32_t pc, uint32_t opcode)
+{
+	if (!jit->view)
+		return false;
+	if ((opcode & 0x0E000000) != 0x04000000)
+		return false;
+	if (!(opcode & (1 << 24)) || (opcode & (1 << 21)))
+		return false;
+	uint32_t rd = (opcode >> 12) & 0xF;
+	uint32_t rn = (opcode >> 16) & 0xF;
+	if (rd == CPU_REG_PC)
+		return false;
+	uint32_t offset = opcode & 0xFFF;
+	if (!(opcode & (1 << 23)))
+		offset = -offset;
+	if (rn == CPU_REG_PC)
+	{
+		emit8(jit, 0xB9); /* mov ecx, imm32 */
+		emit32(jit, pc + 8 + offset);
+	}
+	else
+	{
+		emit_load(jit, REG_ECX, reg_off(jit, rn));
+		if (offset)
+		{
+			emit8(jit, 0x81); /* add ecx, imm32 */
+			emit8(jit, 0xC1);
+			emit32(jit, offset);
+		}
+	}
+	const struct cpu_instr *instr = cpu_instr_arm[((opcode >> 16) & 0xFF0) | ((opcode >> 4) & 0xF)];
+	emit_fastmem(jit, instr, opcode, pc + 4, reg_off(jit, rd),
+	             (opcode & (1 << 22)) ? 8 : 32, !(opcode & (1 << 20)), 0);
+	return true;
+}
+
+/* pc, sp and immediate offset relative ldr / str / ldrb / strb / ldrh / strh */
+static bool emit_thumb_mem(struct cpu_jit *jit, uint32_t pc, uint16_t opcode)
+{
+	if (!jit->view)
+		return false;
+	uint32_t rd;
+	uint8_t size;
+	switch (opcode >> 11)
+	{
+		case 0x09: /* ldr rd, [pc, #nn] */
+			rd = (opcode >> 8) & 0x7;
+			size = 32;
+			emit8(jit, 0xB9); /* mov ecx, imm32 */
+			emit32(jit, ((pc + 4) & ~2) + (opcode & 0xFF) * 4);
+			break;
+		case 0x0C: /* str / ldr rd, [rb, #nn] */
+		case 0x0D:
+		case 0x0E: /* strb / ldrb rd, [rb, #nn] */
+		case 0x0F:
+		case 0x10: /* strh / ldrh rd, [rb, #nn] */
+		case 0x11:
+		{
+			static const uint8_t sizes[] = {32, 8, 16};
+			rd = opcode & 0x7;
+			size = sizes[((opcode >> 11) - 0x0C) / 2];
+			emit_load(jit, REG_ECX, reg_off(jit, (opcode >> 3) & 0x7));
+			emit8(jit, 0x81); /* add ecx, imm32 */
+			emit8(jit, 0xC1);
+			emit32(jit, ((opcode >> 6) & 0x1F) * (size / 8));
+			break;
+		}
+		case 0x12: /* str / ldr rd, [sp, #nn] */
+		case 0x13:
+			rd = (opcode >> 8) & 0x7;
+			size = 32;
+			emit_load(jit, REG_ECX, reg_off(jit, CPU_REG_SP));
+			emit8(jit, 0x81); /* add ecx, imm32 */
+			emit8(jit, 0xC1);
+			emit32(jit, (opcode & 0xFF) * 4);
+			break;
+		default:
+			return false;
+	}
+	bool store = !(opcode & (1 << 11));
+	emit_fastmem(jit, cpu_instr_thumb[opcode >> 6], opcode, pc + 2,
+	             reg_off(jit, rd), size, store, store ? 0 : 1);
+	return true;
+}
+
+static void emit_arm(struct cpu_jit *jit, uint32_t pc, uint32_t opcode)
+{
+	if (opcode >> 25 == 0x7D)
+	{
+		emit_handler(jit, cpu_instr_blx_imm, opcode, pc + 4, false);
+		return;
+	}
+	uint32_t cond = opcode >> 28;
+	if (cond == 0xF)
+		return;
+	uint8_t *fixups[2];
+	size_t fixups_nb = 0;
+	if (cond != 0xE)
+		fixups_nb = emit_cond(jit, cond, fixups);
+	if (!emit_arm_alu(jit, opcode) && !emit_arm_mem(jit, pc, opcode))
+	{
+		const struct cpu_instr *instr = cpu_instr_arm[((opcode >> 16) & 0xFF0) | ((opcode >> 4) & 0xF)];
+		emit_handler(jit, instr, opcode, pc + 4, block_arm_store(opcode));
+	}
+	for (size_t i = 0; i < fixups_nb; ++i)
+		patch_rel32(fixups[i], jit->ptr);
+}
+
+static void emit_thumb(struct cpu_jit *jit, uint32_t pc, uint16_t opcode)
+{
+	if (emit_thumb_mem(jit, pc, opcode))
+		return;
+	emit_handler(jit, cpu_instr_thumb[opcode >> 6], opcode, pc + 2,
+	             block_thumb_store(opcode));
+}
+
+static struct jit_block *compile(struct cpu_jit *jit, uint32_t pc, uint32_t mode)
+{
+	struct cpu *cpu = jit->cpu;
+	uint32_t addr = block_code_addr(cpu, pc);
+	if (addr == MEM_CODE_NONE)
+		return NULL;
+	if (jit->blocks_nb == JIT_BLOCKS_MAX
+	 || jit->code_pos + JIT_BLOCK_CODE > JIT_CODE_SIZE
+	 || jit->sites_nb + BLOCK_INSTR_MAX > JIT_SITES_MAX)
+		cpu_jit_flush(jit);
+	uint32_t page = addr >> MEM_CODE_PAGE_SHIFT;
+	uint32_t page_end = (pc | ((1 << MEM_CODE_PAGE_SHIFT) - 1)) + 1;
+	struct jit_block *block = &jit->blocks[jit->blocks_nb++];
+	block->pc = pc;
+	block->mode = mode;
+	block->code = (void (*)(struct cpu*))&jit->code[jit->code_pos];
+	jit->ptr = &jit->code[jit->code_pos];
+	emit_prologue(jit);
+	bool thumb = mode & CPU_FLAG_T;
+	bool has_next = false;
+	uint16_t next = 0;
+	struct block_idle idle = {0};
+	bool idle_ok = true;
+	block->idle = false;
+	for (size_t i = 0; i < BLOCK_INSTR_MAX && pc < page_end; ++i)
+	{
+		int32_t cycles;
+		bool end;
+		if (thumb)
+		{
+			uint16_t opcode;
+			if (has_next)
+			{
+				opcode = next;
+				has_next = false;
+				cycles = 0;
+			}
+			else if (pc & 2)
+			{
+				opcode = block_fetch(cpu, pc, 16, &cycles);
+			}
+			else
+			{
+				uint32_t v = block_fetch(cpu, pc, 32, &cycles);
+				opcode = v & 0xFFFF;
+				next = v >> 16;
+				has_next = true;
+			}
+			if (i) /* the first instruction is the cpu_cycle call itself */
+			{
+				/* not between the two halves of a word fetch */
+				if (!(pc & 2))
+					emit_budget(jit, pc);
+				cycles++;
+			}
+			if (cycles)
+				emit_add_imm(jit, OFF_DELAY, cycles);
+			emit_store_imm(jit, OFF_REG(CPU_REG_PC), pc);
+			emit_thumb(jit, pc, opcode);
+			end = block_thumb_end(opcode);
+			if (end)
+				block->idle = idle_ok && block_idle_end(&idle, opcode, pc - block->pc, true);
+			else if (idle_ok)
+				idle_ok = block_idle_thumb(&idle, opcode);
+			pc += 2;
+		}
+		else
+		{
+			uint32_t opcode = block_fetch(cpu, pc, 32, &cycles);
+			if (i) /* the first instruction is the cpu_cycle call itself */
+			{
+				emit_budget(jit, pc);
+				cycles++;
+			}
+			if (cycles)
+				emit_add_imm(jit, OFF_DELAY, cycles);
+			emit_store_imm(jit, OFF_REG(CPU_REG_PC), pc);
+			emit_arm(jit, pc, opcode);
+			end = block_arm_end(opcode);
+			if (end)
+				block->idle = idle_ok && block_idle_end(&idle, opcode, pc - block->pc, false);
+			else if (idle_ok)
+				idle_ok = block_idle_arm(&idle, opcode);
+			pc += 4;
+		}
+		if (end)
+			break;
+	}
+	emit_store_imm(jit, OFF_REG(CPU_REG_PC), pc);
+	emit_epilogue(jit);
+	jit->code_pos = jit->ptr - jit->code;
+	jit->code_pos = (jit->code_pos + 15) & ~15;
+	uint32_t key = block_hash(block->pc, mode, JIT_HASH_SIZE);
+	block->hash_next = jit->hash[key];
+	jit->hash[key] = block;
+	block->page_next = jit->pages[page];
+	jit->pages[page] = block;
+	mem_code_add(cpu->mem, page);
+	return block;
+}
+
+bool cpu_jit_run(struct cpu_jit *jit)
+{
+	struct cpu *cpu = jit->cpu;
+	uint32_t pc = cpu_get_reg(cpu, CPU_REG_PC);
+	uint32_t mode = cpu->regs.cpsr & 0x3F;
+	struct jit_block *block = jit->hash[block_hash(pc, mode, JIT_HASH_SIZE)];
+	while (block && (block->pc != pc || block->mode != mode))
+		block = block->hash_next;
+	if (!block)
+	{
+		block = compile(jit, pc, mode);
+		if (!block)
+			return false;
+	}
+	cpu->has_next_thumb = 0;
+	cpu->block_exit = 0;
+	cpu->idle_veto = 0;
+	block->code(cpu);
+	if (block->idle && cpu->regs.r[CPU_REG_PC] == block->pc && !cpu->idle_veto)
+		cpu->idle = 1;
+	return true;
+}
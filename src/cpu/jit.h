@@ -0,0 +1,17 @@
+#ifndef CPU_JIT_H
+#define CPU_JIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct cpu;
+struct cpu_jit;
+
+struct cpu_jit *cpu_jit_new(struct cpu *cpu);
+void cpu_jit_del(struct cpu_jit *jit);
+
+bool cpu_jit_run(struct cpu_jit *jit);
+void cpu_jit_invalidate(struct cpu_jit *jit, uint32_t page);
+void cpu_jit_flush(struct cpu_jit *jit);
+
+#endif
@@ -1,6 +1,7 @@
 #include "instr.h"
 #include "../cpu.h"
 #include "../mem.h"
+#include "../bios.h"
 
 #include <inttypes.h>
 #include <stdint.h>
@@ -922,6 +923,11 @@ THUMB_BRANCH(ble, CPU_GET_FLAG_Z(cpu) || CPU_GET_FLAG_N(cpu) != CPU_GET_FLAG_V(c
 
 THUMB_INSTR(swi,
 {
+	if (cpu->hle_bios && bios_swi(cpu, cpu->instr_opcode & 0xFF))
+	{
+		cpu_inc_pc(cpu, 2);
+		return;
+	}
 	cpu->regs.spsr_modes[1] = cpu->regs.cpsr;
 	CPU_SET_MODE(cpu, CPU_MODE_SVC);
 	cpu_update_mode(cpu);
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+
+#include "fastmem.h"
+#include "mem.h"
+
+#include <sys/mman.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * host mmu backed address spaces
+ *
+ * mram, wram, tcm and vram live in a memfd, mapped over the arrays of
+ * struct mem and inside a 4GB reservation per cpu following the page
+ * tables, so the jit can reach guest memory with a single host access
+ * everything else is left unmapped: accesses fault and the jit replays
+ * them on the slow path
+ * host pages holding cached code are mapped read-only to keep stores
+ * invalidating blocks, and so are pages the page tables send stores of
+ * to the slow path
+ */
+
+#define VIEW_SIZE      (1ULL << 32)
+#define CODE_VIEW_END  0x4000000 /* itcm, mram and wram: the only pages with a code address */
+#define CODE_SUBPAGES  (1 << (MEM_PAGE_SHIFT - MEM_CODE_PAGE_SHIFT))
+
+/* give back private memory to the first nb arrays aliased by the memfd
+ * (their content is lost)
+ */
+static void unalias(struct fastmem *fastmem, size_t nb)
+{
+	for (size_t i = 0; i < nb; ++i)
+	{
+		const struct fastmem_range *range = &fastmem->ranges[i];
+		if (mmap(range->ptr, range->size, PROT_READ | PROT_WRITE,
+		         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+			printf("failed to unmap fastmem memfd\n");
+	}
+}
+
+struct fastmem *fastmem_new(struct mem *mem)
+{
+	struct fastmem *fastmem = calloc(sizeof(*fastmem), 1);
+	if (!fastmem)
+		return NULL;
+
+	fastmem->mem = mem;
+	fastmem->fd = -1;
+	fastmem->ranges[0] = (struct fastmem_range){mem->mram, sizeof(mem->mram), 0};
+	fastmem->ranges[1] = (struct fastmem_range){mem->wram, sizeof(mem->wram), 0};
+	fastmem->ranges[2] = (struct fastmem_range){mem->arm7_wram, sizeof(mem->arm7_wram), 0};
+	fastmem->ranges[3] = (struct fastmem_range){mem->itcm, sizeof(mem->itcm), 0};
+	fastmem->ranges[4] = (struct fastmem_range){mem->dtcm, sizeof(mem->dtcm), 0};
+	fastmem->ranges[5] = (struct fastmem_range){mem->vram, sizeof(mem->vram), 0};
+	uint32_t size = 0;
+	for (size_t i = 0; i < FASTMEM_RANGES; ++i)
+	{
+		fastmem->ranges[i].offset = size;
+		size += fastmem->ranges[i].size;
+	}
+
+	for (size_t i = 0; i < 2; ++i)
+	{
+		fastmem->views[i] = mmap(NULL, VIEW_SIZE, PROT_NONE,
+		                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (fastmem->views[i] == MAP_FAILED)
+		{
+			printf("failed to reserve fastmem view\n");
+			fastmem->views[i] = NULL;
+			goto err;
+		}
+	}
+
+	fastmem->fd = memfd_create("emu_nds", MFD_CLOEXEC);
+	if (fastmem->fd == -1)
+	{
+		printf("failed to create fastmem memfd\n");
+		goto err;
+	}
+	if (ftruncate(fastmem->fd, size))
+	{
+		printf("failed to resize fastmem memfd\n");
+		goto err;
+	}
+
+	/* mem was just allocated: nothing to preserve in the arrays */
+	for (size_t i = 0; i < FASTMEM_RANGES; ++i)
+	{
+		const struct fastmem_range *range = &fastmem->ranges[i];
+		if (mmap(range->ptr, range->size, PROT_READ | PROT_WRITE,
+		         MAP_SHARED | MAP_FIXED, fastmem->fd, range->offset) == MAP_FAILED)
+		{
+			printf("failed to map fastmem memfd\n");
+			unalias(fastmem, i);
+			goto err;
+		}
+	}
+	return fastmem;
+
+err:
+	for (size_t i = 0; i < 2; ++i)
+	{
+		if (fastmem->views[i])
+			munmap(fastmem->views[i], VIEW_SIZE);
+	}
+	if (fastmem->fd != -1)
+		close(fastmem->fd);
+	free(fastmem);
+	return NULL;
+}
+
+void fastmem_del(struct fastmem *fastmem)
+{
+	if (!fastmem)
+		return;
+	/* mem goes back to the allocator once we're done */
+	unalias(fastmem, FASTMEM_RANGES);
+	for (size_t i = 0; i < 2; ++i)
+		munmap(fastmem->views[i], VIEW_SIZE);
+	close(fastmem->fd);
+	free(fastmem);
+}
+
+/* memfd offset of the page, -1 if it has to go through the slow path */
+static int64_t page_offset(struct fastmem *fastmem, const struct mem_page *page, int *prot)
+{
+	if (!page->ptr || page->mask != MEM_PAGE_MASK)
+		return -1;
+	for (size_t i = 0; i < FASTMEM_RANGES; ++i)
+	{
+		const struct fastmem_range *range = &fastmem->ranges[i];
+		if (page->ptr < range->ptr || page->ptr >= range->ptr + range->size)
+			continue;
+		/* stores without a host pointer must reach the slow path */
+		if (!page->write || (page->code != MEM_CODE_NONE && fastmem->code[page->code >> MEM_PAGE_SHIFT]))
+			*prot = PROT_READ;
+		else
+			*prot = PROT_READ | PROT_WRITE;
+		return range->offset + (page->ptr - range->ptr);
+	}
+	return -1;
+}
+
+void fastmem_update(struct fastmem *fastmem, bool arm9, uint32_t start, uint32_t end)
+{
+	const struct mem_page *pages = arm9 ? fastmem->mem->arm9_pages : fastmem->mem->arm7_pages;
+	uint8_t *view = fastmem->views[arm9];
+	for (uint32_t addr = start; addr < end; addr += MEM_PAGE_SIZE)
+	{
+		const struct mem_page *page = &pages[addr >> MEM_PAGE_SHIFT];
+		for (size_t i = 0; i < 3; ++i)
+			fastmem->cycles[arm9][i][addr >> MEM_PAGE_SHIFT] = page->ptr ? mem_wait_cycles[page->wait][i][MEM_DATA_NSEQ] : 0;
+	}
+	uint32_t addr = start;
+	while (addr < end)
+	{
+		/* one mapping for each run of pages contiguous in the memfd */
+		int prot = PROT_NONE;
+		int64_t offset = page_offset(fastmem, &pages[addr >> MEM_PAGE_SHIFT], &prot);
+		uint32_t run = addr + MEM_PAGE_SIZE;
+		while (run < end)
+		{
+			int run_prot = PROT_NONE;
+			int64_t run_offset = page_offset(fastmem, &pages[run >> MEM_PAGE_SHIFT], &run_prot);
+			if (offset == -1 ? run_offset != -1 : (run_offset != offset + (run - addr) || run_prot != prot))
+				break;
+			run += MEM_PAGE_SIZE;
+		}
+		void *ptr;
+		if (offset == -1)
+			ptr = mmap(&view[addr], run - addr, PROT_NONE,
+			           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+		else
+			ptr = mmap(&view[addr], run - addr, prot,
+			           MAP_SHARED | MAP_FIXED, fastmem->fd, offset);
+		if (ptr == MAP_FAILED)
+			printf("failed to map fastmem view [%08" PRIx32 "-%08" PRIx32 "]\n", addr, run);
+		addr = run;
+	}
+}
+
+static void protect(struct fastmem *fastmem, uint32_t code, int prot)
+{
+	for (size_t i = 0; i < 2; ++i)
+	{
+		const struct mem_page *pages = i ? fastmem->mem->arm9_pages : fastmem->mem->arm7_pages;
+		for (uint32_t addr = 0; addr < CODE_VIEW_END; addr += MEM_PAGE_SIZE)
+		{
+			const struct mem_page *page = &pages[addr >> MEM_PAGE_SHIFT];
+			if (page->write && page->code == code)
+				mprotect(&fastmem->views[i][addr], MEM_PAGE_SIZE, prot);
+		}
+	}
+}
+
+void fastmem_code_add(struct fastmem *fastmem, uint32_t page)
+{
+	uint32_t host_page = page / CODE_SUBPAGES;
+	if (fastmem->code[host_page])
+		return;
+	fastmem->code[host_page] = 1;
+	protect(fastmem, host_page << MEM_PAGE_SHIFT, PROT_READ);
+}
+
+void fastmem_code_del(struct fastmem *fastmem, uint32_t page)
+{
+	uint32_t host_page = page / CODE_SUBPAGES;
+	if (!fastmem->code[host_page])
+		return;
+	for (uint32_t i = 0; i < CODE_SUBPAGES; ++i)
+	{
+		if (fastmem->mem->code_pages[host_page * CODE_SUBPAGES + i])
+			return;
+	}
+	fastmem->code[host_page] = 0;
+	protect(fastmem, host_page << MEM_PAGE_SHIFT, PROT_READ | PROT_WRITE);
+}
@@ -0,0 +1,35 @@
+#ifndef FASTMEM_H
+#define FASTMEM_H
+
+#include "mem.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FASTMEM_RANGES 6
+
+struct fastmem_range
+{
+	uint8_t *ptr;
+	uint32_t size;
+	uint32_t offset; /* offset in the memfd */
+};
+
+struct fastmem
+{
+	struct mem *mem;
+	int fd;
+	uint8_t *views[2]; /* 4GB address spaces of the arm7 and the arm9 */
+	struct fastmem_range ranges[FASTMEM_RANGES];
+	uint8_t cycles[2][3][MEM_PAGES]; /* MEM_DATA_NSEQ wait states of 8, 16 and 32 bits accesses */
+	uint8_t code[MEM_CODE_SIZE >> MEM_PAGE_SHIFT]; /* host pages write protected for cached code */
+};
+
+struct fastmem *fastmem_new(struct mem *mem);
+void fastmem_del(struct fastmem *fastmem);
+
+void fastmem_update(struct fastmem *fastmem, bool arm9, uint32_t start, uint32_t end);
+void fastmem_code_add(struct fastmem *fastmem, uint32_t page);
+void fastmem_code_del(struct fastmem *fastmem, uint32_t page);
+
+#endif
@@ -8,6 +8,17 @@
 #include <string.h>
 #include <stdio.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define GPU_AVX2
+#endif
+
+#if defined(__GNUC__)
+#define FORCE_INLINE inline __attribute__((always_inline))
+#else
+#define FORCE_INLINE inline
+#endif
+
 #define TRANSFORM_INT28(n) \
 do \
 { \
@@ -61,6 +72,27 @@ enum layer_type
 	LAYER_OBJ,
 };
 
+/* counters of a band, added to the gpu ones once it's drawn */
+struct band_counts
+{
+	uint64_t pixels;
+	uint64_t hiz_tiles;
+	uint64_t hiz_spans;
+	uint64_t hiz_pixels;
+};
+
+/* screen rectangle (in pixels, right and bottom excluded) a polygon is
+ * drawn in
+ */
+struct tile
+{
+	int32_t left;
+	int32_t right;
+	int32_t top;
+	int32_t bottom;
+	struct band_counts *counts;
+};
+
 struct line_buff
 {
 	uint8_t bg0[256 * 4];
@@ -77,6 +109,10 @@ struct gpu *gpu_new(struct mem *mem)
 		return NULL;
 
 	gpu->mem = mem;
+#ifdef GPU_AVX2
+	gpu->avx2 = __builtin_cpu_supports("avx2")
+	         && __builtin_cpu_supports("fma");
+#endif
 	gpu->enga.reg_base = 0;
 	gpu->enga.pal_base = 0;
 	gpu->enga.oam_base = 0;
@@ -97,9 +133,23 @@ struct gpu *gpu_new(struct mem *mem)
 	gpu->engb.get_vram_obj16 = mem_vram_objb_get16;
 	gpu->engb.get_vram_obj32 = mem_vram_objb_get32;
 	gpu->engb.engb = 1;
+	for (size_t i = 0; i < 2; ++i)
+	{
+		struct gpu_g3d_buf *buf = &gpu->g3d.bufs[i];
+		buf->vertexes = calloc(sizeof(*buf->vertexes), GPU_VERTEXES);
+		buf->polygons = calloc(sizeof(*buf->polygons), GPU_POLYGONS);
+		if (!buf->vertexes || !buf->polygons)
+		{
+			gpu_del(gpu);
+			return NULL;
+		}
+	}
 	gpu->g3d.front = &gpu->g3d.bufs[0];
 	gpu->g3d.back = &gpu->g3d.bufs[1];
+	for (size_t i = 0; i < 4; ++i)
+		gpu->g3d.strip_ids[i] = -1;
 	gpu->g3d.position.w = 1 << 12;
+	gpu->g3d.clip_dirty = 1;
 	gpu->g3d.viewport_left = 0;
 	gpu->g3d.viewport_top = 0;
 	gpu->g3d.viewport_right = 255;
@@ -111,34 +161,142 @@ void gpu_del(struct gpu *gpu)
 {
 	if (!gpu)
 		return;
+	free(gpu->bins);
+	for (size_t i = 0; i < 2; ++i)
+	{
+		free(gpu->g3d.bufs[i].vertexes);
+		free(gpu->g3d.bufs[i].polygons);
+	}
+	for (size_t i = 0; i < GPU_TEX_CACHE; ++i)
+		free(gpu->tex_cache[i].data);
 	free(gpu);
 }
 
-static inline uint32_t eng_get_reg8(struct gpu *gpu, struct gpu_eng *eng, uint32_t reg)
+/* lines are drawn from the registers latched for them, never the live ones */
+static inline struct gpu_eng_line *eng_line(struct gpu *gpu, struct gpu_eng *eng, uint8_t y)
+{
+	return &gpu->lines[y].eng[eng->engb];
+}
+
+static inline uint32_t eng_get_reg8(struct gpu *gpu, struct gpu_eng *eng, uint8_t y, uint32_t reg)
 {
-	return mem_arm9_get_reg8(gpu->mem, reg + eng->reg_base);
+	return eng_line(gpu, eng, y)->regs[reg];
 }
 
-static inline uint32_t eng_get_reg16(struct gpu *gpu, struct gpu_eng *eng, uint32_t reg)
+static inline uint32_t eng_get_reg16(struct gpu *gpu, struct gpu_eng *eng, uint8_t y, uint32_t reg)
 {
-	return mem_arm9_get_reg16(gpu->mem, reg + eng->reg_base);
+	return *(uint16_t*)&eng_line(gpu, eng, y)->regs[reg];
 }
 
-static inline uint32_t eng_get_reg32(struct gpu *gpu, struct gpu_eng *eng, uint32_t reg)
+static inline uint32_t eng_get_reg32(struct gpu *gpu, struct gpu_eng *eng, uint8_t y, uint32_t reg)
 {
-	return mem_arm9_get_reg32(gpu->mem, reg + eng->reg_base);
+	return *(uint32_t*)&eng_line(gpu, eng, y)->regs[reg];
+}
+
+#ifdef GPU_AVX2
+__attribute__((target("avx2")))
+static void fill32_avx2(uint32_t *dst, uint32_t v, size_t n)
+{
+	__m256i vv = _mm256_set1_epi32(v);
+	for (size_t i = 0; i < n; i += 8)
+		_mm256_storeu_si256((__m256i*)&dst[i], vv);
+}
+#endif
+
+/* n is a multiple of 8 */
+static void fill32(struct gpu *gpu, uint32_t *dst, uint32_t v, size_t n)
+{
+#ifdef GPU_AVX2
+	if (gpu->avx2)
+	{
+		fill32_avx2(dst, v, n);
+		return;
+	}
+#endif
+	for (size_t i = 0; i < n; ++i)
+		dst[i] = v;
+}
+
+/* the clear of a 3d buffer is deferred: the rows of a tile are cleared
+ * before the first polygon is drawn on them, and the ones nothing was
+ * drawn on are made up when the buffer is read
+ */
+static void get_clear_span(struct gpu *gpu, const struct gpu_g3d_buf *buf,
+                           uint32_t row, uint32_t left, uint32_t right,
+                           uint8_t *data)
+{
+	if (!buf->clear_image)
+	{
+		uint8_t clearv[4];
+		clearv[0] = TO8((buf->clear_color >> 0x0A) & 0x1F);
+		clearv[1] = TO8((buf->clear_color >> 0x05) & 0x1F);
+		clearv[2] = TO8((buf->clear_color >> 0x00) & 0x1F);
+		clearv[3] = (buf->clear_color >> 0x10) & 0x1F;
+		fill32(gpu, (uint32_t*)data, *(uint32_t*)&clearv[0], right - left);
+		return;
+	}
+	memcpy(data, &gpu->clear_data[(256 * row + left) * 4], (right - left) * 4);
+}
+
+/* CLEAR_DEPTH isn't used: it has no equivalent in the unnormalized z of
+ * the depth buffer
+ */
+static void clear_tile(struct gpu *gpu, struct gpu_g3d_buf *buf,
+                       uint32_t tx, uint32_t top, uint32_t bottom)
+{
+	uint32_t left = tx * GPU_TILE_SIZE;
+	for (uint32_t row = top; row < bottom; ++row)
+	{
+		if (buf->cleared[row] & (1 << tx))
+			continue;
+		get_clear_span(gpu, buf, row, left, left + GPU_TILE_SIZE,
+		               &buf->data[(256 * row + left) * 4]);
+		buf->cleared[row] |= 1 << tx;
+		if (buf->clear_image)
+		{
+			memcpy(&buf->zbuf[256 * row + left], &gpu->clear_zbuf[256 * row + left],
+			       GPU_TILE_SIZE * sizeof(*buf->zbuf));
+			buf->hiz_dirty[row] |= 1 << tx;
+			continue;
+		}
+		fill32(gpu, (uint32_t*)&buf->zbuf[256 * row + left], INT32_MAX,
+		       GPU_TILE_SIZE);
+		buf->hiz[row * GPU_TILES_X + tx] = INT32_MAX;
+		buf->hiz_dirty[row] &= ~(1 << tx);
+	}
+}
+
+/* a row of the front 3d buffer, tmp holds it when it's partly cleared */
+static const uint8_t *get_g3d_row(struct gpu *gpu, uint32_t row, uint8_t *tmp)
+{
+	const struct gpu_g3d_buf *buf = gpu->g3d.front;
+	const uint8_t *data = &buf->data[256 * row * 4];
+	if (buf->cleared[row] == (1 << GPU_TILES_X) - 1)
+		return data;
+	for (uint32_t tx = 0; tx < GPU_TILES_X; ++tx)
+	{
+		uint32_t left = tx * GPU_TILE_SIZE;
+		if (buf->cleared[row] & (1 << tx))
+			memcpy(&tmp[left * 4], &data[left * 4], GPU_TILE_SIZE * 4);
+		else
+			get_clear_span(gpu, buf, row, left, left + GPU_TILE_SIZE,
+			               &tmp[left * 4]);
+	}
+	return tmp;
 }
 
 static void draw_background_3d(struct gpu *gpu, struct gpu_eng *eng,
                                uint8_t y, uint8_t bg, uint8_t *data)
 {
-	uint16_t bghofs = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG0HOFS + bg * 4) & 0x1FF;
+	uint16_t bghofs = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG0HOFS + bg * 4) & 0x1FF;
+	uint8_t tmp[256 * 4];
+	const uint8_t *src = get_g3d_row(gpu, 191 - y, tmp);
 	for (uint32_t x = 0; x < 256; ++x)
 	{
 		uint32_t xx = (bghofs + x) % 512;
 		if (xx >= 256)
 			continue;
-		*(uint32_t*)&data[x * 4] = *(uint32_t*)&gpu->g3d.front->data[((191 - y) * 256 + xx) * 4];
+		*(uint32_t*)&data[x * 4] = *(uint32_t*)&src[xx * 4];
 	}
 }
 
@@ -147,10 +305,10 @@ static void draw_background_text(struct gpu *gpu, struct gpu_eng *eng,
 {
 	static const uint32_t mapwidths[]  = {32 * 8, 64 * 8, 32 * 8, 64 * 8};
 	static const uint32_t mapheights[] = {32 * 8, 32 * 8, 64 * 8, 64 * 8};
-	uint32_t dispcnt = eng_get_reg32(gpu, eng, MEM_ARM9_REG_DISPCNT);
-	uint16_t bgcnt = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG0CNT + bg * 2);
-	uint16_t bghofs = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG0HOFS + bg * 4) & 0x1FF;
-	uint16_t bgvofs = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG0VOFS + bg * 4) & 0x1FF;
+	uint32_t dispcnt = eng_get_reg32(gpu, eng, y, MEM_ARM9_REG_DISPCNT);
+	uint16_t bgcnt = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG0CNT + bg * 2);
+	uint16_t bghofs = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG0HOFS + bg * 4) & 0x1FF;
+	uint16_t bgvofs = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG0VOFS + bg * 4) & 0x1FF;
 	uint32_t ext_pal_base = 0x2000 * bg;
 	if (bg < 2)
 		ext_pal_base += 0x4000 * ((bgcnt >> 13) & 0x1);
@@ -250,9 +408,9 @@ static void draw_background_affine(struct gpu *gpu, struct gpu_eng *eng,
 {
 	(void)y;
 	static const uint32_t mapsizes[]  = {16 * 8, 32 * 8, 64 * 8, 128 * 8};
-	uint16_t bgcnt = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG0CNT + bg * 2);
+	uint16_t bgcnt = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG0CNT + bg * 2);
 	uint8_t size = (bgcnt >> 14) & 0x3;
-	uint32_t dispcnt = eng_get_reg32(gpu, eng, MEM_ARM9_REG_DISPCNT);
+	uint32_t dispcnt = eng_get_reg32(gpu, eng, y, MEM_ARM9_REG_DISPCNT);
 	uint32_t tilebase = ((bgcnt >> 2) & 0xF) * 0x4000;
 	uint32_t mapbase = ((bgcnt >> 8) & 0x1F) * 0x800;
 	if (!eng->engb)
@@ -266,10 +424,10 @@ static void draw_background_affine(struct gpu *gpu, struct gpu_eng *eng,
 		overflow = (bgcnt >> 13) & 0x1;
 	else
 		overflow = 0;
-	int16_t pa = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG2PA + 0x10 * (bg - 2));
-	int16_t pc = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG2PC + 0x10 * (bg - 2));
-	int32_t bgx = bg == 2 ? eng->bg2x : eng->bg3x;
-	int32_t bgy = bg == 2 ? eng->bg2y : eng->bg3y;
+	int16_t pa = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG2PA + 0x10 * (bg - 2));
+	int16_t pc = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG2PC + 0x10 * (bg - 2));
+	int32_t bgx = bg == 2 ? eng_line(gpu, eng, y)->bg2x : eng_line(gpu, eng, y)->bg3x;
+	int32_t bgy = bg == 2 ? eng_line(gpu, eng, y)->bg2y : eng_line(gpu, eng, y)->bg3y;
 	for (int32_t x = 0; x < 256; ++x)
 	{
 		int32_t vx = bgx / 256;
@@ -314,11 +472,11 @@ static void draw_background_ext_direct(struct gpu *gpu, struct gpu_eng *eng,
 	(void)y;
 	static const uint32_t mapwidths[]  = {128, 256, 512, 512};
 	static const uint32_t mapheights[] = {128, 256, 256, 512};
-	uint16_t bgcnt = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG0CNT + bg * 2);
-	int16_t pa = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG2PA + 0x10 * (bg - 2));
-	int16_t pc = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG2PC + 0x10 * (bg - 2));
-	int32_t bgx = bg == 2 ? eng->bg2x : eng->bg3x;
-	int32_t bgy = bg == 2 ? eng->bg2y : eng->bg3y;
+	uint16_t bgcnt = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG0CNT + bg * 2);
+	int16_t pa = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG2PA + 0x10 * (bg - 2));
+	int16_t pc = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG2PC + 0x10 * (bg - 2));
+	int32_t bgx = bg == 2 ? eng_line(gpu, eng, y)->bg2x : eng_line(gpu, eng, y)->bg3x;
+	int32_t bgy = bg == 2 ? eng_line(gpu, eng, y)->bg2y : eng_line(gpu, eng, y)->bg3y;
 	uint32_t baseaddr = ((bgcnt >> 8) & 0x1F) * 0x4000;
 	uint32_t size = (bgcnt >> 14) & 0x3;
 	uint32_t mapwidth = mapwidths[size];
@@ -363,11 +521,11 @@ static void draw_background_ext_paletted(struct gpu *gpu, struct gpu_eng *eng,
 	(void)y;
 	static const uint32_t mapwidths[]  = {128, 256, 512, 512};
 	static const uint32_t mapheights[] = {128, 256, 256, 512};
-	uint16_t bgcnt = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG0CNT + bg * 2);
-	int16_t pa = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG2PA + 0x10 * (bg - 2));
-	int16_t pc = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG2PC + 0x10 * (bg - 2));
-	int32_t bgx = bg == 2 ? eng->bg2x : eng->bg3x;
-	int32_t bgy = bg == 2 ? eng->bg2y : eng->bg3y;
+	uint16_t bgcnt = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG0CNT + bg * 2);
+	int16_t pa = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG2PA + 0x10 * (bg - 2));
+	int16_t pc = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG2PC + 0x10 * (bg - 2));
+	int32_t bgx = bg == 2 ? eng_line(gpu, eng, y)->bg2x : eng_line(gpu, eng, y)->bg3x;
+	int32_t bgy = bg == 2 ? eng_line(gpu, eng, y)->bg2y : eng_line(gpu, eng, y)->bg3y;
 	uint32_t baseaddr = ((bgcnt >> 8) & 0x1F) * 0x4000;
 	uint32_t size = (bgcnt >> 14) & 0x3;
 	uint32_t mapwidth = mapwidths[size];
@@ -412,9 +570,9 @@ static void draw_background_ext_tiled(struct gpu *gpu, struct gpu_eng *eng,
 {
 	(void)y;
 	static const uint32_t mapsizes[]  = {16 * 8, 32 * 8, 64 * 8, 128 * 8};
-	uint16_t bgcnt = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG0CNT + bg * 2);
+	uint16_t bgcnt = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG0CNT + bg * 2);
 	uint8_t size = (bgcnt >> 14) & 0x3;
-	uint32_t dispcnt = eng_get_reg32(gpu, eng, MEM_ARM9_REG_DISPCNT);
+	uint32_t dispcnt = eng_get_reg32(gpu, eng, y, MEM_ARM9_REG_DISPCNT);
 	uint32_t ext_pal_base = 0x2000 * bg;
 	uint32_t tilebase = ((bgcnt >> 2) & 0xF) * 0x4000;
 	uint32_t mapbase = ((bgcnt >> 8) & 0x1F) * 0x800;
@@ -429,10 +587,10 @@ static void draw_background_ext_tiled(struct gpu *gpu, struct gpu_eng *eng,
 		overflow = (bgcnt >> 13) & 0x1;
 	else
 		overflow = 0;
-	int16_t pa = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG2PA + 0x10 * (bg - 2));
-	int16_t pc = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG2PC + 0x10 * (bg - 2));
-	int32_t bgx = bg == 2 ? eng->bg2x : eng->bg3x;
-	int32_t bgy = bg == 2 ? eng->bg2y : eng->bg3y;
+	int16_t pa = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG2PA + 0x10 * (bg - 2));
+	int16_t pc = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG2PC + 0x10 * (bg - 2));
+	int32_t bgx = bg == 2 ? eng_line(gpu, eng, y)->bg2x : eng_line(gpu, eng, y)->bg3x;
+	int32_t bgy = bg == 2 ? eng_line(gpu, eng, y)->bg2y : eng_line(gpu, eng, y)->bg3y;
 	for (int32_t x = 0; x < 256; ++x)
 	{
 		int32_t vx = bgx / 256;
@@ -492,7 +650,7 @@ static void draw_background_ext_tiled(struct gpu *gpu, struct gpu_eng *eng,
 static void draw_background_extended(struct gpu *gpu, struct gpu_eng *eng,
                                      uint8_t y, uint8_t bg, uint8_t *data)
 {
-	uint16_t bgcnt = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG0CNT + bg * 2);
+	uint16_t bgcnt = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG0CNT + bg * 2);
 #if 0
 	printf("[ENG%c] draw extended 0x%04" PRIx16 "\n", eng->engb ? 'B' : 'A', bgcnt);
 #endif
@@ -515,11 +673,11 @@ static void draw_background_large(struct gpu *gpu, struct gpu_eng *eng,
 	(void)y;
 	static const uint32_t mapwidths[]  = {512 , 1024, 512 , 1024};
 	static const uint32_t mapheights[] = {1024, 512 , 1024, 512};
-	uint16_t bgcnt = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG0CNT + bg * 2);
-	int16_t pa = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG2PA + 0x10 * (bg - 2));
-	int16_t pc = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG2PC + 0x10 * (bg - 2));
-	int32_t bgx = bg == 2 ? eng->bg2x : eng->bg3x;
-	int32_t bgy = bg == 2 ? eng->bg2y : eng->bg3y;
+	uint16_t bgcnt = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG0CNT + bg * 2);
+	int16_t pa = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG2PA + 0x10 * (bg - 2));
+	int16_t pc = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG2PC + 0x10 * (bg - 2));
+	int32_t bgx = bg == 2 ? eng_line(gpu, eng, y)->bg2x : eng_line(gpu, eng, y)->bg3x;
+	int32_t bgy = bg == 2 ? eng_line(gpu, eng, y)->bg2y : eng_line(gpu, eng, y)->bg3y;
 	uint32_t size = (bgcnt >> 14) & 0x3;
 	uint32_t mapwidth = mapwidths[size];
 	uint32_t mapheight = mapheights[size];
@@ -576,7 +734,7 @@ static void draw_objects(struct gpu *gpu, struct gpu_eng *eng, uint8_t y, uint8_
 	};
 	for (size_t i = 0; i < 256; ++i)
 		data[i * 4 + 3] = 0xE;
-	uint32_t dispcnt = eng_get_reg32(gpu, eng, MEM_ARM9_REG_DISPCNT);
+	uint32_t dispcnt = eng_get_reg32(gpu, eng, y, MEM_ARM9_REG_DISPCNT);
 	for (uint8_t i = 0; i < 128; ++i)
 	{
 		uint16_t attr0 = mem_get_oam16(gpu->mem, eng->oam_base + i * 8);
@@ -824,15 +982,15 @@ static const uint8_t *layer_data(struct line_buff *line, enum layer_type layer,
 
 static void calcwindow(struct gpu *gpu, struct gpu_eng *eng, struct line_buff *line, uint8_t x, uint8_t y, uint8_t *winflags)
 {
-	uint32_t dispcnt = eng_get_reg32(gpu, eng, MEM_ARM9_REG_DISPCNT);
-	uint16_t winin = eng_get_reg16(gpu, eng, MEM_ARM9_REG_WININ);
-	uint16_t winout = eng_get_reg16(gpu, eng, MEM_ARM9_REG_WINOUT);
+	uint32_t dispcnt = eng_get_reg32(gpu, eng, y, MEM_ARM9_REG_DISPCNT);
+	uint16_t winin = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_WININ);
+	uint16_t winout = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_WINOUT);
 	if (dispcnt & (1 << 13))
 	{
-		uint8_t win0l = eng_get_reg16(gpu, eng, MEM_ARM9_REG_WIN0H + 1);
-		uint8_t win0r = eng_get_reg16(gpu, eng, MEM_ARM9_REG_WIN0H);
-		uint8_t win0t = eng_get_reg16(gpu, eng, MEM_ARM9_REG_WIN0V + 1);
-		uint8_t win0b = eng_get_reg16(gpu, eng, MEM_ARM9_REG_WIN0V);
+		uint8_t win0l = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_WIN0H + 1);
+		uint8_t win0r = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_WIN0H);
+		uint8_t win0t = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_WIN0V + 1);
+		uint8_t win0b = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_WIN0V);
 		if (win0l > win0r)
 		{
 			if (win0t > win0b)
@@ -878,10 +1036,10 @@ static void calcwindow(struct gpu *gpu, struct gpu_eng *eng, struct line_buff *l
 	}
 	if (dispcnt & (1 << 14))
 	{
-		uint8_t win1l = eng_get_reg16(gpu, eng, MEM_ARM9_REG_WIN1H + 1);
-		uint8_t win1r = eng_get_reg16(gpu, eng, MEM_ARM9_REG_WIN1H);
-		uint8_t win1t = eng_get_reg16(gpu, eng, MEM_ARM9_REG_WIN1V + 1);
-		uint8_t win1b = eng_get_reg16(gpu, eng, MEM_ARM9_REG_WIN1V);
+		uint8_t win1l = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_WIN1H + 1);
+		uint8_t win1r = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_WIN1H);
+		uint8_t win1t = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_WIN1V + 1);
+		uint8_t win1b = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_WIN1V);
 		if (win1l > win1r)
 		{
 			if (win1t > win1b)
@@ -945,7 +1103,7 @@ static void compose(struct gpu *gpu, struct gpu_eng *eng, struct line_buff *line
 	{
 		*(uint32_t*)dst = *(uint32_t*)bd_color;
 #if 0
-		uint32_t dispcnt = eng_get_reg32(gpu, eng, MEM_ARM9_REG_DISPCNT);
+		uint32_t dispcnt = eng_get_reg32(gpu, eng, y, MEM_ARM9_REG_DISPCNT);
 		if (!eng->engb && (dispcnt & (1 << 3)))
 		{
 			line->bg0[x * 4 + 0] = line->bg0[x * 4 + 0] / 4 + 0xBF;
@@ -1003,7 +1161,7 @@ static void compose(struct gpu *gpu, struct gpu_eng *eng, struct line_buff *line
 	{
 		for (size_t j = 0; j < 4; ++j)
 		{
-			uint8_t bgp = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG0CNT + 2 * j) & 3;
+			uint8_t bgp = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG0CNT + 2 * j) & 3;
 			if (bgp == i)
 			{
 				bg_order[bg_order_cnt] = j;
@@ -1012,17 +1170,17 @@ static void compose(struct gpu *gpu, struct gpu_eng *eng, struct line_buff *line
 			}
 		}
 	}
-	uint32_t dispcnt = eng_get_reg32(gpu, eng, MEM_ARM9_REG_DISPCNT);
+	uint32_t dispcnt = eng_get_reg32(gpu, eng, y, MEM_ARM9_REG_DISPCNT);
 	uint32_t has_window = dispcnt & (7 << 13);
-	uint16_t bldcnt = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BLDCNT);
+	uint16_t bldcnt = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BLDCNT);
 #if 0
 	printf("[ENG%c] BLDCNT=%04" PRIx16 "\n", eng->engb ? 'B' : 'A', bldcnt);
 #endif
 	uint8_t top_mask = (bldcnt >> 0) & 0x3F;
 	uint8_t bot_mask = (bldcnt >> 8) & 0x3F;
 	uint8_t blending = (bldcnt >> 6) & 3;
-	uint16_t bldalpha = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BLDALPHA);
-	uint8_t bldy = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BLDY) & 0x1F;
+	uint16_t bldalpha = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BLDALPHA);
+	uint8_t bldy = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BLDY) & 0x1F;
 	uint8_t eva = (bldalpha >> 0) & 0x1F;
 	uint8_t evb = (bldalpha >> 8) & 0x1F;
 	dst = &eng->data[y * eng->pitch];
@@ -1195,7 +1353,7 @@ static void compose(struct gpu *gpu, struct gpu_eng *eng, struct line_buff *line
 				break;
 		}
 	}
-	uint16_t master_bright = eng_get_reg16(gpu, eng, MEM_ARM9_REG_MASTER_BRIGHT);
+	uint16_t master_bright = eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_MASTER_BRIGHT);
 	switch ((master_bright >> 14) & 0x3)
 	{
 		case 0:
@@ -1278,7 +1436,7 @@ static void capture(struct gpu *gpu, struct gpu_eng *eng, uint8_t y)
 {
 	static const uint32_t widths[] = {128, 256, 256, 256};
 	static const uint32_t heights[] = {128, 64, 128, 192};
-	uint32_t dispcapcnt = eng_get_reg32(gpu, eng, MEM_ARM9_REG_DISPCAPCNT);
+	uint32_t dispcapcnt = eng_get_reg32(gpu, eng, y, MEM_ARM9_REG_DISPCAPCNT);
 #if 0
 	printf("DISPCAPCNT=%08" PRIx32 "\n", dispcapcnt);
 #endif
@@ -1297,7 +1455,8 @@ static void capture(struct gpu *gpu, struct gpu_eng *eng, uint8_t y)
 		case 0x0:
 			if (dispcapcnt & (1 << 24))
 			{
-				uint8_t *src = &gpu->g3d.front->data[(256 * (191 - y)) * 4];
+				uint8_t tmp[256 * 4];
+				const uint8_t *src = get_g3d_row(gpu, 191 - y, tmp);
 				for (size_t x = 0; x < width; ++x)
 				{
 					uint16_t val = src[3] ? (1 << 15) : 0;
@@ -1335,7 +1494,7 @@ static void capture(struct gpu *gpu, struct gpu_eng *eng, uint8_t y)
 static void draw_eng(struct gpu *gpu, struct gpu_eng *eng, uint8_t y)
 {
 	struct line_buff line;
-	uint32_t dispcnt = eng_get_reg32(gpu, eng, MEM_ARM9_REG_DISPCNT);
+	uint32_t dispcnt = eng_get_reg32(gpu, eng, y, MEM_ARM9_REG_DISPCNT);
 #if 0
 	printf("[ENG%c] DISPCNT: %08" PRIx32 "\n", eng->engb ? 'B' : 'A', dispcnt);
 #endif
@@ -1468,38 +1627,60 @@ static void draw_eng(struct gpu *gpu, struct gpu_eng *eng, uint8_t y)
 	compose(gpu, eng, &line, y);
 	if (gpu->capture && !eng->engb)
 		capture(gpu, eng, y);
-	int16_t bg2pb = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG2PB);
-	int16_t bg2pd = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG2PD);
-	int16_t bg3pb = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG3PB);
-	int16_t bg3pd = eng_get_reg16(gpu, eng, MEM_ARM9_REG_BG3PD);
-	eng->bg2x += bg2pb;
-	eng->bg2y += bg2pd;
-	eng->bg3x += bg3pb;
-	eng->bg3y += bg3pd;
 }
 
-void gpu_draw(struct gpu *gpu, uint8_t y)
+static void eng_latch(struct gpu *gpu, struct gpu_eng *eng, uint8_t y)
+{
+	struct gpu_eng_line *line = eng_line(gpu, eng, y);
+	memcpy(line->regs, &gpu->mem->arm9_regs[eng->reg_base], sizeof(line->regs));
+	line->bg2x = eng->bg2x;
+	line->bg2y = eng->bg2y;
+	line->bg3x = eng->bg3x;
+	line->bg3y = eng->bg3y;
+	eng->bg2x += (int16_t)eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG2PB);
+	eng->bg2y += (int16_t)eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG2PD);
+	eng->bg3x += (int16_t)eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG3PB);
+	eng->bg3y += (int16_t)eng_get_reg16(gpu, eng, y, MEM_ARM9_REG_BG3PD);
+}
+
+/* snapshot the registers line y is drawn with, so that it can be drawn
+ * later, and on another thread, than the emulation reaches it
+ */
+void gpu_latch(struct gpu *gpu, uint8_t y)
+{
+	gpu->lines[y].powcnt1 = mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_POWCNT1);
+	eng_latch(gpu, &gpu->enga, y);
+	eng_latch(gpu, &gpu->engb, y);
+}
+
+/* the engines share nothing but the latched line: they can be drawn
+ * concurrently (the capture only depends on the engine A line, it's
+ * done right after it)
+ */
+void gpu_draw_eng(struct gpu *gpu, struct gpu_eng *eng, uint8_t y)
 {
-	uint32_t powcnt1 = mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_POWCNT1);
+	uint32_t powcnt1 = gpu->lines[y].powcnt1;
 #if 0
 	printf("powcnt1: %08" PRIx32 "\n", powcnt1);
 #endif
-	if (powcnt1 & (1 << 1))
-		draw_eng(gpu, &gpu->enga, y);
+	if (powcnt1 & (eng->engb ? (1 << 9) : (1 << 1)))
+		draw_eng(gpu, eng, y);
 	else
-		memset(&gpu->enga.data[y * gpu->enga.pitch], 0, 256 * 4);
-	if (powcnt1 & (1 << 9))
-		draw_eng(gpu, &gpu->engb, y);
-	else
-		memset(&gpu->engb.data[y * gpu->engb.pitch], 0, 256 * 4);
+		memset(&eng->data[y * eng->pitch], 0, 256 * 4);
+}
+
+void gpu_draw(struct gpu *gpu, uint8_t y)
+{
+	gpu_draw_eng(gpu, &gpu->enga, y);
+	gpu_draw_eng(gpu, &gpu->engb, y);
 }
 
 static void eng_commit_bgpos(struct gpu *gpu, struct gpu_eng *eng)
 {
-	eng->bg2x = eng_get_reg32(gpu, eng, MEM_ARM9_REG_BG2X) & 0xFFFFFFF;
-	eng->bg2y = eng_get_reg32(gpu, eng, MEM_ARM9_REG_BG2Y) & 0xFFFFFFF;
-	eng->bg3x = eng_get_reg32(gpu, eng, MEM_ARM9_REG_BG3X) & 0xFFFFFFF;
-	eng->bg3y = eng_get_reg32(gpu, eng, MEM_ARM9_REG_BG3Y) & 0xFFFFFFF;
+	eng->bg2x = mem_arm9_get_reg32(gpu->mem, eng->reg_base + MEM_ARM9_REG_BG2X) & 0xFFFFFFF;
+	eng->bg2y = mem_arm9_get_reg32(gpu->mem, eng->reg_base + MEM_ARM9_REG_BG2Y) & 0xFFFFFFF;
+	eng->bg3x = mem_arm9_get_reg32(gpu->mem, eng->reg_base + MEM_ARM9_REG_BG3X) & 0xFFFFFFF;
+	eng->bg3y = mem_arm9_get_reg32(gpu->mem, eng->reg_base + MEM_ARM9_REG_BG3Y) & 0xFFFFFFF;
 	TRANSFORM_INT28(eng->bg2x);
 	TRANSFORM_INT28(eng->bg2y);
 	TRANSFORM_INT28(eng->bg3x);
@@ -1512,6 +1693,25 @@ void gpu_commit_bgpos(struct gpu *gpu)
 	eng_commit_bgpos(gpu, &gpu->engb);
 }
 
+/* the 3d output only reaches the screen through the bg0 of engine a or
+ * through the display capture: the rasterization of the frame can be
+ * skipped when neither reads it
+ */
+int gpu_g3d_is_observed(struct gpu *gpu)
+{
+	uint32_t dispcnt = mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_DISPCNT);
+	if (((dispcnt >> 16) & 0x3) == 1
+	 && (dispcnt & (1 << 8))
+	 && ((dispcnt & (1 << 3)) || (dispcnt & 0x7) == 6))
+		return 1;
+	uint32_t dispcapcnt = mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_DISPCAPCNT);
+	if ((dispcapcnt & (1 << 31))
+	 && ((dispcapcnt >> 29) & 0x3) != 1
+	 && (dispcapcnt & (1 << 24)))
+		return 1;
+	return 0;
+}
+
 static int32_t fp12_mul(int64_t a, int64_t b)
 {
 	return a * b / (1 << 12);
@@ -1522,89 +1722,15 @@ static int32_t fp12_div(int64_t a, int64_t b)
 	return a * (1 << 12) / b;
 }
 
-static bool get_tex_color(struct gpu *gpu, struct polygon *polygon,
-                          int16_t s, int16_t t, uint8_t *v)
+/* texel (s, t) of a texture, s and t already wrapped */
+static bool get_texel(struct gpu *gpu, uint32_t texture, uint32_t pltt_base,
+                      uint32_t s, uint32_t t, uint8_t *v)
 {
-	uint8_t texture_type = (polygon->texture >> 26) & 0x7;
-	if (!texture_type)
-	{
-		v[0] = 0x1F;
-		v[1] = 0x1F;
-		v[2] = 0x1F;
-		v[3] = 0x1F;
-		return true;
-	}
-	uint32_t width = 8 << ((polygon->texture >> 20) & 0x7);
-	uint32_t height = 8 << ((polygon->texture >> 23) & 0x7);
-	uint32_t offset = 8 * (polygon->texture & 0xFFFF);
-	s /= (1 << 4);
-	t /= (1 << 4);
-	if (polygon->texture & (1 << 16))
-	{
-		if (polygon->texture & (1 << 18))
-		{
-			s %= width * 2;
-			if (s < 0)
-			{
-				if (s <= -(int32_t)width)
-					s += width * 2;
-				else
-					s = -s;
-			}
-			else
-			{
-				if ((uint32_t)s >= width)
-					s = width * 2 - s - 1;
-			}
-		}
-		else
-		{
-			s %= width;
-			if (s < 0)
-				s += width;
-		}
-	}
-	else
-	{
-		if (s < 0)
-			s = 0;
-		if ((uint32_t)s >= width)
-			s = width - 1;
-	}
-	if (polygon->texture & (1 << 17))
-	{
-		if (polygon->texture & (1 << 19))
-		{
-			t %= height * 2;
-			if (t < 0)
-			{
-				if (t <= -(int32_t)height)
-					t += height * 2;
-				else
-					t = -t;
-			}
-			else
-			{
-				if ((uint32_t)t >= height)
-					t = height * 2 - t - 1;
-			}
-		}
-		else
-		{
-			t %= height;
-			if (t < 0)
-				t += height;
-		}
-	}
-	else
-	{
-		if (t < 0)
-			t = 0;
-		if ((uint32_t)t >= height)
-			t = height - 1;
-	}
-	uint32_t base_addr = (polygon->pltt_base & 0x1FFF) << 4;
-	uint16_t color;
+	uint8_t texture_type = (texture >> 26) & 0x7;
+	uint32_t width = 8 << ((texture >> 20) & 0x7);
+	uint32_t offset = 8 * (texture & 0xFFFF);
+	uint32_t base_addr = (pltt_base & 0x1FFF) << 4;
+	uint16_t color = 0; /* texture type 0 has no texel */
 	switch (texture_type)
 	{
 		case 0x1:
@@ -1620,7 +1746,7 @@ static bool get_tex_color(struct gpu *gpu, struct polygon *polygon,
 			uint8_t index = mem_vram_trpi_get8(gpu->mem, offset + (width * t + s) / 4);
 			index >>= 2 * (s & 0x3);
 			index &= 0x3;
-			if (!index && polygon->texture & (1 << 29))
+			if (!index && texture & (1 << 29))
 				return false;
 			color = mem_vram_texp_get16(gpu->mem, base_addr / 2 + (index * 2));
 			v[3] = 0x1F;
@@ -1633,7 +1759,7 @@ static bool get_tex_color(struct gpu *gpu, struct polygon *polygon,
 				index >>= 4;
 			else
 				index &= 0xF;
-			if (!index && polygon->texture & (1 << 29))
+			if (!index && texture & (1 << 29))
 				return false;
 			color = mem_vram_texp_get16(gpu->mem, base_addr + (index * 2));
 			v[3] = 0x1F;
@@ -1642,7 +1768,7 @@ static bool get_tex_color(struct gpu *gpu, struct polygon *polygon,
 		case 0x4:
 		{
 			uint8_t index = mem_vram_trpi_get8(gpu->mem, offset + width * t + s);
-			if (!index && polygon->texture & (1 << 29))
+			if (!index && texture & (1 << 29))
 				return false;
 			color = mem_vram_texp_get16(gpu->mem, base_addr + (index * 2));
 			v[3] = 0x1F;
@@ -1772,8 +1898,163 @@ static bool get_tex_color(struct gpu *gpu, struct polygon *polygon,
 	return true;
 }
 
-static void draw_pixel(struct gpu *gpu, struct polygon *polygon,
-                       int32_t x, int32_t y, int32_t *v)
+
+static void tex_cache_flush(struct gpu *gpu)
+{
+	for (size_t i = 0; i < GPU_TEX_CACHE; ++i)
+	{
+		struct gpu_tex *tex = &gpu->tex_cache[i];
+		free(tex->data);
+		tex->data = NULL;
+		tex->size = 0;
+		tex->valid = 0;
+	}
+	gpu->tex_bytes = 0;
+}
+
+/* cache entry of a texture, decoded on a miss
+ * the least recently used entry is replaced, but never one used by the
+ * current frame: GPU_TEX_NONE is returned when there's none left and the
+ * texture is then sampled from vram
+ */
+static uint8_t tex_cache_get(struct gpu *gpu, uint32_t texture, uint32_t pltt_base)
+{
+	uint8_t texture_type = (texture >> 26) & 0x7;
+	if (!texture_type)
+		return GPU_TEX_NONE;
+	texture &= 0x3FF0FFFF;
+	if (texture_type == 0x7)
+		pltt_base = 0;
+	else
+		pltt_base &= 0x1FFF;
+	struct gpu_tex *victim = NULL;
+	for (size_t i = 0; i < GPU_TEX_CACHE; ++i)
+	{
+		struct gpu_tex *tex = &gpu->tex_cache[i];
+		if (!tex->valid)
+		{
+			if (!victim || victim->valid)
+				victim = tex;
+			continue;
+		}
+		if (tex->texture == texture && tex->pltt_base == pltt_base)
+		{
+			tex->frame = gpu->tex_frame;
+			gpu->tex_hits++;
+			return i;
+		}
+		if (tex->frame != gpu->tex_frame
+		 && (!victim || (victim->valid && tex->frame < victim->frame)))
+			victim = tex;
+	}
+	gpu->tex_misses++;
+	if (!victim)
+		return GPU_TEX_NONE;
+	uint32_t width = 8 << ((texture >> 20) & 0x7);
+	uint32_t height = 8 << ((texture >> 23) & 0x7);
+	uint32_t size = width * height * 4;
+	if (victim->size != size)
+	{
+		if (gpu->tex_bytes - victim->size + size > GPU_TEX_CACHE_BYTES)
+			return GPU_TEX_NONE;
+		uint8_t *data = realloc(victim->data, size);
+		if (!data)
+		{
+			printf("failed to allocate texture\n");
+			return GPU_TEX_NONE;
+		}
+		gpu->tex_bytes = gpu->tex_bytes - victim->size + size;
+		victim->data = data;
+		victim->size = size;
+	}
+	uint8_t *dst = victim->data;
+	for (uint32_t t = 0; t < height; ++t)
+	{
+		for (uint32_t s = 0; s < width; ++s)
+		{
+			if (!get_texel(gpu, texture, pltt_base, s, t, dst))
+				dst[3] = 0xFF;
+			dst += 4;
+		}
+	}
+	victim->texture = texture;
+	victim->pltt_base = pltt_base;
+	victim->frame = gpu->tex_frame;
+	victim->valid = 1;
+	gpu->tex_decoded += size;
+	return victim - gpu->tex_cache;
+}
+
+/* the state of a triangle its pixels read, loaded once by draw_triangle
+ * instead of at each pixel
+ */
+struct raster_state
+{
+	const struct rasterizer *rast;
+	const uint8_t *tex; /* decoded texture, NULL if it isn't cached */
+	int32_t tex_width;
+	int32_t tex_height;
+	int32_t s_mask; /* -1 when clamped, the size (doubled if flipped) minus 1 when repeated */
+	int32_t t_mask;
+	int32_t s_flip; /* size when flipped, 0 otherwise */
+	int32_t t_flip;
+	uint8_t alpha; /* polygon alpha, on 6 bits */
+	uint8_t alpha_ref; /* ALPHA_TEST_REF */
+	bool toon_highlight; /* DISP3DCNT bit 1 */
+	bool alpha_max; /* attribute bit 11: blending keeps the highest alpha */
+	bool fog;
+	bool fog_alpha; /* only the alpha is fogged (DISP3DCNT bit 6) */
+	uint8_t fog_shift;
+	uint32_t fog_offset;
+	uint32_t fog_color;
+	uint8_t fog_table[32];
+};
+
+/* the wrap mode is given as masks: repeating is an and, flipping a xor
+ * of the odd repetitions, and clamping what's left out of the texture
+ */
+static FORCE_INLINE int32_t wrap_coord(int32_t c, int32_t mask, int32_t flip,
+                                       int32_t size)
+{
+	c &= mask;
+	if (c & flip)
+		c ^= mask;
+	if (c < 0)
+		c = 0;
+	if (c >= size)
+		c = size - 1;
+	return c;
+}
+
+static FORCE_INLINE bool get_tex_color(struct gpu *gpu, struct polygon *polygon,
+                                       const struct raster_state *rs,
+                                       int16_t s, int16_t t, uint8_t *v)
+{
+	s /= (1 << 4);
+	t /= (1 << 4);
+	s = wrap_coord(s, rs->s_mask, rs->s_flip, rs->tex_width);
+	t = wrap_coord(t, rs->t_mask, rs->t_flip, rs->tex_height);
+	if (!rs->tex)
+		return get_texel(gpu, polygon->texture, polygon->pltt_base, s, t, v);
+	const uint8_t *texel = &rs->tex[(rs->tex_width * t + s) * 4];
+	if (texel[3] == 0xFF)
+		return false;
+	v[0] = texel[0];
+	v[1] = texel[1];
+	v[2] = texel[2];
+	v[3] = texel[3];
+	return true;
+}
+
+/* the polygon state is given as constants so each rasterizer gets its
+ * own copy without the branches it doesn't need
+ */
+static FORCE_INLINE void draw_pixel(struct gpu *gpu, struct polygon *polygon,
+                                    const struct raster_state *rs,
+                                    int32_t x, int32_t y, int32_t *v,
+                                    const bool textured, const int mode,
+                                    const bool depth_equal, const bool alpha_test,
+                                    const bool blend)
 {
 	x /= (1 << 4);
 	y /= (1 << 4);
@@ -1787,7 +2068,7 @@ static void draw_pixel(struct gpu *gpu, struct polygon *polygon,
 	if (w < 0)
 		return;
 #if 1
-	if (polygon->attr & (1 << 14))
+	if (depth_equal)
 	{
 		if ((z & ~0x1FF) != (gpu->g3d.front->zbuf[256 * y + x] & ~0x1FF))
 			return;
@@ -1827,20 +2108,26 @@ static void draw_pixel(struct gpu *gpu, struct polygon *polygon,
 	gpu->g3d.front->zbuf[256 * y + x] = z;
 	return;
 #endif
-	uint32_t disp3dcnt = mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_DISP3DCNT);
-	uint16_t a = (polygon->attr >> 16) & 0x1F;
-	if (!a) /* wireframe has solid wires */
-		a = 0x1F;
 	uint8_t vv[4];
 	uint8_t tv[4];
 	uint8_t cv[4];
-	if (!get_tex_color(gpu, polygon, s, t, tv))
-		return;
+	if (textured)
+	{
+		if (!get_tex_color(gpu, polygon, rs, s, t, tv))
+			return;
+	}
+	else
+	{
+		tv[0] = 0x1F;
+		tv[1] = 0x1F;
+		tv[2] = 0x1F;
+		tv[3] = 0x1F;
+	}
 	vv[0] = TO6(r);
 	vv[1] = TO6(g);
 	vv[2] = TO6(b);
-	vv[3] = TO6(a);
-	switch ((polygon->attr >> 4) & 0x3)
+	vv[3] = rs->alpha;
+	switch (mode)
 	{
 		case 0x0:
 			cv[0] = ((tv[0] + 1) * (vv[0] + 1) - 1) / 64;
@@ -1880,7 +2167,7 @@ static void draw_pixel(struct gpu *gpu, struct polygon *polygon,
 			cv[1] = ((tv[1] + 1) * (sv[1] + 1) - 1) / 64;
 			cv[2] = ((tv[2] + 1) * (sv[2] + 1) - 1) / 64;
 			cv[3] = ((tv[3] + 1) * (vv[3] + 1) - 1) / 64;
-			if (disp3dcnt & (1 << 1))
+			if (rs->toon_highlight)
 			{
 				cv[0] += sv[0];
 				cv[1] += sv[1];
@@ -1901,13 +2188,12 @@ static void draw_pixel(struct gpu *gpu, struct polygon *polygon,
 	cv[1] /= 2;
 	cv[2] /= 2;
 	cv[3] /= 2;
-	if ((disp3dcnt & (1 << 7)) && (polygon->attr & (1 < 15)))
+	if (rs->fog)
 	{
-		uint32_t offset = mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_FOG_OFFSET) & 0x7FFF;
 		uint32_t fofs;
-		if ((size_t)w >= offset)
+		if ((size_t)w >= rs->fog_offset)
 		{
-			fofs = w - offset / (0x400 >> ((disp3dcnt >> 8) & 0xF));
+			fofs = w - rs->fog_offset / (0x400 >> rs->fog_shift);
 			if (fofs > 0x1F)
 				fofs = 0x1F;
 		}
@@ -1915,10 +2201,10 @@ static void draw_pixel(struct gpu *gpu, struct polygon *polygon,
 		{
 			fofs = 0;
 		}
-		uint8_t fd = mem_arm9_get_reg8(gpu->mem, MEM_ARM9_REG_FOG_TABLE + fofs);
-		uint16_t fc = mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_FOG_COLOR);
+		uint8_t fd = rs->fog_table[fofs];
+		uint32_t fc = rs->fog_color;
 		uint8_t fv[4];
-		if (!(disp3dcnt & (1 << 6)))
+		if (!rs->fog_alpha)
 		{
 			fv[0] = TO6((fc >> 0x0A) & 0x1F);
 			fv[1] = TO6((fc >> 0x05) & 0x1F);
@@ -1932,12 +2218,12 @@ static void draw_pixel(struct gpu *gpu, struct polygon *polygon,
 	}
 	if (!cv[3])
 		return;
-	if (disp3dcnt & (1 << 2))
+	if (alpha_test)
 	{
-		if (cv[3] <= mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_ALPHA_TEST_REF))
+		if (cv[3] <= rs->alpha_ref)
 			return;
 	}
-	if (cv[3] == 0x1F || !dst[3] || !(disp3dcnt & (1 << 3)))
+	if (cv[3] == 0x1F || !dst[3] || !blend)
 	{
 		dst[0] = TO8(cv[0]);
 		dst[1] = TO8(cv[1]);
@@ -1949,26 +2235,358 @@ static void draw_pixel(struct gpu *gpu, struct polygon *polygon,
 		dst[0] = (cv[0] * (cv[3] + 1) + dst[0] * (31 - cv[3])) / 32;
 		dst[1] = (cv[1] * (cv[3] + 1) + dst[1] * (31 - cv[3])) / 32;
 		dst[2] = (cv[2] * (cv[3] + 1) + dst[2] * (31 - cv[3])) / 32;
-		if ((polygon->attr & (1 << 11)) && cv[3] > dst[3])
+		if (rs->alpha_max && cv[3] > dst[3])
 			dst[3] = cv[3];
 	}
 	gpu->g3d.front->zbuf[256 * y + x] = z;
+	/* the only write that can raise the depth */
+	if (depth_equal)
+	{
+		int32_t *hiz = &gpu->g3d.front->hiz[y * GPU_TILES_X + x / GPU_TILE_SIZE];
+		if (z > *hiz)
+			*hiz = z;
+	}
 }
 
-static void draw_line_pixel(struct gpu *gpu, struct polygon *polygon,
-                            int32_t x, int32_t y,
-                            int32_t *v0, int32_t *v1, int32_t *d)
+/* the hiz holds an upper bound of the depths of each row of a tile: it
+ * only gets above them when the row is drawn on (it's then flagged
+ * dirty), as pixels of the depth equal test are the only ones that can
+ * raise a depth and they raise the bound along
+ */
+static int32_t get_hiz(struct gpu_g3d_buf *buf, uint32_t row, uint32_t tx)
+{
+	int32_t *hiz = &buf->hiz[row * GPU_TILES_X + tx];
+	if (buf->hiz_dirty[row] & (1 << tx))
+	{
+		const int32_t *zbuf = &buf->zbuf[256 * row + tx * GPU_TILE_SIZE];
+		int32_t max = zbuf[0];
+		for (size_t i = 1; i < GPU_TILE_SIZE; ++i)
+		{
+			if (zbuf[i] > max)
+				max = zbuf[i];
+		}
+		*hiz = max;
+		buf->hiz_dirty[row] &= ~(1 << tx);
+	}
+	return *hiz;
+}
+
+/* whether no depth of at least z passes the test against depths of at
+ * most max
+ */
+static bool hiz_occluded(struct polygon *polygon, int32_t z, int32_t max)
+{
+	if (polygon->attr & (1 << 14))
+		return (z & ~0x1FF) > (max & ~0x1FF);
+	return z >= max;
+}
+
+/* a vertex the rasterizer never clamps: the depths of the pixels it
+ * interpolates are between the ones of the vertexes
+ */
+static bool hiz_vertex(struct gpu *gpu, const struct vertex *v)
+{
+	return v->position.w > 0
+	    && v->screen_x >= gpu->g3d.viewport_left * (1 << 4)
+	    && v->screen_x / (1 << 4) <= gpu->g3d.viewport_right
+	    && v->screen_y >= gpu->g3d.viewport_top * (1 << 4)
+	    && v->screen_y / (1 << 4) <= gpu->g3d.viewport_bottom;
+}
+
+static bool tile_occluded(struct gpu *gpu, struct gpu_g3d_buf *buf,
+                          struct polygon *polygon, const struct tile *tile)
+{
+	int32_t z = INT32_MAX;
+	for (size_t i = 0; i < (polygon->quad ? 4u : 3u); ++i)
+	{
+		const struct vertex *v = &buf->vertexes[polygon->vertexes[i]];
+		if (!hiz_vertex(gpu, v))
+			return false;
+		if (v->position.z < z)
+			z = v->position.z;
+	}
+	uint32_t tx = tile->left / GPU_TILE_SIZE;
+	for (int32_t row = tile->top; row < tile->bottom; ++row)
+	{
+		if (!hiz_occluded(polygon, z, get_hiz(buf, row, tx)))
+			return false;
+	}
+	return true;
+}
+
+static FORCE_INLINE void interp_line(int32_t x, const int32_t *v0, const int32_t *v1,
+                                     const int32_t *d, int32_t *v)
 {
 	int64_t num = (x - v0[0]) * (int64_t)v0[2];
 	int64_t dem = num + (v1[0] - x) * (int64_t)v1[2];
 	int64_t factor = dem ? fp12_div(num, dem) : 0;
-	int32_t v[8];
 	for (size_t i = 0; i < 8; ++i)
 		v[i] = v0[i] + fp12_mul(d[i], factor);
-	draw_pixel(gpu, polygon, x, y, v);
 }
 
-static void draw_line(struct gpu *gpu, struct polygon *polygon, int32_t y,
+static FORCE_INLINE void draw_line_pixels(struct gpu *gpu, struct polygon *polygon,
+                                          const struct raster_state *rs,
+                                          int32_t x, int32_t endx, int32_t y,
+                                          int32_t *v0, int32_t *v1, int32_t *d,
+                                          const bool textured, const int mode,
+                                          const bool depth_equal, const bool alpha_test,
+                                          const bool blend)
+{
+	for (; x < endx; x += (1 << 4))
+	{
+		int32_t v[8];
+		interp_line(x, v0, v1, d, v);
+		draw_pixel(gpu, polygon, rs, x, y, v, textured, mode, depth_equal, alpha_test, blend);
+	}
+}
+
+#ifdef GPU_AVX2
+/* four pixels at a time, with the same results as interp_line:
+ * num * 4096 fits in the 53 bits of a double for the accepted inputs
+ * and the rounded quotient can only be one above the truncated one
+ */
+__attribute__((target("avx2,fma")))
+static FORCE_INLINE int32_t draw_line_pixels_avx2(struct gpu *gpu, struct polygon *polygon,
+                                                  const struct raster_state *rs,
+                                                  int32_t x, int32_t endx, int32_t y,
+                                                  int32_t *v0, int32_t *v1, int32_t *d,
+                                                  const bool textured, const int mode,
+                                                  const bool depth_equal, const bool alpha_test,
+                                                  const bool blend)
+{
+	const __m128i step = _mm_setr_epi32(0, 1 << 4, 2 << 4, 3 << 4);
+	const __m256d w0 = _mm256_set1_pd(v0[2]);
+	const __m256d w1 = _mm256_set1_pd(v1[2]);
+	const __m256d scale = _mm256_set1_pd(1 << 12);
+	const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+	const __m256i round = _mm256_set1_epi64x(0xFFF);
+	for (; endx - x > 3 * (1 << 4); x += 4 * (1 << 4))
+	{
+		__m128i xs = _mm_add_epi32(_mm_set1_epi32(x), step);
+		__m256d dl = _mm256_cvtepi32_pd(_mm_sub_epi32(xs, _mm_set1_epi32(v0[0])));
+		__m256d dr = _mm256_cvtepi32_pd(_mm_sub_epi32(_mm_set1_epi32(v1[0]), xs));
+		__m256d num = _mm256_mul_pd(dl, w0);
+		__m256d dem = _mm256_fmadd_pd(dr, w1, num);
+		__m256d a = _mm256_mul_pd(num, scale);
+		__m256d q = _mm256_round_pd(_mm256_div_pd(a, dem),
+		                            _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+		__m256d e = _mm256_fmsub_pd(q, dem, a);
+		q = _mm256_sub_pd(q, _mm256_and_pd(_mm256_cmp_pd(e, _mm256_setzero_pd(), _CMP_GT_OQ),
+		                                   _mm256_set1_pd(1)));
+		__m256i factor = _mm256_cvtepi32_epi64(_mm256_cvttpd_epi32(q));
+		int32_t v[4][8];
+		for (size_t i = 1; i < 8; ++i)
+		{
+			__m256i p = _mm256_mul_epi32(_mm256_set1_epi64x(d[i]), factor);
+			p = _mm256_add_epi64(p, _mm256_and_si256(_mm256_cmpgt_epi64(_mm256_setzero_si256(), p), round));
+			p = _mm256_srli_epi64(p, 12); /* only the low 32 bits are kept */
+			p = _mm256_permutevar8x32_epi32(p, pack);
+			__m128i r = _mm_add_epi32(_mm256_castsi256_si128(p), _mm_set1_epi32(v0[i]));
+			v[0][i] = _mm_cvtsi128_si32(r);
+			v[1][i] = _mm_extract_epi32(r, 1);
+			v[2][i] = _mm_extract_epi32(r, 2);
+			v[3][i] = _mm_extract_epi32(r, 3);
+		}
+		for (size_t i = 0; i < 4; ++i)
+			draw_pixel(gpu, polygon, rs, x + (int32_t)i * (1 << 4), y, v[i],
+			           textured, mode, depth_equal, alpha_test, blend);
+	}
+	return x;
+}
+
+static inline bool line_avx2(struct gpu *gpu, const int32_t *v0, const int32_t *v1)
+{
+	return gpu->avx2
+	    && v0[2] > 0 && v0[2] < (1 << 24)
+	    && v1[2] > 0 && v1[2] < (1 << 24)
+	    && v0[0] > -(1 << 16) && v0[0] < (1 << 16)
+	    && v1[0] > -(1 << 16) && v1[0] < (1 << 16);
+}
+
+#define RASTERIZER_AVX2(textured, mode, depth_equal, alpha_test, blend) \
+__attribute__((target("avx2,fma"))) \
+static int32_t draw_pixels_avx2_##textured##mode##depth_equal##alpha_test##blend(struct gpu *gpu, \
+                                                                                 struct polygon *polygon, \
+                                                                                 const struct raster_state *rs, \
+                                                                                 int32_t x, int32_t endx, int32_t y, \
+                                                                                 int32_t *v0, int32_t *v1, int32_t *d) \
+{ \
+	return draw_line_pixels_avx2(gpu, polygon, rs, x, endx, y, v0, v1, d, \
+	                             textured, mode, depth_equal, alpha_test, blend); \
+}
+
+#define RASTERIZER_AVX2_CALL(textured, mode, depth_equal, alpha_test, blend) \
+	if (line_avx2(gpu, v0, v1)) \
+		x = draw_pixels_avx2_##textured##mode##depth_equal##alpha_test##blend(gpu, polygon, rs, \
+		                                                                       x, endx, y, \
+		                                                                       v0, v1, d);
+#else
+#define RASTERIZER_AVX2(textured, mode, depth_equal, alpha_test, blend)
+#define RASTERIZER_AVX2_CALL(textured, mode, depth_equal, alpha_test, blend)
+#endif
+
+/* the pixels of a line between its ends go through the specialized
+ * loop, only the ends are drawn one by one through the pixel function
+ */
+struct rasterizer
+{
+	void (*pixel)(struct gpu *gpu, struct polygon *polygon,
+	              const struct raster_state *rs,
+	              int32_t x, int32_t y, int32_t *v);
+	void (*pixels)(struct gpu *gpu, struct polygon *polygon,
+	               const struct raster_state *rs,
+	               int32_t x, int32_t endx, int32_t y,
+	               int32_t *v0, int32_t *v1, int32_t *d);
+};
+
+#define RASTERIZER(textured, mode, depth_equal, alpha_test, blend) \
+static void draw_pixel_##textured##mode##depth_equal##alpha_test##blend(struct gpu *gpu, \
+                                                                        struct polygon *polygon, \
+                                                                        const struct raster_state *rs, \
+                                                                        int32_t x, int32_t y, \
+                                                                        int32_t *v) \
+{ \
+	draw_pixel(gpu, polygon, rs, x, y, v, textured, mode, depth_equal, alpha_test, blend); \
+} \
+RASTERIZER_AVX2(textured, mode, depth_equal, alpha_test, blend) \
+static void draw_pixels_##textured##mode##depth_equal##alpha_test##blend(struct gpu *gpu, \
+                                                                         struct polygon *polygon, \
+                                                                         const struct raster_state *rs, \
+                                                                         int32_t x, int32_t endx, int32_t y, \
+                                                                         int32_t *v0, int32_t *v1, int32_t *d) \
+{ \
+	RASTERIZER_AVX2_CALL(textured, mode, depth_equal, alpha_test, blend) \
+	draw_line_pixels(gpu, polygon, rs, x, endx, y, v0, v1, d, \
+	                 textured, mode, depth_equal, alpha_test, blend); \
+} \
+static const struct rasterizer rasterizer_##textured##mode##depth_equal##alpha_test##blend = \
+{ \
+	.pixel = draw_pixel_##textured##mode##depth_equal##alpha_test##blend, \
+	.pixels = draw_pixels_##textured##mode##depth_equal##alpha_test##blend, \
+};
+
+#define RASTERIZER_BLEND(textured, mode, depth_equal, alpha_test) \
+	RASTERIZER(textured, mode, depth_equal, alpha_test, 0) \
+	RASTERIZER(textured, mode, depth_equal, alpha_test, 1)
+
+#define RASTERIZER_ALPHA_TEST(textured, mode, depth_equal) \
+	RASTERIZER_BLEND(textured, mode, depth_equal, 0) \
+	RASTERIZER_BLEND(textured, mode, depth_equal, 1)
+
+#define RASTERIZER_DEPTH(textured, mode) \
+	RASTERIZER_ALPHA_TEST(textured, mode, 0) \
+	RASTERIZER_ALPHA_TEST(textured, mode, 1)
+
+#define RASTERIZER_MODE(textured) \
+	RASTERIZER_DEPTH(textured, 0) \
+	RASTERIZER_DEPTH(textured, 1) \
+	RASTERIZER_DEPTH(textured, 2)
+
+RASTERIZER_MODE(0)
+RASTERIZER_MODE(1)
+
+#define RASTERIZER_REF(textured, mode, depth_equal, alpha_test, blend) \
+	&rasterizer_##textured##mode##depth_equal##alpha_test##blend,
+
+#define RASTERIZER_REF_BLEND(textured, mode, depth_equal, alpha_test) \
+	RASTERIZER_REF(textured, mode, depth_equal, alpha_test, 0) \
+	RASTERIZER_REF(textured, mode, depth_equal, alpha_test, 1)
+
+#define RASTERIZER_REF_ALPHA_TEST(textured, mode, depth_equal) \
+	RASTERIZER_REF_BLEND(textured, mode, depth_equal, 0) \
+	RASTERIZER_REF_BLEND(textured, mode, depth_equal, 1)
+
+#define RASTERIZER_REF_DEPTH(textured, mode) \
+	RASTERIZER_REF_ALPHA_TEST(textured, mode, 0) \
+	RASTERIZER_REF_ALPHA_TEST(textured, mode, 1)
+
+#define RASTERIZER_REF_MODE(textured) \
+	RASTERIZER_REF_DEPTH(textured, 0) \
+	RASTERIZER_REF_DEPTH(textured, 1) \
+	RASTERIZER_REF_DEPTH(textured, 2)
+
+/* indexed by get_rasterizer */
+static const struct rasterizer *rasterizers[2 * 3 * 2 * 2 * 2] =
+{
+	RASTERIZER_REF_MODE(0)
+	RASTERIZER_REF_MODE(1)
+};
+
+#undef RASTERIZER_REF_MODE
+#undef RASTERIZER_REF_DEPTH
+#undef RASTERIZER_REF_ALPHA_TEST
+#undef RASTERIZER_REF_BLEND
+#undef RASTERIZER_REF
+#undef RASTERIZER_MODE
+#undef RASTERIZER_DEPTH
+#undef RASTERIZER_ALPHA_TEST
+#undef RASTERIZER_BLEND
+#undef RASTERIZER
+#undef RASTERIZER_AVX2_CALL
+#undef RASTERIZER_AVX2
+
+/* the rasterizer and the state of a polygon, shadow polygons excepted */
+static void init_raster_state(struct gpu *gpu, struct polygon *polygon,
+                              struct raster_state *rs)
+{
+	uint32_t disp3dcnt = mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_DISP3DCNT);
+	size_t id = ((polygon->texture >> 26) & 0x7) ? 1 : 0;
+	id = id * 3 + ((polygon->attr >> 4) & 0x3);
+	id = id * 2 + ((polygon->attr >> 14) & 0x1);
+	id = id * 2 + ((disp3dcnt >> 2) & 0x1);
+	id = id * 2 + ((disp3dcnt >> 3) & 0x1);
+	rs->rast = rasterizers[id];
+	if ((polygon->texture >> 26) & 0x7)
+	{
+		uint8_t tex_id = gpu->tex_ids[polygon - gpu->g3d.front->polygons];
+		rs->tex = tex_id != GPU_TEX_NONE ? gpu->tex_cache[tex_id].data : NULL;
+		rs->tex_width = 8 << ((polygon->texture >> 20) & 0x7);
+		rs->tex_height = 8 << ((polygon->texture >> 23) & 0x7);
+		rs->s_mask = -1;
+		rs->s_flip = 0;
+		if (polygon->texture & (1 << 16))
+		{
+			rs->s_flip = (polygon->texture & (1 << 18)) ? rs->tex_width : 0;
+			rs->s_mask = rs->tex_width + rs->s_flip - 1;
+		}
+		rs->t_mask = -1;
+		rs->t_flip = 0;
+		if (polygon->texture & (1 << 17))
+		{
+			rs->t_flip = (polygon->texture & (1 << 19)) ? rs->tex_height : 0;
+			rs->t_mask = rs->tex_height + rs->t_flip - 1;
+		}
+	}
+	uint8_t a = (polygon->attr >> 16) & 0x1F;
+	if (!a) /* wireframe has solid wires */
+		a = 0x1F;
+	rs->alpha = TO6(a);
+	rs->alpha_ref = mem_arm9_get_reg8(gpu->mem, MEM_ARM9_REG_ALPHA_TEST_REF) & 0x1F;
+	rs->toon_highlight = (disp3dcnt >> 1) & 0x1;
+	rs->alpha_max = (polygon->attr >> 11) & 0x1;
+	rs->fog = (disp3dcnt & (1 << 7)) && (polygon->attr & (1 << 15));
+	if (rs->fog)
+	{
+		rs->fog_alpha = (disp3dcnt >> 6) & 0x1;
+		rs->fog_shift = (disp3dcnt >> 8) & 0xF;
+		rs->fog_offset = mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_FOG_OFFSET) & 0x7FFF;
+		rs->fog_color = mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_FOG_COLOR);
+		for (size_t i = 0; i < 32; ++i)
+			rs->fog_table[i] = mem_arm9_get_reg8(gpu->mem, MEM_ARM9_REG_FOG_TABLE + i);
+	}
+}
+
+static void draw_line_pixel(struct gpu *gpu, struct polygon *polygon,
+                            const struct raster_state *rs, int32_t x, int32_t y,
+                            int32_t *v0, int32_t *v1, int32_t *d)
+{
+	int32_t v[8];
+	interp_line(x, v0, v1, d, v);
+	rs->rast->pixel(gpu, polygon, rs, x, y, v);
+}
+
+static void draw_line(struct gpu *gpu, struct polygon *polygon,
+                      const struct raster_state *rs, const struct tile *tile, int32_t y,
                       int32_t yl0, int32_t yl1, int32_t yr0, int32_t yr1,
                       int32_t *vl, int32_t *vr, int32_t *dl, int32_t *dr)
 {
@@ -2001,6 +2619,9 @@ static void draw_line(struct gpu *gpu, struct polygon *polygon, int32_t y,
 	if (v1[0] / (1 << 4) < gpu->g3d.viewport_left
 	 || v0[0] / (1 << 4) > gpu->g3d.viewport_right)
 		return;
+	if (v1[0] / (1 << 4) < tile->left
+	 || v0[0] / (1 << 4) >= tile->right)
+		return;
 	if (yl0 / (1 << 4) != yl1 / (1 << 4))
 	{
 		int64_t num = (y - yl0) * (int64_t)vl[2];
@@ -2027,11 +2648,20 @@ static void draw_line(struct gpu *gpu, struct polygon *polygon, int32_t y,
 		for (size_t i = 1; i < 8; ++i)
 			v1[i] = vr[i];
 	}
+	struct gpu_g3d_buf *buf = gpu->g3d.front;
+	uint32_t row = y / (1 << 4);
+	uint32_t tx = tile->left / GPU_TILE_SIZE;
 	if (v0[0] / (1 << 4) == v1[0] / (1 << 4))
 	{
 		if (v0[0] / (1 << 4) >= gpu->g3d.viewport_left
-		 && v0[0] / (1 << 4) <= gpu->g3d.viewport_right)
-			draw_pixel(gpu, polygon, v0[0], y, v0);
+		 && v0[0] / (1 << 4) <= gpu->g3d.viewport_right
+		 && v0[0] / (1 << 4) >= tile->left
+		 && v0[0] / (1 << 4) < tile->right)
+		{
+			rs->rast->pixel(gpu, polygon, rs, v0[0], y, v0);
+			buf->hiz_dirty[row] |= 1 << tx;
+			tile->counts->pixels++;
+		}
 		return;
 	}
 	/* XXX edge */
@@ -2042,10 +2672,10 @@ static void draw_line(struct gpu *gpu, struct polygon *polygon, int32_t y,
 	{
 		if (v0[0] / (1 << 4) >= gpu->g3d.viewport_left
 		 && v0[0] / (1 << 4) <= gpu->g3d.viewport_right)
-			draw_pixel(gpu, polygon, v0[0], y, v0);
+			rs->rast->pixel(gpu, polygon, rs, v0[0], y, v0);
 		if (v1[0] / (1 << 4) >= gpu->g3d.viewport_left
 		 && v1[0] / (1 << 4) <= gpu->g3d.viewport_right)
-			draw_pixel(gpu, polygon, v1[0], y, v1);
+			rs->rast->pixel(gpu, polygon, rs, v1[0], y, v1);
 		return;
 	}
 #endif
@@ -2058,15 +2688,41 @@ static void draw_line(struct gpu *gpu, struct polygon *polygon, int32_t y,
 		minx = gpu->g3d.viewport_left * (1 << 4);
 	if (maxx / (1 << 4) > gpu->g3d.viewport_right)
 		maxx = gpu->g3d.viewport_right * (1 << 4);
-	draw_line_pixel(gpu, polygon, minx, y, v0, v1, d);
-	minx = (minx & ~0xF) + 0x12;
+	bool first = minx / (1 << 4) >= tile->left && minx / (1 << 4) < tile->right;
+	bool last = maxx / (1 << 4) >= tile->left && maxx / (1 << 4) < tile->right;
+	int32_t startx = (minx & ~0xF) + 0x12;
+	if (startx / (1 << 4) < tile->left)
+		startx += (tile->left - startx / (1 << 4)) * (1 << 4);
 	int32_t endx = maxx & ~0xF;
-	for (int32_t x = minx; x < endx; x += (1 << 4))
-		draw_line_pixel(gpu, polygon, x, y, v0, v1, d);
-	draw_line_pixel(gpu, polygon, maxx, y, v0, v1, d);
+	if (endx > tile->right * (1 << 4))
+		endx = tile->right * (1 << 4);
+	uint32_t pixels = first + last;
+	if (endx > startx)
+		pixels += (endx - startx + 0xF) / (1 << 4);
+	/* without clamping, the pixels are between v0 and v1 */
+	if (v0[2] > 0 && v1[2] > 0 && minx == v0[0] && maxx == v1[0]
+	 && hiz_occluded(polygon, v0[1] < v1[1] ? v0[1] : v1[1],
+	                 get_hiz(buf, row, tx)))
+	{
+		tile->counts->hiz_spans++;
+		tile->counts->hiz_pixels += pixels;
+		return;
+	}
+	if (first)
+		draw_line_pixel(gpu, polygon, rs, minx, y, v0, v1, d);
+	rs->rast->pixels(gpu, polygon, rs, startx, endx, y, v0, v1, d);
+	if (last)
+		draw_line_pixel(gpu, polygon, rs, maxx, y, v0, v1, d);
+	buf->hiz_dirty[row] |= 1 << tx;
+	tile->counts->pixels += pixels;
 }
 
+/* only the pixels inside the tile are drawn: each row and each pixel of
+ * a row is interpolated on its own, so a tile gets exactly the pixels
+ * the whole screen would
+ */
 static void draw_span(struct gpu *gpu, struct polygon *polygon,
+                      const struct raster_state *rs, const struct tile *tile,
                       struct vertex *vl0, struct vertex *vl1,
                       struct vertex *vr0, struct vertex *vr1,
                       int32_t y0, int32_t y1)
@@ -2109,15 +2765,21 @@ static void draw_span(struct gpu *gpu, struct polygon *polygon,
 
 #undef INIT_INTERP
 
-	draw_line(gpu, polygon, miny, vl0->screen_y, vl1->screen_y,
-	          vr0->screen_y, vr1->screen_y, vl, vr, dl, dr);
+	if (miny / (1 << 4) >= tile->top && miny / (1 << 4) < tile->bottom)
+		draw_line(gpu, polygon, rs, tile, miny, vl0->screen_y, vl1->screen_y,
+		          vr0->screen_y, vr1->screen_y, vl, vr, dl, dr);
 	miny = (miny & ~0xF) + 0x11;
+	if (miny / (1 << 4) < tile->top)
+		miny += (tile->top - miny / (1 << 4)) * (1 << 4);
 	int32_t endy = maxy & ~0xF;
+	if (endy > tile->bottom * (1 << 4))
+		endy = tile->bottom * (1 << 4);
 	for (int32_t y = miny; y < endy; y += (1 << 4))
-		draw_line(gpu, polygon, y, vl0->screen_y, vl1->screen_y,
+		draw_line(gpu, polygon, rs, tile, y, vl0->screen_y, vl1->screen_y,
+		          vr0->screen_y, vr1->screen_y, vl, vr, dl, dr);
+	if (maxy / (1 << 4) >= tile->top && maxy / (1 << 4) < tile->bottom)
+		draw_line(gpu, polygon, rs, tile, maxy, vl0->screen_y, vl1->screen_y,
 		          vr0->screen_y, vr1->screen_y, vl, vr, dl, dr);
-	draw_line(gpu, polygon, maxy, vl0->screen_y, vl1->screen_y,
-	          vr0->screen_y, vr1->screen_y, vl, vr, dl, dr);
 }
 
 static void sort_vertices(struct vertex **v1, struct vertex **v2,
@@ -2145,8 +2807,8 @@ static void sort_vertices(struct vertex **v1, struct vertex **v2,
 }
 
 static void draw_triangle(struct gpu *gpu, struct polygon *polygon,
-                          struct vertex *v1, struct vertex *v2,
-                          struct vertex *v3)
+                          const struct tile *tile, struct vertex *v1,
+                          struct vertex *v2, struct vertex *v3)
 {
 #if 0
 	printf("draw triangle:\n");
@@ -2163,13 +2825,6 @@ static void draw_triangle(struct gpu *gpu, struct polygon *polygon,
 	       I12_PRT(v3->screen_y * (1 << 8)),
 	       I12_PRT(v3->position.z));
 #endif
-	if (polygon->attr & (1 << 12))
-	{
-		if (v1->position.z >= 1
-		 || v2->position.z >= 1
-		 || v3->position.z >= 1)
-		return;
-	}
 	switch ((polygon->attr >> 0x4) & 0x3)
 	{
 		case 0: /* modulation */
@@ -2196,29 +2851,213 @@ static void draw_triangle(struct gpu *gpu, struct polygon *polygon,
 		case 3:
 			break;
 	}
+	struct raster_state rs;
+	init_raster_state(gpu, polygon, &rs);
 	sort_vertices(&v1, &v2, &v3);
 	if (v1->screen_y / (1 << 4) != v2->screen_y / (1 << 4))
-		draw_span(gpu, polygon, v1, v2, v1, v3, v1->screen_y, v2->screen_y);
+		draw_span(gpu, polygon, &rs, tile, v1, v2, v1, v3, v1->screen_y, v2->screen_y);
 	if (v2->screen_y / (1 << 4) != v3->screen_y / (1 << 4))
-		draw_span(gpu, polygon, v1, v3, v2, v3, v2->screen_y, v3->screen_y);
+		draw_span(gpu, polygon, &rs, tile, v1, v3, v2, v3, v2->screen_y, v3->screen_y);
 }
 
-void gpu_g3d_draw(struct gpu *gpu)
+/* sort the polygons by the tiles their bounding box touches, keeping
+ * their order in each tile, and get their decoded textures
+ */
+void gpu_g3d_bin(struct gpu *gpu)
 {
 	struct gpu_g3d_buf *buf = gpu->g3d.front;
-	for (uint16_t i = 0; i < buf->polygons_nb; ++i)
+	uint32_t counts[GPU_TILES] = {0};
+	uint32_t total = 0;
+	if (gpu->tex_gen != gpu->mem->vram_tex_gen)
 	{
-		struct polygon *polygon = &buf->polygons[i];
-		draw_triangle(gpu, polygon,
-		              &buf->vertexes[polygon->vertexes[0]],
-		              &buf->vertexes[polygon->vertexes[1]],
-		              &buf->vertexes[polygon->vertexes[2]]);
-		if (polygon->quad)
+		tex_cache_flush(gpu);
+		gpu->tex_gen = gpu->mem->vram_tex_gen;
+	}
+	gpu->tex_frame++;
+	struct polygon *last = NULL;
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		if (pass)
+		{
+			if (total > gpu->bins_size)
+			{
+				uint16_t *bins = realloc(gpu->bins, sizeof(*bins) * total);
+				if (!bins)
+				{
+					printf("failed to allocate 3d bins\n");
+					memset(gpu->bins_start, 0, sizeof(gpu->bins_start));
+					return;
+				}
+				gpu->bins = bins;
+				gpu->bins_size = total;
+			}
+			uint32_t start = 0;
+			for (size_t i = 0; i < GPU_TILES; ++i)
+			{
+				gpu->bins_start[i] = start;
+				start += counts[i];
+				counts[i] = gpu->bins_start[i];
+			}
+			gpu->bins_start[GPU_TILES] = start;
+		}
+		for (uint16_t i = 0; i < buf->polygons_nb; ++i)
 		{
-			draw_triangle(gpu, polygon,
-			              &buf->vertexes[polygon->vertexes[0]],
-			              &buf->vertexes[polygon->vertexes[2]],
-			              &buf->vertexes[polygon->vertexes[3]]);
+			struct polygon *polygon = &buf->polygons[i];
+			int32_t minx = INT32_MAX;
+			int32_t maxx = INT32_MIN;
+			int32_t miny = INT32_MAX;
+			int32_t maxy = INT32_MIN;
+			for (size_t j = 0; j < (polygon->quad ? 4u : 3u); ++j)
+			{
+				struct vertex *v = &buf->vertexes[polygon->vertexes[j]];
+				int32_t x = v->screen_x / (1 << 4);
+				int32_t y = v->screen_y / (1 << 4);
+				if (x < minx)
+					minx = x;
+				if (x > maxx)
+					maxx = x;
+				if (y < miny)
+					miny = y;
+				if (y > maxy)
+					maxy = y;
+			}
+			if (minx < gpu->g3d.viewport_left)
+				minx = gpu->g3d.viewport_left;
+			if (maxx > gpu->g3d.viewport_right)
+				maxx = gpu->g3d.viewport_right;
+			if (miny < gpu->g3d.viewport_top)
+				miny = gpu->g3d.viewport_top;
+			if (maxy > gpu->g3d.viewport_bottom)
+				maxy = gpu->g3d.viewport_bottom;
+			if (maxx > 255)
+				maxx = 255;
+			if (maxy > 191)
+				maxy = 191;
+			if (minx > maxx || miny > maxy)
+				continue;
+			if (!pass)
+			{
+				if (last
+				 && polygon->texture == last->texture
+				 && polygon->pltt_base == last->pltt_base)
+					gpu->tex_ids[i] = gpu->tex_ids[last - buf->polygons];
+				else
+					gpu->tex_ids[i] = tex_cache_get(gpu, polygon->texture,
+					                                polygon->pltt_base);
+				last = polygon;
+			}
+			for (int32_t ty = miny / GPU_TILE_SIZE; ty <= maxy / GPU_TILE_SIZE; ++ty)
+			{
+				for (int32_t tx = minx / GPU_TILE_SIZE; tx <= maxx / GPU_TILE_SIZE; ++tx)
+				{
+					uint32_t n = counts[ty * GPU_TILES_X + tx]++;
+					if (pass)
+						gpu->bins[n] = i;
+					else
+						total++;
+				}
+			}
+		}
+	}
+}
+
+/* draw the rows [top, bottom) of the 3d frame, from the bins
+ * polygons are drawn in the same order in every tile, tiles and bands
+ * can be drawn in any order (and concurrently) and give the same pixels
+ * as a whole screen traversal
+ */
+void gpu_g3d_draw_band(struct gpu *gpu, uint8_t top, uint8_t bottom)
+{
+	struct gpu_g3d_buf *buf = gpu->g3d.front;
+	struct band_counts counts = {0};
+	for (uint32_t ty = top / GPU_TILE_SIZE; ty * GPU_TILE_SIZE < bottom; ++ty)
+	{
+		for (uint32_t tx = 0; tx < GPU_TILES_X; ++tx)
+		{
+			struct tile tile;
+			tile.left = tx * GPU_TILE_SIZE;
+			tile.right = tile.left + GPU_TILE_SIZE;
+			tile.top = ty * GPU_TILE_SIZE;
+			tile.bottom = tile.top + GPU_TILE_SIZE;
+			tile.counts = &counts;
+			if (tile.top < top)
+				tile.top = top;
+			if (tile.bottom > bottom)
+				tile.bottom = bottom;
+			uint32_t n = ty * GPU_TILES_X + tx;
+			/* empty tiles are left uncleared */
+			if (gpu->bins_start[n] != gpu->bins_start[n + 1])
+				clear_tile(gpu, buf, tx, tile.top, tile.bottom);
+			for (uint32_t i = gpu->bins_start[n]; i < gpu->bins_start[n + 1]; ++i)
+			{
+				struct polygon *polygon = &buf->polygons[gpu->bins[i]];
+				if (tile_occluded(gpu, buf, polygon, &tile))
+				{
+					counts.hiz_tiles++;
+					continue;
+				}
+				draw_triangle(gpu, polygon, &tile,
+				              &buf->vertexes[polygon->vertexes[0]],
+				              &buf->vertexes[polygon->vertexes[1]],
+				              &buf->vertexes[polygon->vertexes[2]]);
+				if (polygon->quad)
+				{
+					draw_triangle(gpu, polygon, &tile,
+					              &buf->vertexes[polygon->vertexes[0]],
+					              &buf->vertexes[polygon->vertexes[2]],
+					              &buf->vertexes[polygon->vertexes[3]]);
+				}
+			}
+		}
+	}
+	__atomic_add_fetch(&gpu->g3d_pixels, counts.pixels, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&gpu->hiz_tiles, counts.hiz_tiles, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&gpu->hiz_spans, counts.hiz_spans, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&gpu->hiz_pixels, counts.hiz_pixels, __ATOMIC_RELAXED);
+}
+
+void gpu_g3d_draw(struct gpu *gpu)
+{
+	gpu_g3d_bin(gpu);
+	gpu_g3d_draw_band(gpu, 0, 192);
+}
+
+/* the depth buffer holds the clip space z, the 15 bits depths of the
+ * clear image are taken as the ones of a w of 1: the farthest one stays
+ * behind everything
+ */
+static int32_t rear_depth(uint16_t depth)
+{
+	depth &= 0x7FFF;
+	if (depth == 0x7FFF)
+		return INT32_MAX;
+	return ((int32_t)depth * 2 - 0x7FFF) * (1 << 12) / 0x7FFF;
+}
+
+/* the color and depth images of the slots 2 and 3 are read once, when
+ * the frame is swapped, the fog bits are left out as the fog is only
+ * applied to the pixels of the polygons
+ */
+static void decode_clear_image(struct gpu *gpu, const struct gpu_g3d_buf *buf)
+{
+	for (uint32_t row = 0; row < 192; ++row)
+	{
+		/* the image is in screen space, rows are bottom up in the buffer */
+		uint8_t y = (191 - row) + (buf->clear_offset >> 8);
+		uint8_t *data = &gpu->clear_data[256 * row * 4];
+		int32_t *zbuf = &gpu->clear_zbuf[256 * row];
+		for (uint32_t x = 0; x < 256; ++x)
+		{
+			uint8_t xx = x + buf->clear_offset;
+			uint32_t offset = (y * 256 + xx) * 2;
+			uint16_t color = mem_vram_trpi_get16(gpu->mem, 0x40000 + offset);
+			uint16_t depth = mem_vram_trpi_get16(gpu->mem, 0x60000 + offset);
+			data[0] = TO8((color >> 0x0A) & 0x1F);
+			data[1] = TO8((color >> 0x05) & 0x1F);
+			data[2] = TO8((color >> 0x00) & 0x1F);
+			data[3] = (color & (1 << 15)) ? 0x1F : 0;
+			zbuf[x] = rear_depth(depth);
+			data += 4;
 		}
 	}
 }
@@ -2237,50 +3076,79 @@ void gpu_g3d_swap_buffers(struct gpu *gpu)
 	gpu->g3d.front = tmp;
 	gpu->g3d.back->vertexes_nb = 0;
 	gpu->g3d.back->polygons_nb = 0;
-	uint32_t clear_color = mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_CLEAR_COLOR);
-	uint8_t clearv[4];
-	clearv[0] = TO8((clear_color >> 0x0A) & 0x1F);
-	clearv[1] = TO8((clear_color >> 0x05) & 0x1F);
-	clearv[2] = TO8((clear_color >> 0x00) & 0x1F);
-	clearv[3] = (clear_color >> 0x10) & 0x1F;
+	for (size_t i = 0; i < 4; ++i)
+		gpu->g3d.strip_ids[i] = -1;
+	struct gpu_g3d_buf *buf = gpu->g3d.front;
+	buf->clear_color = mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_CLEAR_COLOR);
+	buf->clear_offset = mem_arm9_get_reg16(gpu->mem, MEM_ARM9_REG_CLRIMAGE_OFFSET);
+	buf->clear_image = (mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_DISP3DCNT) >> 14) & 0x1;
+	if (buf->clear_image)
+		decode_clear_image(gpu, buf);
 #if 0
-	printf("[GX] clear color: 0x%08" PRIx32 " (%" PRIu8 ", %" PRIu8 ", %" PRIu8 ", %" PRIu8 ")\n",
-	       clear_color, clearv[0], clearv[1], clearv[2], clearv[3]);
+	printf("[GX] clear color: 0x%08" PRIx32 " image: %" PRIu8 "\n",
+	       buf->clear_color, buf->clear_image);
 #endif
-	struct gpu_g3d_buf *buf = gpu->g3d.front;
-	for (size_t i = 0; i < sizeof(buf->data); i += 4)
-		*(uint32_t*)&buf->data[i] = *(uint32_t*)&clearv[0];
-	for (size_t i = 0; i < sizeof(buf->zbuf) / sizeof(*buf->zbuf); ++i)
-		buf->zbuf[i] = INT32_MAX;
+	memset(buf->cleared, 0, sizeof(buf->cleared));
 }
 
-static void mtx_mult(struct matrix *r, const struct matrix *a,
-                     const struct matrix *b)
+#ifdef GPU_AVX2
+/* the four fp12_mul of a column are done at once, truncated like the
+ * scalar ones: only the low 32 bits of the shifted products are kept
+ */
+__attribute__((target("avx2")))
+static void mtx_mult_vec4_avx2(struct vec4 *r, const struct matrix *m,
+                               const struct vec4 *v)
 {
-	int32_t *fr = (int32_t*)r;
-	int32_t *fa = (int32_t*)a;
-	int32_t *fb = (int32_t*)b;
-	for (int y = 0; y < 4; ++y)
+	const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+	const __m256i round = _mm256_set1_epi64x(0xFFF);
+	const struct vec4 *rows = &m->x;
+	const int32_t f[4] = {v->x, v->y, v->z, v->w};
+	__m128i sum = _mm_setzero_si128();
+	for (size_t i = 0; i < 4; ++i)
 	{
-		for (int x = 0; x < 4; ++x)
-			fr[y + x * 4] = fp12_mul(fa[y + 0x0], fb[0 + x * 4])
-			              + fp12_mul(fa[y + 0x4], fb[1 + x * 4])
-			              + fp12_mul(fa[y + 0x8], fb[2 + x * 4])
-			              + fp12_mul(fa[y + 0xC], fb[3 + x * 4]);
+		__m256i row = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i*)&rows[i]));
+		__m256i p = _mm256_mul_epi32(row, _mm256_set1_epi64x(f[i]));
+		p = _mm256_add_epi64(p, _mm256_and_si256(_mm256_cmpgt_epi64(_mm256_setzero_si256(), p), round));
+		p = _mm256_srli_epi64(p, 12);
+		p = _mm256_permutevar8x32_epi32(p, pack);
+		sum = _mm_add_epi32(sum, _mm256_castsi256_si128(p));
 	}
+	_mm_storeu_si128((__m128i*)r, sum);
 }
+#endif
 
-static void mtx_mult_vec4(struct vec4 *r, struct matrix *m, struct vec4 *v)
+/* r may be v */
+static void mtx_mult_vec4(struct gpu *gpu, struct vec4 *r, const struct matrix *m,
+                          const struct vec4 *v)
 {
-#define MULT_COMP(X) r->X = fp12_mul(v->x, m->x.X) \
-                          + fp12_mul(v->y, m->y.X) \
-                          + fp12_mul(v->z, m->z.X) \
-                          + fp12_mul(v->w, m->w.X)
+#ifdef GPU_AVX2
+	if (gpu->avx2)
+	{
+		mtx_mult_vec4_avx2(r, m, v);
+		return;
+	}
+#endif
+	struct vec4 t;
+#define MULT_COMP(X) t.X = fp12_mul(v->x, m->x.X) \
+                         + fp12_mul(v->y, m->y.X) \
+                         + fp12_mul(v->z, m->z.X) \
+                         + fp12_mul(v->w, m->w.X)
 	MULT_COMP(x);
 	MULT_COMP(y);
 	MULT_COMP(z);
 	MULT_COMP(w);
 #undef MULT_COMP
+	*r = t;
+}
+
+/* each column of r is a column of b transformed by a, r may be b */
+static void mtx_mult(struct gpu *gpu, struct matrix *r, const struct matrix *a,
+                     const struct matrix *b)
+{
+	mtx_mult_vec4(gpu, &r->x, a, &b->x);
+	mtx_mult_vec4(gpu, &r->y, a, &b->y);
+	mtx_mult_vec4(gpu, &r->z, a, &b->z);
+	mtx_mult_vec4(gpu, &r->w, a, &b->w);
 }
 
 static void mtx_mult_vec3(struct vec3 *r, struct matrix *m, struct vec3 *v)
@@ -2306,9 +3174,15 @@ static inline void mtx_print(const struct matrix *m)
 	       I12_PRT(m->x.w), I12_PRT(m->y.w), I12_PRT(m->z.w), I12_PRT(m->w.w));
 }
 
-static void update_clip_matrix(struct gpu *gpu)
+/* the clip matrix is only computed when a vertex, a test or a read of
+ * CLIPMTX_RESULT needs it: the matrix commands only mark it dirty
+ */
+struct matrix *gpu_g3d_clip_matrix(struct gpu *gpu)
 {
-	mtx_mult(&gpu->g3d.clip_matrix,
+	if (!gpu->g3d.clip_dirty)
+		return &gpu->g3d.clip_matrix;
+	gpu->g3d.clip_dirty = 0;
+	mtx_mult(gpu, &gpu->g3d.clip_matrix,
 	         &gpu->g3d.proj_matrix,
 	         &gpu->g3d.pos_matrix);
 #if 0
@@ -2319,13 +3193,12 @@ static void update_clip_matrix(struct gpu *gpu)
 	printf("clip:\n");
 	mtx_print(&gpu->g3d.clip_matrix);
 #endif
+	return &gpu->g3d.clip_matrix;
 }
 
 static void set_stack_error(struct gpu *gpu)
 {
-	mem_arm9_set_reg32(gpu->mem, MEM_ARM9_REG_GXSTAT,
-	                   mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_GXSTAT)
-	                 | (1 << 15));
+	gpu->g3d.gxstat |= 1 << 15;
 }
 
 static void cmd_mtx_mode(struct gpu *gpu, uint32_t *params)
@@ -2355,10 +3228,8 @@ static void cmd_mtx_push(struct gpu *gpu, uint32_t *params)
 				break;
 			}
 			gpu->g3d.proj_stack_pos++;
-			mem_arm9_set_reg32(gpu->mem, MEM_ARM9_REG_GXSTAT,
-			                   (mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_GXSTAT)
-			                  & ~(1 << 13))
-			                  | (gpu->g3d.proj_stack_pos << 13));
+			gpu->g3d.gxstat = (gpu->g3d.gxstat & ~(1 << 13))
+			                | (gpu->g3d.proj_stack_pos << 13);
 			break;
 		case 1:
 		case 2:
@@ -2373,10 +3244,8 @@ static void cmd_mtx_push(struct gpu *gpu, uint32_t *params)
 			}
 			gpu->g3d.pos_stack_pos++;
 			gpu->g3d.pos_stack_pos &= 0x3F;
-			mem_arm9_set_reg32(gpu->mem, MEM_ARM9_REG_GXSTAT,
-			                   (mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_GXSTAT)
-			                  & ~(0x1F << 8))
-			                  | ((gpu->g3d.pos_stack_pos & 0x1F) << 8));
+			gpu->g3d.gxstat = (gpu->g3d.gxstat & ~(0x1F << 8))
+			                | ((gpu->g3d.pos_stack_pos & 0x1F) << 8);
 			break;
 		case 3:
 			gpu->g3d.tex_stack[0] = gpu->g3d.tex_matrix;
@@ -2415,7 +3284,7 @@ static void cmd_mtx_pop(struct gpu *gpu, uint32_t *params)
 				gpu->g3d.proj_stack_pos--;
 			}
 			gpu->g3d.proj_matrix = gpu->g3d.proj_stack[gpu->g3d.proj_stack_pos];
-			update_clip_matrix(gpu);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 1:
 		case 2:
@@ -2451,7 +3320,7 @@ static void cmd_mtx_pop(struct gpu *gpu, uint32_t *params)
 			}
 			gpu->g3d.pos_matrix = gpu->g3d.pos_stack[gpu->g3d.pos_stack_pos];
 			gpu->g3d.dir_matrix = gpu->g3d.dir_stack[gpu->g3d.pos_stack_pos];
-			update_clip_matrix(gpu);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 3:
 			if (!gpu->g3d.tex_stack_pos)
@@ -2511,7 +3380,7 @@ static void cmd_mtx_restore(struct gpu *gpu, uint32_t *params)
 	{
 		case 0:
 			gpu->g3d.proj_matrix = gpu->g3d.proj_stack[0];
-			update_clip_matrix(gpu);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 1:
 		case 2:
@@ -2524,7 +3393,7 @@ static void cmd_mtx_restore(struct gpu *gpu, uint32_t *params)
 			}
 			gpu->g3d.pos_matrix = gpu->g3d.pos_stack[n];
 			gpu->g3d.dir_matrix = gpu->g3d.dir_stack[n];
-			update_clip_matrix(gpu);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 3:
 			gpu->g3d.tex_matrix = gpu->g3d.tex_stack[0];
@@ -2555,16 +3424,16 @@ static void cmd_mtx_identity(struct gpu *gpu, uint32_t *params)
 	{
 		case 0:
 			load_identity(&gpu->g3d.proj_matrix);
-			update_clip_matrix(gpu);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 1:
 			load_identity(&gpu->g3d.pos_matrix);
-			update_clip_matrix(gpu);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 2:
 			load_identity(&gpu->g3d.pos_matrix);
 			load_identity(&gpu->g3d.dir_matrix);
-			update_clip_matrix(gpu);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 3:
 			load_identity(&gpu->g3d.tex_matrix);
@@ -2602,16 +3471,16 @@ static void cmd_mtx_load_4x4(struct gpu *gpu, uint32_t *params)
 	{
 		case 0:
 			load_4x4(&gpu->g3d.proj_matrix, params);
-			update_clip_matrix(gpu);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 1:
 			load_4x4(&gpu->g3d.pos_matrix, params);
-			update_clip_matrix(gpu);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 2:
 			load_4x4(&gpu->g3d.pos_matrix, params);
 			load_4x4(&gpu->g3d.dir_matrix, params);
-			update_clip_matrix(gpu);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 3:
 			load_4x4(&gpu->g3d.tex_matrix, params);
@@ -2649,16 +3518,16 @@ static void cmd_mtx_load_4x3(struct gpu *gpu, uint32_t *params)
 	{
 		case 0:
 			load_4x3(&gpu->g3d.proj_matrix, params);
-			update_clip_matrix(gpu);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 1:
 			load_4x3(&gpu->g3d.pos_matrix, params);
-			update_clip_matrix(gpu);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 2:
 			load_4x3(&gpu->g3d.pos_matrix, params);
 			load_4x3(&gpu->g3d.dir_matrix, params);
-			update_clip_matrix(gpu);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 3:
 			load_4x3(&gpu->g3d.tex_matrix, params);
@@ -2666,10 +3535,10 @@ static void cmd_mtx_load_4x3(struct gpu *gpu, uint32_t *params)
 	}
 }
 
-static void mult_4x4(struct matrix *a, struct matrix *b)
+static void mult_4x4(struct gpu *gpu, struct matrix *a, struct matrix *b)
 {
 	struct matrix r;
-	mtx_mult(&r, a, b);
+	mtx_mult(gpu, &r, a, b);
 	*a = r;
 }
 
@@ -2684,20 +3553,20 @@ static void cmd_mtx_mult_4x4(struct gpu *gpu, uint32_t *params)
 	switch (gpu->g3d.matrix_mode & 0x3)
 	{
 		case 0:
-			mult_4x4(&gpu->g3d.proj_matrix, &matrix);
-			update_clip_matrix(gpu);
+			mult_4x4(gpu, &gpu->g3d.proj_matrix, &matrix);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 1:
-			mult_4x4(&gpu->g3d.pos_matrix, &matrix);
-			update_clip_matrix(gpu);
+			mult_4x4(gpu, &gpu->g3d.pos_matrix, &matrix);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 2:
-			mult_4x4(&gpu->g3d.pos_matrix, &matrix);
-			mult_4x4(&gpu->g3d.dir_matrix, &matrix);
-			update_clip_matrix(gpu);
+			mult_4x4(gpu, &gpu->g3d.pos_matrix, &matrix);
+			mult_4x4(gpu, &gpu->g3d.dir_matrix, &matrix);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 3:
-			mult_4x4(&gpu->g3d.tex_matrix, &matrix);
+			mult_4x4(gpu, &gpu->g3d.tex_matrix, &matrix);
 			break;
 	}
 }
@@ -2713,20 +3582,20 @@ static void cmd_mtx_mult_4x3(struct gpu *gpu, uint32_t *params)
 	switch (gpu->g3d.matrix_mode & 0x3)
 	{
 		case 0:
-			mult_4x4(&gpu->g3d.proj_matrix, &matrix);
-			update_clip_matrix(gpu);
+			mult_4x4(gpu, &gpu->g3d.proj_matrix, &matrix);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 1:
-			mult_4x4(&gpu->g3d.pos_matrix, &matrix);
-			update_clip_matrix(gpu);
+			mult_4x4(gpu, &gpu->g3d.pos_matrix, &matrix);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 2:
-			mult_4x4(&gpu->g3d.pos_matrix, &matrix);
-			mult_4x4(&gpu->g3d.dir_matrix, &matrix);
-			update_clip_matrix(gpu);
+			mult_4x4(gpu, &gpu->g3d.pos_matrix, &matrix);
+			mult_4x4(gpu, &gpu->g3d.dir_matrix, &matrix);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 3:
-			mult_4x4(&gpu->g3d.tex_matrix, &matrix);
+			mult_4x4(gpu, &gpu->g3d.tex_matrix, &matrix);
 			break;
 	}
 }
@@ -2762,20 +3631,20 @@ static void cmd_mtx_mult_3x3(struct gpu *gpu, uint32_t *params)
 	switch (gpu->g3d.matrix_mode & 0x3)
 	{
 		case 0:
-			mult_4x4(&gpu->g3d.proj_matrix, &matrix);
-			update_clip_matrix(gpu);
+			mult_4x4(gpu, &gpu->g3d.proj_matrix, &matrix);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 1:
-			mult_4x4(&gpu->g3d.pos_matrix, &matrix);
-			update_clip_matrix(gpu);
+			mult_4x4(gpu, &gpu->g3d.pos_matrix, &matrix);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 2:
-			mult_4x4(&gpu->g3d.pos_matrix, &matrix);
-			mult_4x4(&gpu->g3d.dir_matrix, &matrix);
-			update_clip_matrix(gpu);
+			mult_4x4(gpu, &gpu->g3d.pos_matrix, &matrix);
+			mult_4x4(gpu, &gpu->g3d.dir_matrix, &matrix);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 3:
-			mult_4x4(&gpu->g3d.tex_matrix, &matrix);
+			mult_4x4(gpu, &gpu->g3d.tex_matrix, &matrix);
 			break;
 	}
 }
@@ -2807,12 +3676,12 @@ static void cmd_mtx_scale(struct gpu *gpu, uint32_t *params)
 	{
 		case 0:
 			mtx_scale(&gpu->g3d.proj_matrix, params);
-			update_clip_matrix(gpu);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 1:
 		case 2:
 			mtx_scale(&gpu->g3d.pos_matrix, params);
-			update_clip_matrix(gpu);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 3:
 			mtx_scale(&gpu->g3d.tex_matrix, params);
@@ -2820,7 +3689,7 @@ static void cmd_mtx_scale(struct gpu *gpu, uint32_t *params)
 	}
 }
 
-static void mtx_trans(struct matrix *m, uint32_t *params)
+static void mtx_trans(struct gpu *gpu, struct matrix *m, uint32_t *params)
 {
 	struct matrix tmp;
 	tmp.x.x = (1 << 12);
@@ -2839,7 +3708,7 @@ static void mtx_trans(struct matrix *m, uint32_t *params)
 	tmp.w.y = params[1];
 	tmp.w.z = params[2];
 	tmp.w.w = (1 << 12);
-	mult_4x4(m, &tmp);
+	mult_4x4(gpu, m, &tmp);
 }
 
 static void cmd_mtx_trans(struct gpu *gpu, uint32_t *params)
@@ -2852,20 +3721,20 @@ static void cmd_mtx_trans(struct gpu *gpu, uint32_t *params)
 	switch (gpu->g3d.matrix_mode & 0x3)
 	{
 		case 0:
-			mtx_trans(&gpu->g3d.proj_matrix, params);
-			update_clip_matrix(gpu);
+			mtx_trans(gpu, &gpu->g3d.proj_matrix, params);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 1:
-			mtx_trans(&gpu->g3d.pos_matrix, params);
-			update_clip_matrix(gpu);
+			mtx_trans(gpu, &gpu->g3d.pos_matrix, params);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 2:
-			mtx_trans(&gpu->g3d.pos_matrix, params);
-			mtx_trans(&gpu->g3d.dir_matrix, params);
-			update_clip_matrix(gpu);
+			mtx_trans(gpu, &gpu->g3d.pos_matrix, params);
+			mtx_trans(gpu, &gpu->g3d.dir_matrix, params);
+			gpu->g3d.clip_dirty = 1;
 			break;
 		case 3:
-			mtx_trans(&gpu->g3d.tex_matrix, params);
+			mtx_trans(gpu, &gpu->g3d.tex_matrix, params);
 			break;
 	}
 }
@@ -2888,6 +3757,93 @@ static int32_t get_int10_9(uint16_t v)
 	return ((int32_t)(int16_t)(v << 6)) / (1 << 3);
 }
 
+#ifdef GPU_AVX2
+/* fp12_mul of 4 lanes holding int32 values, sign extended to 64 bits */
+#define FP12_MUL_4X64(a, b) \
+	sext_4x64(_mm256_srli_epi64(trunc_4x64(_mm256_mul_epi32(a, b)), 12))
+
+__attribute__((target("avx2")))
+static inline __m256i trunc_4x64(__m256i p)
+{
+	return _mm256_add_epi64(p, _mm256_and_si256(_mm256_cmpgt_epi64(_mm256_setzero_si256(), p),
+	                                             _mm256_set1_epi64x(0xFFF)));
+}
+
+/* the low 32 bits of each lane, sign extended */
+__attribute__((target("avx2")))
+static inline __m256i sext_4x64(__m256i v)
+{
+	__m256i dup = _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 0, 0));
+	return _mm256_blend_epi32(v, _mm256_srai_epi32(dup, 31), 0xAA);
+}
+
+/* the four lights of cmd_normal at once, one per 64 bits lane, with the
+ * same integer results: every channel term is positive, so the division
+ * by 31 is a multiplication by the inverse
+ */
+__attribute__((target("avx2")))
+static void light_normal_avx2(struct gpu *gpu, const struct vec3 *nr)
+{
+	const struct light_block *block = &gpu->g3d.light_block;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i n[3] =
+	{
+		_mm256_set1_epi64x(nr->x),
+		_mm256_set1_epi64x(nr->y),
+		_mm256_set1_epi64x(nr->z),
+	};
+	uint8_t attr = gpu->g3d.commit_polygon_attr;
+	__m256i enabled = _mm256_setr_epi64x(attr & (1 << 0) ? -1 : 0,
+	                                     attr & (1 << 1) ? -1 : 0,
+	                                     attr & (1 << 2) ? -1 : 0,
+	                                     attr & (1 << 3) ? -1 : 0);
+	__m256i diffuse_factor = zero;
+	__m256i specular_factor = zero;
+	for (size_t i = 0; i < 3; ++i)
+	{
+		__m256i dir = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i*)block->dir[i]));
+		__m256i halfdir = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i*)block->halfdir[i]));
+		diffuse_factor = _mm256_add_epi64(diffuse_factor, FP12_MUL_4X64(dir, n[i]));
+		specular_factor = _mm256_add_epi64(specular_factor, FP12_MUL_4X64(halfdir, n[i]));
+	}
+	diffuse_factor = sext_4x64(diffuse_factor);
+	diffuse_factor = _mm256_and_si256(_mm256_cmpgt_epi64(zero, diffuse_factor),
+	                                  _mm256_sub_epi64(zero, diffuse_factor));
+	specular_factor = sext_4x64(specular_factor);
+	specular_factor = FP12_MUL_4X64(specular_factor, specular_factor);
+	specular_factor = _mm256_and_si256(specular_factor, _mm256_cmpgt_epi64(specular_factor, zero));
+	__m256i one = _mm256_set1_epi64x(1 << 12);
+	__m256i over = _mm256_cmpgt_epi64(specular_factor, one);
+	specular_factor = _mm256_blendv_epi8(specular_factor, one, over);
+	if (gpu->g3d.specular_table)
+	{
+		int64_t f[4];
+		_mm256_storeu_si256((__m256i*)f, specular_factor);
+		for (size_t i = 0; i < 4; ++i)
+			f[i] = gpu->g3d.shininess[f[i] >> 5];
+		specular_factor = _mm256_loadu_si256((const __m256i*)f);
+	}
+	const int32_t ambient[3] = {gpu->g3d.ambient.x, gpu->g3d.ambient.y, gpu->g3d.ambient.z};
+	const int32_t diffuse[3] = {gpu->g3d.diffuse.x, gpu->g3d.diffuse.y, gpu->g3d.diffuse.z};
+	const int32_t specular[3] = {gpu->g3d.specular.x, gpu->g3d.specular.y, gpu->g3d.specular.z};
+	int32_t *color[3] = {&gpu->g3d.color.x, &gpu->g3d.color.y, &gpu->g3d.color.z};
+	for (size_t i = 0; i < 3; ++i)
+	{
+		__m256i light_color = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i*)block->color[i]));
+		__m256i v = _mm256_set1_epi64x(ambient[i]);
+		v = _mm256_add_epi64(v, FP12_MUL_4X64(_mm256_set1_epi64x(diffuse[i]), diffuse_factor));
+		v = _mm256_add_epi64(v, FP12_MUL_4X64(_mm256_set1_epi64x(specular[i]), specular_factor));
+		v = _mm256_mul_epi32(light_color, v);
+		v = _mm256_srli_epi64(_mm256_mul_epu32(v, _mm256_set1_epi64x(0x84210843)), 36); /* / 31 */
+		v = _mm256_and_si256(v, enabled);
+		__m128i sum = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+		*color[i] += _mm_cvtsi128_si32(sum) + _mm_extract_epi32(sum, 2);
+	}
+}
+
+#undef FP12_MUL_4X64
+#endif
+
 static void cmd_normal(struct gpu *gpu, uint32_t *params)
 {
 	struct vec3 normal;
@@ -2912,6 +3868,11 @@ static void cmd_normal(struct gpu *gpu, uint32_t *params)
 	gpu->g3d.color.x = gpu->g3d.emission.x;
 	gpu->g3d.color.y = gpu->g3d.emission.y;
 	gpu->g3d.color.z = gpu->g3d.emission.z;
+#ifdef GPU_AVX2
+	if (gpu->avx2)
+		light_normal_avx2(gpu, &nr);
+	else
+#endif
 	for (size_t i = 0; i < 4; ++i)
 	{
 		if (!(gpu->g3d.commit_polygon_attr & (1 << i)))
@@ -2988,49 +3949,239 @@ static void cmd_texcoord(struct gpu *gpu, uint32_t *params)
 	}
 }
 
-static void push_triangle(struct gpu *gpu, uint16_t v1, uint16_t v2,
-                          uint16_t v3)
+/* the room in the polygon ram is checked by push_polygon */
+static void add_polygon(struct gpu *gpu, const uint16_t *vertexes, uint8_t quad)
 {
-	if (gpu->g3d.back->polygons_nb == sizeof(gpu->g3d.back->polygons) / sizeof(*gpu->g3d.back->polygons))
-	{
-		printf("[GX] polygons buffer overflow\n");
-		return;
-	}
 #if 0
-	printf("[GX] push triangle %" PRIu16 " {%" PRIu16 ", %" PRIu16 ", %" PRIu16 "}\n",
-	       gpu->g3d.back->polygons_nb, v1, v2, v3);
+	printf("[GX] push %s %" PRIu16 " {%" PRIu16 ", %" PRIu16 ", %" PRIu16 "}\n",
+	       quad ? "quad" : "triangle", gpu->g3d.back->polygons_nb,
+	       vertexes[0], vertexes[1], vertexes[2]);
 #endif
 	struct polygon *polygon = &gpu->g3d.back->polygons[gpu->g3d.back->polygons_nb++];
-	polygon->quad = 0;
+	polygon->quad = quad;
 	polygon->attr = gpu->g3d.commit_polygon_attr;
 	polygon->texture = gpu->g3d.texture;
 	polygon->pltt_base = gpu->g3d.pltt_base;
-	polygon->vertexes[0] = v1;
-	polygon->vertexes[1] = v2;
-	polygon->vertexes[2] = v3;
+	polygon->vertexes[0] = vertexes[0];
+	polygon->vertexes[1] = vertexes[1];
+	polygon->vertexes[2] = vertexes[2];
+	if (quad)
+		polygon->vertexes[3] = vertexes[3];
 }
 
-static void push_quad(struct gpu *gpu, uint16_t v1, uint16_t v2, uint16_t v3,
-                      uint16_t v4)
+static void project_vertex(struct gpu *gpu, struct vertex *v)
 {
-	if (gpu->g3d.back->polygons_nb == sizeof(gpu->g3d.back->polygons) / sizeof(*gpu->g3d.back->polygons))
+	if (v->position.w)
 	{
-		printf("[GX] polygons buffer overflow\n");
-		return;
+		int64_t viewport_width = gpu->g3d.viewport_right - gpu->g3d.viewport_left + 1;
+		int64_t viewport_height = gpu->g3d.viewport_bottom - gpu->g3d.viewport_top + 1;
+		v->screen_x = fp12_div((v->position.x + v->position.w) * viewport_width, 2 * v->position.w);
+		v->screen_x = (v->screen_x >> 8) + gpu->g3d.viewport_left * (1 << 4);
+		v->screen_y = fp12_div((v->position.y + v->position.w) * viewport_height, 2 * v->position.w);
+		v->screen_y = (v->screen_y >> 8) + gpu->g3d.viewport_top * (1 << 4);
+	}
+	else
+	{
+		v->screen_x = 0;
+		v->screen_y = 0;
+	}
+}
+
+/* a quad clipped by the 6 planes has at most 10 vertexes */
+#define CLIP_VERTEXES 10
+
+/* signed distance of a vertex to a plane of the frustum, negative when
+ * outside: planes are -x, +x, -y, +y, -z, +z
+ */
+static int64_t clip_dist(const struct vertex *v, uint8_t plane)
+{
+	int64_t c;
+	switch (plane / 2)
+	{
+		case 0:
+			c = v->position.x;
+			break;
+		case 1:
+			c = v->position.y;
+			break;
+		default:
+			c = v->position.z;
+			break;
+	}
+	if (plane & 1)
+		return v->position.w - c;
+	return v->position.w + c;
+}
+
+static uint8_t clip_codes(const struct vertex *v)
+{
+	uint8_t codes = 0;
+	for (uint8_t plane = 0; plane < 6; ++plane)
+	{
+		if (clip_dist(v, plane) < 0)
+			codes |= 1 << plane;
+	}
+	return codes;
+}
+
+/* vertex where the edge ab crosses a plane, da and db being the
+ * distances of a and b to it
+ */
+static void clip_edge(struct vertex *dst, const struct vertex *a,
+                      const struct vertex *b, int64_t da, int64_t db,
+                      uint8_t plane)
+{
+	int64_t num = da;
+	int64_t den = da - db;
+	while (den > INT32_MAX || den < -INT32_MAX)
+	{
+		num /= 2;
+		den /= 2;
+	}
+#define CLIP_LERP(var) \
+	dst->var = a->var + (b->var - (int64_t)a->var) * num / den
+
+	CLIP_LERP(position.x);
+	CLIP_LERP(position.y);
+	CLIP_LERP(position.z);
+	CLIP_LERP(position.w);
+	CLIP_LERP(color.x);
+	CLIP_LERP(color.y);
+	CLIP_LERP(color.z);
+	CLIP_LERP(texcoord.x);
+	CLIP_LERP(texcoord.y);
+
+#undef CLIP_LERP
+
+	/* put it on the plane, whatever the rounding */
+	int32_t c = (plane & 1) ? dst->position.w : -dst->position.w;
+	switch (plane / 2)
+	{
+		case 0:
+			dst->position.x = c;
+			break;
+		case 1:
+			dst->position.y = c;
+			break;
+		default:
+			dst->position.z = c;
+			break;
 	}
+}
+
+/* when the vertex or the polygon ram is full, the polygons that don't
+ * fit are dropped and the overflow flag of DISP3DCNT is set (merged in
+ * the register when it's read)
+ */
+static void ram_overflow(struct gpu *gpu)
+{
 #if 0
-	printf("[GX] push quad %" PRIu16 " {%" PRIu16 ", %" PRIu16 ", %" PRIu16 ", %" PRIu16 "}\n",
-	       gpu->g3d.back->polygons_nb, v1, v2, v3, v4);
+	printf("[GX] polygon / vertex ram overflow\n");
 #endif
-	struct polygon *polygon = &gpu->g3d.back->polygons[gpu->g3d.back->polygons_nb++];
-	polygon->quad = 1;
-	polygon->attr = gpu->g3d.commit_polygon_attr;
-	polygon->texture = gpu->g3d.texture;
-	polygon->pltt_base = gpu->g3d.pltt_base;
-	polygon->vertexes[0] = v1;
-	polygon->vertexes[1] = v2;
-	polygon->vertexes[2] = v3;
-	polygon->vertexes[3] = v4;
+	gpu->g3d.ram_overflow = 1;
+}
+
+/* polygons are clipped in clip space, before the perspective divide:
+ * the ones outside of the frustum are dropped, the ones crossing it are
+ * cut to the part inside, with new vertexes, and given as a fan of
+ * quads (drawn as the (0, 1, 2) (0, 2, 3) triangles) and triangles
+ * like the hardware, only the vertexes of the polygons that are kept
+ * go to the vertex ram, once even when they're shared by a strip
+ */
+static void push_polygon(struct gpu *gpu, const uint8_t *slots, uint8_t count)
+{
+	struct gpu_g3d_buf *buf = gpu->g3d.back;
+	struct vertex *strip = gpu->g3d.strip;
+	int16_t *strip_ids = gpu->g3d.strip_ids;
+	uint8_t codes_or = 0;
+	uint8_t codes_and = 0x3F;
+	for (uint8_t i = 0; i < count; ++i)
+	{
+		uint8_t codes = clip_codes(&strip[slots[i]]);
+		codes_or |= codes;
+		codes_and &= codes;
+	}
+	if (codes_and)
+		return;
+	/* without the bit 12 of the attributes, the polygons crossing the
+	 * far plane are hidden instead of clipped
+	 */
+	if ((codes_or & (1 << 5)) && !(gpu->g3d.commit_polygon_attr & (1 << 12)))
+		return;
+	struct vertex clip[2][CLIP_VERTEXES];
+	int8_t ids[2][CLIP_VERTEXES]; /* strip slot, or -1 for a new vertex */
+	uint8_t n = count;
+	uint8_t cur = 0;
+	for (uint8_t i = 0; i < count; ++i)
+	{
+		clip[0][i] = strip[slots[i]];
+		ids[0][i] = slots[i];
+	}
+	for (uint8_t plane = 0; plane < 6; ++plane)
+	{
+		if (!(codes_or & (1 << plane)))
+			continue;
+		uint8_t m = 0;
+		for (uint8_t i = 0; i < n; ++i)
+		{
+			const struct vertex *a = &clip[cur][i];
+			const struct vertex *b = &clip[cur][(i + 1) % n];
+			int64_t da = clip_dist(a, plane);
+			int64_t db = clip_dist(b, plane);
+			if (da >= 0)
+			{
+				clip[!cur][m] = *a;
+				ids[!cur][m] = ids[cur][i];
+				m++;
+			}
+			if ((da >= 0) != (db >= 0))
+			{
+				clip_edge(&clip[!cur][m], a, b, da, db, plane);
+				ids[!cur][m] = -1;
+				m++;
+			}
+		}
+		cur = !cur;
+		n = m;
+		if (n < 3)
+			return;
+	}
+	uint32_t vertexes = 0;
+	for (uint8_t i = 0; i < n; ++i)
+	{
+		if (ids[cur][i] < 0 || strip_ids[ids[cur][i]] < 0)
+			vertexes++;
+	}
+	if (buf->vertexes_nb + vertexes > GPU_VERTEXES
+	 || buf->polygons_nb + (n - 1) / 2u > GPU_POLYGONS)
+	{
+		ram_overflow(gpu);
+		return;
+	}
+	uint16_t out[CLIP_VERTEXES];
+	for (uint8_t i = 0; i < n; ++i)
+	{
+		int8_t slot = ids[cur][i];
+		if (slot >= 0 && strip_ids[slot] >= 0)
+		{
+			out[i] = strip_ids[slot];
+			continue;
+		}
+		struct vertex *v = &buf->vertexes[buf->vertexes_nb];
+		*v = clip[cur][i];
+		if (slot < 0)
+			project_vertex(gpu, v);
+		else
+			strip_ids[slot] = buf->vertexes_nb;
+		out[i] = buf->vertexes_nb++;
+	}
+	for (uint8_t i = 1; i + 1 < n; i += 2)
+	{
+		uint16_t fan[4] = {out[0], out[i], out[i + 1], 0};
+		if (i + 2 < n)
+			fan[3] = out[i + 2];
+		add_polygon(gpu, fan, i + 2 < n);
+	}
 }
 
 static void push_vertex(struct gpu *gpu)
@@ -3044,30 +4195,20 @@ static void push_vertex(struct gpu *gpu)
 		                     + fp12_mul(gpu->g3d.position.y, gpu->g3d.tex_matrix.y.y)
 		                     + fp12_mul(gpu->g3d.position.z, gpu->g3d.tex_matrix.y.z);
 	}
-	if (gpu->g3d.back->vertexes_nb == sizeof(gpu->g3d.back->vertexes) / sizeof(*gpu->g3d.back->vertexes))
+	struct vertex *strip = gpu->g3d.strip;
+	int16_t *strip_ids = gpu->g3d.strip_ids;
+	for (size_t i = 0; i < 3; ++i)
 	{
-		printf("[GX] vertexes buffer overflow\n");
-		return;
+		strip[i] = strip[i + 1];
+		strip_ids[i] = strip_ids[i + 1];
 	}
-	struct vertex *v = &gpu->g3d.back->vertexes[gpu->g3d.back->vertexes_nb++];
-	mtx_mult_vec4(&v->position, &gpu->g3d.clip_matrix, &gpu->g3d.position);
+	strip_ids[3] = -1;
+	struct vertex *v = &strip[3];
+	mtx_mult_vec4(gpu, &v->position, gpu_g3d_clip_matrix(gpu), &gpu->g3d.position);
 	v->color = gpu->g3d.color;
 	v->texcoord.x = gpu->g3d.texcoord.x / (1 << 8);
 	v->texcoord.y = gpu->g3d.texcoord.y / (1 << 8);
-	if (v->position.w)
-	{
-		int64_t viewport_width = gpu->g3d.viewport_right - gpu->g3d.viewport_left + 1;
-		int64_t viewport_height = gpu->g3d.viewport_bottom - gpu->g3d.viewport_top + 1;
-		v->screen_x = fp12_div((v->position.x + v->position.w) * viewport_width, 2 * v->position.w);
-		v->screen_x = (v->screen_x >> 8) + gpu->g3d.viewport_left * (1 << 4);
-		v->screen_y = fp12_div((v->position.y + v->position.w) * viewport_height, 2 * v->position.w);
-		v->screen_y = (v->screen_y >> 8) + gpu->g3d.viewport_top * (1 << 4);
-	}
-	else
-	{
-		v->screen_x = 0;
-		v->screen_y = 0;
-	}
+	project_vertex(gpu, v);
 #if 0
 	printf("[GX] push vertex {" I12_FMT ", " I12_FMT ", " I12_FMT "}\n",
 	       I12_PRT(gpu->g3d.position.x),
@@ -3089,6 +4230,7 @@ static void push_vertex(struct gpu *gpu)
 	       I12_PRT(v->screen_x * (1 << 8)),
 	       I12_PRT(v->screen_y * (1 << 8)));
 #endif
+	static const uint8_t slots[4] = {0, 1, 2, 3};
 	switch (gpu->g3d.primitive)
 	{
 		case PRIMITIVE_TRIANGLES:
@@ -3098,10 +4240,7 @@ static void push_vertex(struct gpu *gpu)
 				break;
 			}
 			gpu->g3d.tmp_vertex = 0;
-			push_triangle(gpu,
-			              gpu->g3d.back->vertexes_nb - 3,
-			              gpu->g3d.back->vertexes_nb - 2,
-			              gpu->g3d.back->vertexes_nb - 1);
+			push_polygon(gpu, &slots[1], 3);
 			break;
 		case PRIMITIVE_QUADS:
 			if (gpu->g3d.tmp_vertex < 3)
@@ -3110,11 +4249,7 @@ static void push_vertex(struct gpu *gpu)
 				break;
 			}
 			gpu->g3d.tmp_vertex = 0;
-			push_quad(gpu,
-			              gpu->g3d.back->vertexes_nb - 4,
-			              gpu->g3d.back->vertexes_nb - 3,
-			              gpu->g3d.back->vertexes_nb - 2,
-			              gpu->g3d.back->vertexes_nb - 1);
+			push_polygon(gpu, &slots[0], 4);
 			break;
 		case PRIMITIVE_TRIANGLE_STRIP:
 			if (gpu->g3d.tmp_vertex < 2)
@@ -3124,17 +4259,12 @@ static void push_vertex(struct gpu *gpu)
 			}
 			if (gpu->g3d.tmp_vertex & 1)
 			{
-				push_triangle(gpu,
-				              gpu->g3d.back->vertexes_nb - 2,
-				              gpu->g3d.back->vertexes_nb - 3,
-				              gpu->g3d.back->vertexes_nb - 1);
+				uint8_t vertexes[3] = {2, 1, 3};
+				push_polygon(gpu, vertexes, 3);
 			}
 			else
 			{
-				push_triangle(gpu,
-				              gpu->g3d.back->vertexes_nb - 3,
-				              gpu->g3d.back->vertexes_nb - 2,
-				              gpu->g3d.back->vertexes_nb - 1);
+				push_polygon(gpu, &slots[1], 3);
 			}
 			gpu->g3d.tmp_vertex++;
 			break;
@@ -3143,11 +4273,10 @@ static void push_vertex(struct gpu *gpu)
 				break;
 			if (gpu->g3d.tmp_vertex & 1)
 				break;
-			push_quad(gpu,
-			              gpu->g3d.back->vertexes_nb - 4,
-			              gpu->g3d.back->vertexes_nb - 3,
-			              gpu->g3d.back->vertexes_nb - 1,
-			              gpu->g3d.back->vertexes_nb - 2);
+			{
+				uint8_t vertexes[4] = {0, 1, 3, 2};
+				push_polygon(gpu, vertexes, 4);
+			}
 			break;
 	}
 }
@@ -3331,6 +4460,13 @@ static void cmd_light_vector(struct gpu *gpu, uint32_t *params)
 	light->halfdir.x = -light->dir.x / 2;
 	light->halfdir.y = -light->dir.y / 2;
 	light->halfdir.z = (-light->dir.z - 1) / 2;
+	struct light_block *block = &gpu->g3d.light_block;
+	block->dir[0][light_id] = light->dir.x;
+	block->dir[1][light_id] = light->dir.y;
+	block->dir[2][light_id] = light->dir.z;
+	block->halfdir[0][light_id] = light->halfdir.x;
+	block->halfdir[1][light_id] = light->halfdir.y;
+	block->halfdir[2][light_id] = light->halfdir.z;
 }
 
 static void cmd_light_color(struct gpu *gpu, uint32_t *params)
@@ -3343,6 +4479,10 @@ static void cmd_light_color(struct gpu *gpu, uint32_t *params)
 	light->color.x = (params[0] >>  0) & 0x1F;
 	light->color.y = (params[0] >>  5) & 0x1F;
 	light->color.z = (params[0] >> 10) & 0x1F;
+	struct light_block *block = &gpu->g3d.light_block;
+	block->color[0][light_id] = light->color.x;
+	block->color[1][light_id] = light->color.y;
+	block->color[2][light_id] = light->color.z;
 }
 
 static void cmd_shininess(struct gpu *gpu, uint32_t *params)
@@ -3413,8 +4553,7 @@ static void cmd_box_test(struct gpu *gpu, uint32_t *params)
 	       params[0], params[1], params[2]);
 #endif
 	/* XXX */
-	mem_arm9_set_reg32(gpu->mem, MEM_ARM9_REG_GXSTAT,
-	                   mem_arm9_get_reg32(gpu->mem, MEM_ARM9_REG_GXSTAT) | (1 << 1));
+	gpu->g3d.gxstat |= 1 << 1;
 }
 
 static void cmd_pos_test(struct gpu *gpu, uint32_t *params)
@@ -3428,7 +4567,7 @@ static void cmd_pos_test(struct gpu *gpu, uint32_t *params)
 	pos.y = get_int16_12((params[0] >> 16) & 0xFFFF);
 	pos.z = get_int16_12((params[1] >>  0) & 0xFFFF);
 	pos.w = 1;
-	mtx_mult_vec4(&pos, &gpu->g3d.clip_matrix, &pos);
+	mtx_mult_vec4(gpu, &pos, gpu_g3d_clip_matrix(gpu), &pos);
 #if 0
 	printf("pos: {" I12_FMT ", " I12_FMT ", " I12_FMT ", " I12_FMT "}\n",
 	       I12_PRT(pos.x), I12_PRT(pos.y), I12_PRT(pos.z), I12_PRT(pos.w));
@@ -25,6 +25,50 @@ struct gpu_eng
 	int engb;
 };
 
+/* the 3d is drawn by tiles, polygons are binned by the tiles they touch */
+#define GPU_TILE_SIZE 32
+#define GPU_TILES_X   (256 / GPU_TILE_SIZE)
+#define GPU_TILES_Y   (192 / GPU_TILE_SIZE)
+#define GPU_TILES     (GPU_TILES_X * GPU_TILES_Y)
+
+/* decoded textures, kept until their slots are remapped */
+#define GPU_TEX_CACHE       64
+#define GPU_TEX_CACHE_BYTES (16 * 1024 * 1024)
+#define GPU_TEX_NONE        0xFF
+
+/* a texture decoded for a TEXIMAGE_PARAM and PLTT_BASE pair: 4 bytes
+ * per texel, the TO6 rgba of get_tex_color, or an alpha of 0xFF for
+ * the transparent ones
+ */
+struct gpu_tex
+{
+	uint32_t texture; /* TEXIMAGE_PARAM without the repeat / flip / transform bits */
+	uint32_t pltt_base;
+	uint32_t frame; /* last frame it was used */
+	uint32_t size; /* bytes allocated */
+	uint8_t *data;
+	int valid;
+};
+
+/* engine registers, DISPCNT to MASTER_BRIGHT */
+#define GPU_ENG_REGS 0x70
+
+/* state of an engine when a line is drawn, latched by the emulation */
+struct gpu_eng_line
+{
+	uint8_t regs[GPU_ENG_REGS];
+	int32_t bg2x;
+	int32_t bg2y;
+	int32_t bg3x;
+	int32_t bg3y;
+};
+
+struct gpu_line
+{
+	struct gpu_eng_line eng[2];
+	uint32_t powcnt1;
+};
+
 struct vec4
 {
 	int32_t x;
@@ -72,14 +116,24 @@ struct polygon
 	uint16_t vertexes[4];
 };
 
+/* sizes of the vertex and polygon ram */
+#define GPU_VERTEXES 6144
+#define GPU_POLYGONS 2048
+
 struct gpu_g3d_buf
 {
 	uint8_t data[256 * 192 * 4];
 	int32_t zbuf[256 * 192];
-	struct vertex vertexes[6144 * 10]; /* XXX don't do this :D */
-	struct polygon polygons[2048 * 10];
+	struct vertex *vertexes; /* GPU_VERTEXES */
+	struct polygon *polygons; /* GPU_POLYGONS */
 	uint16_t vertexes_nb;
 	uint16_t polygons_nb;
+	uint8_t cleared[192]; /* tile columns of each row holding their clear */
+	uint32_t clear_color;
+	uint16_t clear_offset; /* CLRIMAGE_OFFSET */
+	uint8_t clear_image; /* rear plane read from the texture slots */
+	int32_t hiz[192 * GPU_TILES_X]; /* depth upper bound of each row of a tile */
+	uint8_t hiz_dirty[192]; /* tile columns of each row above their depths */
 };
 
 struct light
@@ -89,6 +143,16 @@ struct light
 	struct vec3 color;
 };
 
+/* the lights as one column per light, for the vectorized lighting:
+ * updated by LIGHT_VECTOR and LIGHT_COLOR
+ */
+struct light_block
+{
+	int32_t dir[3][4];
+	int32_t halfdir[3][4];
+	int32_t color[3][4];
+};
+
 struct gpu_g3d
 {
 	struct gpu_g3d_buf bufs[2];
@@ -102,7 +166,7 @@ struct gpu_g3d
 	struct matrix pos_matrix;
 	struct matrix dir_matrix;
 	struct matrix tex_matrix;
-	struct matrix clip_matrix;
+	struct matrix clip_matrix; /* proj * pos, when clip_dirty is 0 */
 	uint8_t shininess[128];
 	struct light lights[4];
 	uint16_t toon[32];
@@ -112,6 +176,7 @@ struct gpu_g3d
 	struct vec3 specular;
 	struct vec3 emission;
 	uint8_t specular_table;
+	uint8_t clip_dirty;
 	uint8_t matrix_mode;
 	uint8_t proj_stack_pos;
 	uint8_t pos_stack_pos;
@@ -123,6 +188,8 @@ struct gpu_g3d
 	uint32_t commit_polygon_attr;
 	uint8_t primitive;
 	uint8_t tmp_vertex;
+	struct vertex strip[4]; /* the last 4 vertexes pushed, for the strips */
+	int16_t strip_ids[4]; /* their index in the vertex ram, -1 until a polygon uses them */
 	uint8_t swap_buffers;
 	uint8_t viewport_left;
 	uint8_t viewport_right;
@@ -130,6 +197,12 @@ struct gpu_g3d
 	uint8_t viewport_bottom;
 	uint32_t texture;
 	uint32_t pltt_base;
+	struct light_block light_block;
+	/* written by the gx commands, which may run on the gx thread: they
+	 * are merged in the registers when they're read
+	 */
+	uint32_t gxstat; /* box test result, stack levels and error of GXSTAT */
+	uint8_t ram_overflow; /* DISP3DCNT bit 13 */
 };
 
 struct gpu
@@ -137,16 +210,42 @@ struct gpu
 	struct gpu_eng enga;
 	struct gpu_eng engb;
 	struct gpu_g3d g3d;
+	struct gpu_line lines[192];
+	uint8_t clear_data[256 * 192 * 4]; /* front clear image, decoded on swap */
+	int32_t clear_zbuf[256 * 192];
+	uint16_t *bins; /* polygons of each tile, in submission order */
+	uint32_t bins_size;
+	uint32_t bins_start[GPU_TILES + 1]; /* first bin entry of each tile */
+	struct gpu_tex tex_cache[GPU_TEX_CACHE];
+	uint8_t tex_ids[GPU_POLYGONS]; /* cache entry of each front polygon */
+	uint32_t tex_gen; /* mem->vram_tex_gen the cache was decoded from */
+	uint32_t tex_frame;
+	uint32_t tex_bytes; /* bytes allocated by the cache */
+	uint64_t tex_hits;
+	uint64_t tex_misses;
+	uint64_t tex_decoded; /* bytes decoded */
+	uint64_t g3d_pixels; /* pixels rasterized, over 256x192 it's the overdraw */
+	uint64_t hiz_tiles; /* polygons rejected from a whole tile */
+	uint64_t hiz_spans; /* rows of a polygon rejected in a tile */
+	uint64_t hiz_pixels; /* pixels of the rejected rows */
 	struct mem *mem;
 	int capture;
+	int g3d_observed; /* the 3d output is displayed or captured this frame */
+	int avx2; /* avx2 and fma line interpolation */
 };
 
 struct gpu *gpu_new(struct mem *mem);
 void gpu_del(struct gpu *gpu);
 
+void gpu_latch(struct gpu *gpu, uint8_t y);
 void gpu_draw(struct gpu *gpu, uint8_t y);
+void gpu_draw_eng(struct gpu *gpu, struct gpu_eng *eng, uint8_t y);
 void gpu_commit_bgpos(struct gpu *gpu);
+void gpu_g3d_bin(struct gpu *gpu);
+int gpu_g3d_is_observed(struct gpu *gpu);
+struct matrix *gpu_g3d_clip_matrix(struct gpu *gpu);
 void gpu_g3d_draw(struct gpu *gpu);
+void gpu_g3d_draw_band(struct gpu *gpu, uint8_t top, uint8_t bottom);
 void gpu_g3d_swap_buffers(struct gpu *gpu);
 
 void gpu_gx_cmd(struct gpu *gpu, uint8_t cmd, uint32_t *params);
@@ -1,3 +1,5 @@
+#include <sys/stat.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -116,6 +118,84 @@ void retro_set_environment(retro_environment_t cb)
 	};
 
 	cb(RETRO_ENVIRONMENT_SET_CONTROLLER_INFO, (void*)ports);
+
+	static const struct retro_variable variables[] =
+	{
+		{"emu_nds_cpu", "CPU core; interpreter|cached|jit"},
+		{"emu_nds_hle_bios", "HLE BIOS; disabled|enabled"},
+		{"emu_nds_boot", "Boot; firmware|direct"},
+		{"emu_nds_boot_cache", "Boot state cache; disabled|enabled"},
+		{"emu_nds_boot_cache_frame", "Boot state cache frame; 1|60|120|300|600|1200"},
+		{"emu_nds_gpu_spin", "GPU thread spin budget; auto|0|500|2000|10000|50000"},
+		{"emu_nds_2d_threads", "2D line threads (0 draws inline); auto|0|1|2|3|4"},
+		{"emu_nds_3d_threads", "3D rasterizer threads; auto|1|2|3|4|6|8"},
+		{NULL, NULL},
+	};
+
+	cb(RETRO_ENVIRONMENT_SET_VARIABLES, (void*)variables);
+}
+
+static const char *get_variable(const char *key)
+{
+	struct retro_variable var;
+
+	var.key = key;
+	var.value = NULL;
+	if (!environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var))
+		return NULL;
+	return var.value;
+}
+
+static void update_variables(void)
+{
+	struct retro_variable var;
+
+	var.key = "emu_nds_cpu";
+	var.value = NULL;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+	{
+		if (!strcmp(var.value, "jit"))
+			nds_set_exec(g_nds, NDS_EXEC_JIT);
+		else if (!strcmp(var.value, "cached"))
+			nds_set_exec(g_nds, NDS_EXEC_CACHED);
+		else
+			nds_set_exec(g_nds, NDS_EXEC_INTERPRETER);
+	}
+
+	var.key = "emu_nds_hle_bios";
+	var.value = NULL;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+		nds_set_hle_bios(g_nds, !strcmp(var.value, "enabled"));
+
+	var.key = "emu_nds_gpu_spin";
+	var.value = NULL;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+	{
+		if (!strcmp(var.value, "auto"))
+			nds_set_spin(g_nds, NDS_SPIN_AUTO);
+		else
+			nds_set_spin(g_nds, strtoul(var.value, NULL, 10));
+	}
+
+	var.key = "emu_nds_2d_threads";
+	var.value = NULL;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+	{
+		if (!strcmp(var.value, "auto"))
+			nds_set_gpu_threads(g_nds, NDS_GPU_THREADS_AUTO);
+		else
+			nds_set_gpu_threads(g_nds, strtoul(var.value, NULL, 10));
+	}
+
+	var.key = "emu_nds_3d_threads";
+	var.value = NULL;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+	{
+		if (!strcmp(var.value, "auto"))
+			nds_set_g3d_threads(g_nds, NDS_G3D_THREADS_AUTO);
+		else
+			nds_set_g3d_threads(g_nds, strtoul(var.value, NULL, 10));
+	}
 }
 
 void retro_set_audio_sample(retro_audio_sample_t cb)
@@ -153,6 +233,10 @@ static int16_t audio_buf[AUDIO_FRAME * 2];
 void retro_run(void)
 {
 	uint32_t joypad = 0;
+	bool updated = false;
+
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &updated) && updated)
+		update_variables();
 
 	input_poll_cb();
 
@@ -241,6 +325,96 @@ static bool load_bios(const char *name, uint8_t *data, size_t size)
 	return true;
 }
 
+static uint64_t hash(uint64_t h, const void *data, size_t size)
+{
+	/* fnv-1a, on 64 bits words */
+	const uint8_t *ptr = data;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t v;
+		memcpy(&v, &ptr[i], sizeof(v));
+		h = (h ^ v) * 0x100000001B3ULL;
+	}
+	for (; i < size; ++i)
+		h = (h ^ ptr[i]) * 0x100000001B3ULL;
+	return h;
+}
+
+/* restore the state at the given frame after boot if it was cached by a
+ * previous run with the same rom, bios, firmware and options, run the
+ * boot and store it otherwise
+ */
+static void boot_cache(const struct retro_game_info *info, const uint8_t *arm7_bios,
+                       const uint8_t *arm9_bios, const uint8_t *firmware)
+{
+	const char *enabled = get_variable("emu_nds_boot_cache");
+	if (!enabled || strcmp(enabled, "enabled"))
+		return;
+	const char *frames_var = get_variable("emu_nds_boot_cache_frame");
+	const char *boot_var = get_variable("emu_nds_boot");
+	const char *hle_var = get_variable("emu_nds_hle_bios");
+	unsigned frames = frames_var ? strtoul(frames_var, NULL, 10) : 1;
+	if (!frames)
+		frames = 1;
+
+	char config[256];
+	snprintf(config, sizeof(config), "%s;%s;%u",
+	         boot_var ? boot_var : "", hle_var ? hle_var : "", frames);
+	uint64_t key = 0xCBF29CE484222325ULL;
+	key = hash(key, info->data, info->size);
+	key = hash(key, arm7_bios, 0x4000);
+	key = hash(key, arm9_bios, 0x1000);
+	key = hash(key, firmware, 0x40000);
+	key = hash(key, config, strlen(config));
+
+	const char *dir;
+	if (!environ_cb(RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY, &dir) || !dir)
+		dir = system_dir;
+	char path[512];
+	char tmp_path[520];
+	snprintf(path, sizeof(path), "%s/emu_nds_cache", dir);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/emu_nds_cache/%016" PRIx64 ".state", dir, key);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	size_t size = nds_state_size(g_nds);
+	uint8_t *data = malloc(size);
+	if (!data)
+		return;
+	FILE *fp = fopen(path, "rb");
+	if (fp)
+	{
+		bool loaded = fread(data, 1, size, fp) == size
+		           && nds_load_state(g_nds, data, size);
+		fclose(fp);
+		if (loaded)
+		{
+			log_cb(RETRO_LOG_INFO, "boot state restored from %s\n", path);
+			free(data);
+			return;
+		}
+	}
+
+	for (unsigned i = 0; i < frames; ++i)
+		nds_frame(g_nds, &video_buf[0], 256 * 4, &video_buf[256 * 192 * 4], 256 * 4,
+		          audio_buf, 0, 0, 0, 0);
+	if (nds_save_state(g_nds, data, size))
+	{
+		fp = fopen(tmp_path, "wb");
+		if (fp)
+		{
+			bool written = fwrite(data, 1, size, fp) == size;
+			if (fclose(fp) || !written || rename(tmp_path, path))
+			{
+				log_cb(RETRO_LOG_ERROR, "failed to write boot state to %s\n", path);
+				remove(tmp_path);
+			}
+		}
+	}
+	free(data);
+}
+
 bool retro_load_game(const struct retro_game_info *info)
 {
 	struct retro_input_descriptor desc[] =
@@ -277,8 +451,11 @@ bool retro_load_game(const struct retro_game_info *info)
 		goto err;
 	}
 
+	const char *boot = get_variable("emu_nds_boot");
+	bool direct_boot = boot && !strcmp(boot, "direct");
+
 	nds_del(g_nds);
-	g_nds = nds_new(info->data, info->size);
+	g_nds = nds_new(info->data, info->size, direct_boot);
 	if (!g_nds)
 	{
 		log_cb(RETRO_LOG_ERROR, "can't create nds\n");
@@ -306,6 +483,8 @@ bool retro_load_game(const struct retro_game_info *info)
 	nds_set_arm7_bios(g_nds, arm7_bios);
 	nds_set_arm9_bios(g_nds, arm9_bios);
 	nds_set_firmware(g_nds, firmware);
+	update_variables();
+	boot_cache(info, arm7_bios, arm9_bios, firmware);
 	return true;
 
 err:
@@ -335,21 +514,23 @@ bool retro_load_game_special(unsigned type, const struct retro_game_info *info,
 
 size_t retro_serialize_size(void)
 {
-	return 0;
+	if (!g_nds)
+		return 0;
+	return nds_state_size(g_nds);
 }
 
 bool retro_serialize(void *data, size_t size)
 {
-	(void)data;
-	(void)size;
-	return false;
+	if (!g_nds)
+		return false;
+	return nds_save_state(g_nds, data, size);
 }
 
 bool retro_unserialize(const void *data, size_t size)
 {
-	(void)data;
-	(void)size;
-	return false;
+	if (!g_nds)
+		return false;
+	return nds_load_state(g_nds, data, size);
 }
 
 void *retro_get_memory_data(unsigned id)
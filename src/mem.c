@@ -5,6 +5,10 @@
 #include "apu.h"
 #include "gpu.h"
 
+#ifdef ENABLE_FASTMEM
+# include "fastmem.h"
+#endif
+
 #include <inttypes.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -51,6 +55,19 @@ static const uint8_t arm9_tcm_cycles_32[]  = {0, 1,  1, 1,  1};
 static const uint8_t arm9_tcm_cycles_16[]  = {0, 1,  1, 1,  1};
 static const uint8_t arm9_tcm_cycles_8[]   = {0, 1,  1, 1,  1};
 
+#define WAIT_CYCLES(name) {name##_cycles_8, name##_cycles_16, name##_cycles_32}
+
+const uint8_t *const mem_wait_cycles[MEM_WAIT_LAST][3] =
+{
+	[MEM_WAIT_ARM7_MRAM] = WAIT_CYCLES(arm7_mram),
+	[MEM_WAIT_ARM7_WRAM] = WAIT_CYCLES(arm7_wram),
+	[MEM_WAIT_ARM7_VRAM] = WAIT_CYCLES(arm7_vram),
+	[MEM_WAIT_ARM9_MRAM] = WAIT_CYCLES(arm9_mram),
+	[MEM_WAIT_ARM9_WRAM] = WAIT_CYCLES(arm9_wram),
+	[MEM_WAIT_ARM9_VRAM] = WAIT_CYCLES(arm9_vram),
+	[MEM_WAIT_ARM9_TCM]  = WAIT_CYCLES(arm9_tcm),
+};
+
 static const struct gx_cmd_def gx_cmd_defs[256] =
 {
 #define GX_CMD_DEF(name, params) \
@@ -99,12 +116,22 @@ static const struct gx_cmd_def gx_cmd_defs[256] =
 
 static void update_vram_maps(struct mem *mem);
 static void update_gxfifo_irq(struct mem *mem);
+static void arm7_update_pages(struct mem *mem, uint32_t start, uint32_t end);
+static void arm9_update_pages(struct mem *mem, uint32_t start, uint32_t end);
 
 struct mem *mem_new(struct nds *nds, struct mbc *mbc)
 {
+#ifdef ENABLE_FASTMEM
+	struct mem *mem;
+	if (posix_memalign((void**)&mem, 4096, sizeof(*mem)))
+		return NULL;
+	memset(mem, 0, sizeof(*mem));
+	mem->fastmem = fastmem_new(mem);
+#else
 	struct mem *mem = calloc(sizeof(*mem), 1);
 	if (!mem)
 		return NULL;
+#endif
 
 	mem->nds = nds;
 	mem->mbc = mbc;
@@ -119,11 +146,13 @@ struct mem *mem_new(struct nds *nds, struct mbc *mbc)
 	mem->spi_powerman.regs[0x0] = 0x0C; /* enable backlight */
 	mem->spi_powerman.regs[0x4] = 0x42; /* high brightness */
 	update_vram_maps(mem);
+	mem_arm7_update_pages(mem);
+	mem_arm9_update_pages(mem);
 	mem->sram_size = 0x40000 + mbc->backup_size;
 	mem->sram = calloc(mem->sram_size, 1);
 	if (!mem->sram)
 	{
-		free(mem);
+		mem_del(mem);
 		return NULL;
 	}
 	mbc->backup = &mem->sram[0x40000];
@@ -140,13 +169,20 @@ void mem_del(struct mem *mem)
 	if (!mem)
 		return;
 	free(mem->sram);
+#ifdef ENABLE_FASTMEM
+	fastmem_del(mem->fastmem);
+#endif
 	free(mem);
 }
 
+/* timers are brought up to date lazily: when their registers are accessed
+ * and on the scheduler event of the next overflow that can be observed
+ * (irq or count-up timer)
+ */
 #define ARM_TIMERS(armv) \
-static void arm##armv##_timers(struct mem *mem, uint32_t cycles) \
+static void arm##armv##_timers(struct mem *mem, uint64_t cycles) \
 { \
-	uint16_t prev_overflow = 0; \
+	uint32_t prev_overflow = 0; \
 	for (unsigned i = 0; i < 4; ++i) \
 	{ \
 		uint8_t cnt_h = mem_arm##armv##_get_reg8(mem, MEM_ARM##armv##_REG_TM0CNT_H + i * 4); \
@@ -155,45 +191,93 @@ static void arm##armv##_timers(struct mem *mem, uint32_t cycles) \
 			prev_overflow = 0; \
 			continue; \
 		} \
+		uint64_t v = mem->arm##armv##_timers[i].v; \
 		if (cnt_h & (1 << 2)) \
-			mem->arm##armv##_timers[i].v += cycles * (prev_overflow << 10); \
+			v += (uint64_t)prev_overflow << 10; \
 		else \
-			mem->arm##armv##_timers[i].v += cycles * timer_increments[cnt_h & 3]; \
+			v += (uint64_t)cycles * timer_increments[cnt_h & 3]; \
 		prev_overflow = 0; \
-		if (mem->arm##armv##_timers[i].v < (0x10000 << 10)) \
-			continue; \
-		do \
+		if (v >= (0x10000 << 10)) \
 		{ \
 			/* printf("[ARM" #armv "] timer %u overflow (cnt_h: %02" PRIx8 ")\n", i, cnt_h); */ \
-			mem->arm##armv##_timers[i].v -= (0x10000 << 10); \
-			mem->arm##armv##_timers[i].v += mem_arm##armv##_get_reg16(mem, MEM_ARM##armv##_REG_TM0CNT_L + i * 4) << 10; \
+			uint32_t reload = mem_arm##armv##_get_reg16(mem, MEM_ARM##armv##_REG_TM0CNT_L + i * 4) << 10; \
+			uint32_t period = (0x10000 << 10) - reload; \
+			v -= (0x10000 << 10); \
+			prev_overflow = 1 + v / period; \
+			v = reload + v % period; \
 			if (cnt_h & (1 << 6)) \
 				mem_arm##armv##_irq(mem, 1 << (3 + i)); \
-			prev_overflow++; \
 		} \
-		while (mem->arm##armv##_timers[i].v >= (0x10000 << 10)); \
+		mem->arm##armv##_timers[i].v = v; \
+	} \
+} \
+static uint64_t arm##armv##_timers_next(struct mem *mem) \
+{ \
+	uint64_t next = UINT64_MAX; \
+	for (unsigned i = 0; i < 4; ++i) \
+	{ \
+		uint8_t cnt_h = mem_arm##armv##_get_reg8(mem, MEM_ARM##armv##_REG_TM0CNT_H + i * 4); \
+		if ((cnt_h & ((1 << 7) | (1 << 2))) != (1 << 7)) \
+			continue; \
+		if (!(cnt_h & (1 << 6)) \
+		 && (i == 3 || (mem_arm##armv##_get_reg8(mem, MEM_ARM##armv##_REG_TM0CNT_H + i * 4 + 4) & 0x84) != 0x84)) \
+			continue; \
+		uint32_t inc = timer_increments[cnt_h & 3]; \
+		uint64_t ticks = ((0x10000 << 10) - mem->arm##armv##_timers[i].v + inc - 1) / inc; \
+		if (ticks < next) \
+			next = ticks; \
 	} \
+	return next; \
 } \
 static void arm##armv##_timer_control(struct mem *mem, uint8_t timer, uint8_t v) \
 { \
+	mem_timers(mem); \
 	uint8_t prev = mem_arm##armv##_get_reg8(mem, MEM_ARM##armv##_REG_TM0CNT_H + timer * 4); \
 	mem_arm##armv##_set_reg8(mem, MEM_ARM##armv##_REG_TM0CNT_H + timer * 4, v); \
 	if ((v & (1 << 7)) && !(prev & (1 << 7))) \
 		mem->arm##armv##_timers[timer].v = mem_arm##armv##_get_reg16(mem, MEM_ARM##armv##_REG_TM0CNT_L + timer * 4) << 10; \
+	mem_timers(mem); \
 }
 
 ARM_TIMERS(7);
 ARM_TIMERS(9);
 
-void mem_timers(struct mem *mem, uint32_t cycles)
+void mem_timers(struct mem *mem)
+{
+	/* timers run at half the arm9 clock */
+	uint64_t ticks = (mem->nds->cycle - mem->timers_cycle) / 2;
+	if (ticks)
+	{
+		mem->timers_cycle += ticks * 2;
+		arm7_timers(mem, ticks);
+		arm9_timers(mem, ticks);
+	}
+	uint64_t next = arm7_timers_next(mem);
+	uint64_t next9 = arm9_timers_next(mem);
+	if (next9 < next)
+		next = next9;
+	if (next == UINT64_MAX)
+		nds_schedule(mem->nds, NDS_EVENT_TIMERS, UINT64_MAX);
+	else
+		nds_schedule(mem->nds, NDS_EVENT_TIMERS, mem->timers_cycle + next * 2);
+}
+
+static uint32_t timer_get(struct mem *mem, struct timer *timer)
 {
-	arm7_timers(mem, cycles);
-	arm9_timers(mem, cycles);
+	mem_timers(mem);
+	return timer->v;
 }
 
 static void arm7_dma_start(struct mem *mem, uint8_t cond);
 static void arm9_dma_start(struct mem *mem, uint8_t cond);
 
+/* dma only run while one of them is active */
+static void dma_schedule(struct mem *mem)
+{
+	if (mem->nds->events[NDS_EVENT_DMA] == UINT64_MAX)
+		nds_schedule(mem->nds, NDS_EVENT_DMA, mem->nds->cycle + NDS_DMA_PERIOD);
+}
+
 #define ARM_DMA(armv) \
 static void arm##armv##_dma(struct mem *mem, uint8_t id, uint32_t cycles) \
 { \
@@ -365,6 +449,8 @@ static void arm##armv##_dma_control(struct mem *mem, uint8_t id) \
 			} \
 		} \
 	} \
+	if (dma->status == (MEM_DMA_ACTIVE | MEM_DMA_ENABLE)) \
+		dma_schedule(mem); \
 	if (0 && (dma->status & MEM_DMA_ENABLE)) \
 		printf("[ARM" #armv "] enable DMA %" PRIu8 " type %" PRId32 " of %08" PRIx32 " words from %08" PRIx32 " to %08" PRIx32 " CNT_H=%04" PRIx16 " PREV=%02" PRIx8 "\n",  \
 		       id, armv == 7 ? ((cnt_h >> 12) & 3) : ((cnt_h >> 11) & 7), \
@@ -394,6 +480,7 @@ static void arm##armv##_dma_start(struct mem *mem, uint8_t cond) \
 		arm##armv##_load_dma_length(mem, i); \
 		dma->cnt = 0; \
 		dma->status |= MEM_DMA_ACTIVE; \
+		dma_schedule(mem); \
 		if (armv == 7) \
 		{ \
 			if (cond == 2) \
@@ -416,16 +503,21 @@ static void arm##armv##_dma_start(struct mem *mem, uint8_t cond) \
 ARM_DMA(7);
 ARM_DMA(9);
 
-void mem_dma(struct mem *mem, uint32_t cycles)
+void mem_dma(struct mem *mem)
 {
-	arm7_dma(mem, 0, cycles);
-	arm7_dma(mem, 1, cycles);
-	arm7_dma(mem, 2, cycles);
-	arm7_dma(mem, 3, cycles);
-	arm9_dma(mem, 0, cycles);
-	arm9_dma(mem, 1, cycles);
-	arm9_dma(mem, 2, cycles);
-	arm9_dma(mem, 3, cycles);
+	for (uint8_t i = 0; i < 4; ++i)
+		arm7_dma(mem, i, NDS_DMA_BURST);
+	for (uint8_t i = 0; i < 4; ++i)
+		arm9_dma(mem, i, NDS_DMA_BURST);
+	for (uint8_t i = 0; i < 4; ++i)
+	{
+		if (mem->arm7_dma[i].status == (MEM_DMA_ACTIVE | MEM_DMA_ENABLE)
+		 || mem->arm9_dma[i].status == (MEM_DMA_ACTIVE | MEM_DMA_ENABLE))
+		{
+			dma_schedule(mem);
+			return;
+		}
+	}
 }
 
 void mem_vblank(struct mem *mem)
@@ -445,6 +537,23 @@ void mem_dscard(struct mem *mem)
 	arm9_dma_start(mem, 5);
 }
 
+/* registers written by the gx commands: accesses have to wait for the
+ * queued ones to be executed
+ *
+ * the emulated fifo is always seen empty, the commands being done as
+ * they're stored: how far the gx thread got isn't visible, so the runs
+ * don't depend on the host
+ */
+static inline void gx_sync(struct mem *mem)
+{
+#ifdef ENABLE_MULTITHREAD
+	if (mem->gx_async)
+		nds_gx_sync(mem->nds);
+#else
+	(void)mem;
+#endif
+}
+
 static void update_gxfifo_irq(struct mem *mem)
 {
 	/* nasty hack v2: fake non-available DMA if irq is running */
@@ -480,6 +589,116 @@ void mem_arm7_irq(struct mem *mem, uint32_t f)
 	cpu_update_irq_state(mem->nds->arm7);
 }
 
+uint32_t mem_arm9_code_addr(struct mem *mem, uint32_t addr)
+{
+	if ((addr & ~mem->itcm_mask) == mem->itcm_base)
+		return MEM_CODE_ITCM + (addr & 0x7FFF);
+	if ((addr & ~mem->dtcm_mask) == mem->dtcm_base)
+		return MEM_CODE_NONE;
+	if (addr >= 0xFFFF0000)
+		return MEM_CODE_ARM9_BIOS + (addr & 0xFFF);
+	switch ((addr >> 24) & 0xFF)
+	{
+		case 0x2:
+			return MEM_CODE_MRAM + (addr & 0x3FFFFF);
+		case 0x3:
+			if (!mem->arm9_wram_mask)
+				return MEM_CODE_NONE;
+			return MEM_CODE_WRAM + mem->arm9_wram_base + (addr & mem->arm9_wram_mask);
+	}
+	return MEM_CODE_NONE;
+}
+
+uint32_t mem_arm7_code_addr(struct mem *mem, uint32_t addr)
+{
+	switch ((addr >> 24) & 0xFF)
+	{
+		case 0x0:
+			if (addr >= sizeof(mem->arm7_bios))
+				return MEM_CODE_NONE;
+			return MEM_CODE_ARM7_BIOS + addr;
+		case 0x2:
+			return MEM_CODE_MRAM + (addr & 0x3FFFFF);
+		case 0x3:
+			if (!mem->arm7_wram_mask || addr >= 0x3800000)
+				return MEM_CODE_ARM7_WRAM + (addr & 0xFFFF);
+			return MEM_CODE_WRAM + mem->arm7_wram_base + (addr & mem->arm7_wram_mask);
+	}
+	return MEM_CODE_NONE;
+}
+
+void mem_code_add(struct mem *mem, uint32_t page)
+{
+	if (mem->code_pages[page])
+		return;
+	mem->code_pages[page] = 1;
+#ifdef ENABLE_FASTMEM
+	if (mem->fastmem)
+		fastmem_code_add(mem->fastmem, page);
+#endif
+}
+
+void mem_code_invalidate(struct mem *mem, uint32_t page)
+{
+	mem->code_pages[page] = 0;
+	cpu_invalidate_code(mem->nds->arm7, page);
+	cpu_invalidate_code(mem->nds->arm9, page);
+#ifdef ENABLE_FASTMEM
+	if (mem->fastmem)
+		fastmem_code_del(mem->fastmem, page);
+#endif
+}
+
+/* memory read by the 2d engines: stores have to wait for the lines
+ * being drawn from it by other threads
+ */
+static inline void gpu_write(struct mem *mem)
+{
+#ifdef ENABLE_MULTITHREAD
+	if (mem->gpu_async)
+		nds_gpu_sync(mem->nds);
+#else
+	(void)mem;
+#endif
+}
+
+static inline uint8_t gpu_pages_write(struct mem *mem)
+{
+#ifdef ENABLE_MULTITHREAD
+	return !mem->gpu_async;
+#else
+	(void)mem;
+	return 1;
+#endif
+}
+
+static inline void code_write(struct mem *mem, uint32_t addr)
+{
+	uint32_t page = addr >> MEM_CODE_PAGE_SHIFT;
+	if (mem->code_pages[page])
+		mem_code_invalidate(mem, page);
+}
+
+/* io registers only changing on events, irqs, scanlines or stores of
+ * the other cpu, which all wake idle cpus: polling them can be skipped
+ */
+static bool io_idle_safe(uint32_t addr)
+{
+	switch (addr & ~3)
+	{
+		case MEM_ARM9_REG_DISPSTAT:
+		case MEM_ARM9_REG_KEYINPUT:
+		case MEM_ARM7_REG_EXTKEYIN & ~3:
+		case MEM_ARM9_REG_IPCSYNC:
+		case MEM_ARM9_REG_IPCFIFOCNT:
+		case MEM_ARM9_REG_IME:
+		case MEM_ARM9_REG_IE:
+		case MEM_ARM9_REG_IF:
+			return true;
+	}
+	return false;
+}
+
 static uint8_t powerman_read(struct mem *mem)
 {
 #if 0
@@ -1095,17 +1314,9 @@ static void set_arm7_reg8(struct mem *mem, uint32_t addr, uint8_t v)
 		case MEM_ARM7_REG_IME + 2:
 		case MEM_ARM7_REG_IME + 3:
 		case MEM_ARM7_REG_POSTFLG:
-		case MEM_ARM7_REG_TM0CNT_L:
-		case MEM_ARM7_REG_TM0CNT_L + 1:
 		case MEM_ARM7_REG_TM0CNT_H + 1:
-		case MEM_ARM7_REG_TM1CNT_L:
-		case MEM_ARM7_REG_TM1CNT_L + 1:
 		case MEM_ARM7_REG_TM1CNT_H + 1:
-		case MEM_ARM7_REG_TM2CNT_L:
-		case MEM_ARM7_REG_TM2CNT_L + 1:
 		case MEM_ARM7_REG_TM2CNT_H + 1:
-		case MEM_ARM7_REG_TM3CNT_L:
-		case MEM_ARM7_REG_TM3CNT_L + 1:
 		case MEM_ARM7_REG_TM3CNT_H + 1:
 		case MEM_ARM7_REG_SOUNDBIAS:
 		case MEM_ARM7_REG_SOUNDBIAS + 1:
@@ -1537,6 +1748,17 @@ static void set_arm7_reg8(struct mem *mem, uint32_t addr, uint8_t v)
 			if (v)
 				cpu_update_irq_state(mem->nds->arm7);
 			return;
+		case MEM_ARM7_REG_TM0CNT_L:
+		case MEM_ARM7_REG_TM0CNT_L + 1:
+		case MEM_ARM7_REG_TM1CNT_L:
+		case MEM_ARM7_REG_TM1CNT_L + 1:
+		case MEM_ARM7_REG_TM2CNT_L:
+		case MEM_ARM7_REG_TM2CNT_L + 1:
+		case MEM_ARM7_REG_TM3CNT_L:
+		case MEM_ARM7_REG_TM3CNT_L + 1:
+			mem_timers(mem); /* the new reload value only applies to next overflows */
+			mem->arm7_regs[addr] = v;
+			return;
 		case MEM_ARM7_REG_TM0CNT_H:
 			arm7_timer_control(mem, 0, v);
 			return;
@@ -1589,11 +1811,13 @@ static void set_arm7_reg8(struct mem *mem, uint32_t addr, uint8_t v)
 		case MEM_ARM7_REG_BIOSPROT + 2:
 			if (!mem->biosprot)
 				mem->arm7_regs[addr] = v;
+			arm7_update_pages(mem, 0, sizeof(mem->arm7_bios));
 			return;
 		case MEM_ARM7_REG_BIOSPROT + 3:
 			if (!mem->biosprot)
 				mem->arm7_regs[addr] = v;
 			mem->biosprot = 1;
+			arm7_update_pages(mem, 0, sizeof(mem->arm7_bios));
 			return;
 		case MEM_ARM7_REG_RTC:
 			rtc_write(mem, v);
@@ -2207,21 +2431,21 @@ static uint8_t get_arm7_reg8(struct mem *mem, uint32_t addr)
 		case MEM_ARM7_REG_ROMDATA + 3:
 			return mbc_read(mem->mbc);
 		case MEM_ARM7_REG_TM0CNT_L:
-			return mem->arm7_timers[0].v >> 10;
+			return timer_get(mem, &mem->arm7_timers[0]) >> 10;
 		case MEM_ARM7_REG_TM0CNT_L + 1:
-			return mem->arm7_timers[0].v >> 18;
+			return timer_get(mem, &mem->arm7_timers[0]) >> 18;
 		case MEM_ARM7_REG_TM1CNT_L:
-			return mem->arm7_timers[1].v >> 10;
+			return timer_get(mem, &mem->arm7_timers[1]) >> 10;
 		case MEM_ARM7_REG_TM1CNT_L + 1:
-			return mem->arm7_timers[1].v >> 18;
+			return timer_get(mem, &mem->arm7_timers[1]) >> 18;
 		case MEM_ARM7_REG_TM2CNT_L:
-			return mem->arm7_timers[2].v >> 10;
+			return timer_get(mem, &mem->arm7_timers[2]) >> 10;
 		case MEM_ARM7_REG_TM2CNT_L + 1:
-			return mem->arm7_timers[2].v >> 18;
+			return timer_get(mem, &mem->arm7_timers[2]) >> 18;
 		case MEM_ARM7_REG_TM3CNT_L:
-			return mem->arm7_timers[3].v >> 10;
+			return timer_get(mem, &mem->arm7_timers[3]) >> 10;
 		case MEM_ARM7_REG_TM3CNT_L + 1:
-			return mem->arm7_timers[3].v >> 18;
+			return timer_get(mem, &mem->arm7_timers[3]) >> 18;
 		case MEM_ARM7_REG_SPIDATA:
 			return spi_read(mem);
 		case MEM_ARM7_REG_SPIDATA + 1:
@@ -2500,6 +2724,60 @@ static void *get_arm7_vram_ptr(struct mem *mem, uint32_t addr)
 	return &mem->vram[base + (addr & 0x1FFFF)];
 }
 
+static void arm7_update_pages(struct mem *mem, uint32_t start, uint32_t end)
+{
+	uint32_t biosprot = mem_arm7_get_reg32(mem, MEM_ARM7_REG_BIOSPROT);
+	for (uint32_t addr = start; addr < end; addr += MEM_PAGE_SIZE)
+	{
+		struct mem_page *page = &mem->arm7_pages[addr >> MEM_PAGE_SHIFT];
+		*page = (struct mem_page){0};
+		switch ((addr >> 24) & 0xFF)
+		{
+			case 0x0: /* ARM7 bios, protected pages use the slow path */
+				if (addr >= sizeof(mem->arm7_bios) || addr < biosprot)
+					break;
+				*page = (struct mem_page){&mem->arm7_bios[addr], MEM_CODE_NONE, MEM_PAGE_MASK,
+				                          0, MEM_WAIT_ARM7_WRAM};
+				break;
+			case 0x2: /* main memory */
+				*page = (struct mem_page){&mem->mram[addr & 0x3FFFFF], MEM_CODE_MRAM + (addr & 0x3FFFFF),
+				                          MEM_PAGE_MASK, 1, MEM_WAIT_ARM7_MRAM};
+				break;
+			case 0x3: /* wram */
+				if (!mem->arm7_wram_mask || addr >= 0x3800000)
+				{
+					*page = (struct mem_page){&mem->arm7_wram[addr & 0xFFFF], MEM_CODE_ARM7_WRAM + (addr & 0xFFFF),
+					                          MEM_PAGE_MASK, 1, MEM_WAIT_ARM7_WRAM};
+				}
+				else
+				{
+					uint32_t off = mem->arm7_wram_base + (addr & mem->arm7_wram_mask);
+					*page = (struct mem_page){&mem->wram[off], MEM_CODE_WRAM + off,
+					                          MEM_PAGE_MASK, 1, MEM_WAIT_ARM7_WRAM};
+				}
+				break;
+			case 0x6: /* vram */
+			{
+				uint8_t *ptr = get_arm7_vram_ptr(mem, addr & 0x3FFFF);
+				if (!ptr)
+					break;
+				*page = (struct mem_page){ptr, MEM_CODE_NONE, MEM_PAGE_MASK, 1,
+				                          MEM_WAIT_ARM7_VRAM};
+				break;
+			}
+		}
+	}
+#ifdef ENABLE_FASTMEM
+	if (mem->fastmem)
+		fastmem_update(mem->fastmem, false, start, end);
+#endif
+}
+
+void mem_arm7_update_pages(struct mem *mem)
+{
+	arm7_update_pages(mem, 0, MEM_PAGES_END);
+}
+
 #define MEM_ARM7_GET(size) \
 uint##size##_t mem_arm7_get##size(struct mem *mem, uint32_t addr, enum mem_type type) \
 { \
@@ -2507,6 +2785,15 @@ uint##size##_t mem_arm7_get##size(struct mem *mem, uint32_t addr, enum mem_type
 		addr &= ~1; \
 	if (size == 32) \
 		addr &= ~3; \
+	if (addr < MEM_PAGES_END) \
+	{ \
+		const struct mem_page *page = &mem->arm7_pages[addr >> MEM_PAGE_SHIFT]; \
+		if (page->ptr) \
+		{ \
+			arm7_instr_delay(mem, mem_wait_cycles[page->wait][size / 16], type); \
+			return *(uint##size##_t*)&page->ptr[addr & page->mask]; \
+		} \
+	} \
 	switch ((addr >> 24) & 0xFF) \
 	{ \
 		case 0x0: /* ARM7 bios */ \
@@ -2528,6 +2815,8 @@ uint##size##_t mem_arm7_get##size(struct mem *mem, uint32_t addr, enum mem_type
 			     + (addr & mem->arm7_wram_mask)]; \
 		case 0x4: /* io ports */ \
 			arm7_instr_delay(mem, arm7_wram_cycles_##size, type); \
+			if (!io_idle_safe(addr - 0x4000000)) \
+				mem->nds->arm7->idle_veto = 1; \
 			return get_arm7_reg##size(mem, addr - 0x4000000); \
 		case 0x6: /* vram */ \
 		{ \
@@ -2567,6 +2856,19 @@ void mem_arm7_set##size(struct mem *mem, uint32_t addr, uint##size##_t v, enum m
 		addr &= ~1; \
 	if (size == 32) \
 		addr &= ~3; \
+	mem->nds->arm9->idle = 0; \
+	if (addr < MEM_PAGES_END) \
+	{ \
+		const struct mem_page *page = &mem->arm7_pages[addr >> MEM_PAGE_SHIFT]; \
+		if (page->write) \
+		{ \
+			*(uint##size##_t*)&page->ptr[addr & page->mask] = v; \
+			if (page->code != MEM_CODE_NONE) \
+				code_write(mem, page->code + (addr & page->mask)); \
+			arm7_instr_delay(mem, mem_wait_cycles[page->wait][size / 16], type); \
+			return; \
+		} \
+	} \
 	switch ((addr >> 24) & 0xFF) \
 	{ \
 		case 0x0: /* ARM7 bios */ \
@@ -2574,14 +2876,22 @@ void mem_arm7_set##size(struct mem *mem, uint32_t addr, uint##size##_t v, enum m
 			break; \
 		case 0x2: /* main memory */ \
 			*(uint##size##_t*)&mem->mram[addr & 0x3FFFFF] = v; \
+			code_write(mem, MEM_CODE_MRAM + (addr & 0x3FFFFF)); \
 			arm7_instr_delay(mem, arm7_mram_cycles_##size, type); \
 			return; \
 		case 0x3: /* wram */ \
 			if (!mem->arm7_wram_mask || addr >= 0x3800000) \
+			{ \
 				*(uint##size##_t*)&mem->arm7_wram[addr & 0xFFFF] = v; \
+				code_write(mem, MEM_CODE_ARM7_WRAM + (addr & 0xFFFF)); \
+			} \
 			else \
+			{ \
 				*(uint##size##_t*)&mem->wram[mem->arm7_wram_base \
 				                          + (addr & mem->arm7_wram_mask)] = v; \
+				code_write(mem, MEM_CODE_WRAM + mem->arm7_wram_base \
+				                              + (addr & mem->arm7_wram_mask)); \
+			} \
 			arm7_instr_delay(mem, arm7_wram_cycles_##size, type); \
 			return; \
 		case 0x4: /* io ports */ \
@@ -2759,6 +3069,11 @@ static void run_sqrt(struct mem *mem)
 
 static void update_vram_maps(struct mem *mem)
 {
+	uint32_t trpi_bases[4];
+	uint32_t texp_bases[8];
+	gpu_write(mem);
+	memcpy(trpi_bases, mem->vram_trpi_bases, sizeof(trpi_bases));
+	memcpy(texp_bases, mem->vram_texp_bases, sizeof(texp_bases));
 	for (size_t i = 0; i < 32; ++i)
 		mem->vram_bga_bases[i] = 0xFFFFFFFF;
 	for (size_t i = 0; i < 8; ++i)
@@ -3026,30 +3341,46 @@ static void update_vram_maps(struct mem *mem)
 				break;
 		}
 	}
+	/* the texture slots can't be written while they're mapped: the
+	 * decoded textures only go stale when the slots are remapped
+	 */
+	if (memcmp(trpi_bases, mem->vram_trpi_bases, sizeof(trpi_bases))
+	 || memcmp(texp_bases, mem->vram_texp_bases, sizeof(texp_bases)))
+		mem->vram_tex_gen++;
+	arm7_update_pages(mem, 0x6000000, 0x7000000);
+	arm9_update_pages(mem, 0x6000000, 0x7000000);
 }
 
 static void commit_gx_cmd(struct mem *mem)
 {
 	struct gx_cmd *cmd = &mem->gx_cmd[mem->gx_cmd_nb - 1];
+	const struct gx_cmd_def *def = &gx_cmd_defs[cmd->id];
 	mem->gx_cmd_nb--;
-	if (cmd->params_nb != cmd->def->params)
+	if (cmd->params_nb != def->params)
 	{
 #if 1
 		printf("[GX] %s doesn't have all the required params (%" PRIu8 " / %" PRIu8 ")\n",
-		       cmd->def->name, cmd->params_nb, cmd->params_nb);
+		       def->name, cmd->params_nb, cmd->params_nb);
 #endif
 		return;
 	}
 #if 0
-	printf("[GX] execute %s with %u params\n", cmd->def->name, cmd->params_nb);
+	printf("[GX] execute %s with %u params\n", def->name, cmd->params_nb);
+#endif
+#ifdef ENABLE_MULTITHREAD
+	if (mem->gx_async)
+	{
+		nds_gx_push(mem->nds, cmd->id, cmd->params, cmd->params_nb);
+		return;
+	}
 #endif
-	gpu_gx_cmd(mem->nds->gpu, cmd->def - &gx_cmd_defs[0], cmd->params);
+	gpu_gx_cmd(mem->nds->gpu, cmd->id, cmd->params);
 }
 
 static void start_gx_cmd(struct mem *mem, const struct gx_cmd_def *def)
 {
 	struct gx_cmd *cmd = &mem->gx_cmd[mem->gx_cmd_nb++];
-	cmd->def = def;
+	cmd->id = def - &gx_cmd_defs[0];
 	cmd->params_nb = 0;
 #if 0
 	printf("[GX] start %s\n", def->name);
@@ -3063,10 +3394,10 @@ static void add_gx_cmd_param(struct mem *mem, uint32_t param)
 	struct gx_cmd *cmd = &mem->gx_cmd[mem->gx_cmd_nb - 1];
 #if 0
 	printf("[GX] add param [%" PRIu8 "] = 0x%08" PRIx32 " to %s\n",
-	       cmd->params_nb, param, cmd->def->name);
+	       cmd->params_nb, param, gx_cmd_defs[cmd->id].name);
 #endif
 	cmd->params[cmd->params_nb++] = param;
-	if (cmd->params_nb == cmd->def->params)
+	if (cmd->params_nb == gx_cmd_defs[cmd->id].params)
 		commit_gx_cmd(mem);
 }
 
@@ -3074,6 +3405,19 @@ static void set_arm9_reg8(struct mem *mem, uint32_t addr, uint8_t v)
 {
 	switch (addr)
 	{
+		case MEM_ARM9_REG_DISP3DCNT:
+		case MEM_ARM9_REG_DISP3DCNT + 2:
+		case MEM_ARM9_REG_DISP3DCNT + 3:
+			gx_sync(mem);
+			mem->arm9_regs[addr] = v;
+			return;
+		case MEM_ARM9_REG_DISP3DCNT + 1:
+			gx_sync(mem);
+			/* the underflow and ram overflow flags are acknowledged by writing 1 */
+			mem->arm9_regs[addr] = (v & ~0x30) | (mem->arm9_regs[addr] & ~v & 0x10);
+			if (v & (1 << 5))
+				mem->nds->gpu->g3d.ram_overflow = 0;
+			return;
 		case MEM_ARM9_REG_IPCSYNC:
 			return;
 		case MEM_ARM9_REG_IPCSYNC + 1:
@@ -3116,17 +3460,9 @@ static void set_arm9_reg8(struct mem *mem, uint32_t addr, uint8_t v)
 		case MEM_ARM9_REG_ROMCMD + 5:
 		case MEM_ARM9_REG_ROMCMD + 6:
 		case MEM_ARM9_REG_ROMCMD + 7:
-		case MEM_ARM9_REG_TM0CNT_L:
-		case MEM_ARM9_REG_TM0CNT_L + 1:
 		case MEM_ARM9_REG_TM0CNT_H + 1:
-		case MEM_ARM9_REG_TM1CNT_L:
-		case MEM_ARM9_REG_TM1CNT_L + 1:
 		case MEM_ARM9_REG_TM1CNT_H + 1:
-		case MEM_ARM9_REG_TM2CNT_L:
-		case MEM_ARM9_REG_TM2CNT_L + 1:
 		case MEM_ARM9_REG_TM2CNT_H + 1:
-		case MEM_ARM9_REG_TM3CNT_L:
-		case MEM_ARM9_REG_TM3CNT_L + 1:
 		case MEM_ARM9_REG_TM3CNT_H + 1:
 		case MEM_ARM9_REG_EXMEMCNT:
 		case MEM_ARM9_REG_EXMEMCNT + 1:
@@ -3362,10 +3698,6 @@ static void set_arm9_reg8(struct mem *mem, uint32_t addr, uint8_t v)
 		case MEM_ARM9_REG_BLDY + 0x1000 + 1:
 		case MEM_ARM9_REG_BLDY + 0x1000 + 2:
 		case MEM_ARM9_REG_BLDY + 0x1000 + 3:
-		case MEM_ARM9_REG_DISP3DCNT:
-		case MEM_ARM9_REG_DISP3DCNT + 1:
-		case MEM_ARM9_REG_DISP3DCNT + 2:
-		case MEM_ARM9_REG_DISP3DCNT + 3:
 		case MEM_ARM9_REG_DISPCAPCNT:
 		case MEM_ARM9_REG_DISPCAPCNT + 1:
 		case MEM_ARM9_REG_DISPCAPCNT + 2:
@@ -3479,6 +3811,17 @@ static void set_arm9_reg8(struct mem *mem, uint32_t addr, uint8_t v)
 			if (v)
 				cpu_update_irq_state(mem->nds->arm9);
 			return;
+		case MEM_ARM9_REG_TM0CNT_L:
+		case MEM_ARM9_REG_TM0CNT_L + 1:
+		case MEM_ARM9_REG_TM1CNT_L:
+		case MEM_ARM9_REG_TM1CNT_L + 1:
+		case MEM_ARM9_REG_TM2CNT_L:
+		case MEM_ARM9_REG_TM2CNT_L + 1:
+		case MEM_ARM9_REG_TM3CNT_L:
+		case MEM_ARM9_REG_TM3CNT_L + 1:
+			mem_timers(mem); /* the new reload value only applies to next overflows */
+			mem->arm9_regs[addr] = v;
+			return;
 		case MEM_ARM9_REG_TM0CNT_H:
 			arm9_timer_control(mem, 0, v);
 			return;
@@ -3524,6 +3867,10 @@ static void set_arm9_reg8(struct mem *mem, uint32_t addr, uint8_t v)
 					break;
 			}
 			mem->arm9_regs[addr] = v;
+			arm7_update_pages(mem, 0x3000000, 0x4000000);
+			arm9_update_pages(mem, 0x3000000, 0x4000000);
+			cpu_flush_code(mem->nds->arm7);
+			cpu_flush_code(mem->nds->arm9);
 			return;
 		case MEM_ARM9_REG_KEYCNT:
 		case MEM_ARM9_REG_KEYCNT + 1:
@@ -3683,13 +4030,15 @@ static void set_arm9_reg8(struct mem *mem, uint32_t addr, uint8_t v)
 #if 0
 			printf("[ARM9] GXSTAT[%08" PRIx32 "] set %02" PRIx8 "\n", addr, v);
 #endif
+			gx_sync(mem);
 			if (v & (1 << 7))
-				mem->arm9_regs[addr] &= ~((1 << 7) | (1 << 5) | 0x1F);
+				mem->nds->gpu->g3d.gxstat &= ~((1 << 15) | (1 << 13) | (0x1F << 8));
 			return;
 		case MEM_ARM9_REG_GXSTAT + 3:
 #if 0
 			printf("[ARM9] GXSTAT[%08" PRIx32 "] set %02" PRIx8 "\n", addr, v);
 #endif
+			gx_sync(mem);
 			mem->arm9_regs[addr] &= 0x3F;
 			mem->arm9_regs[addr] |= v & 0xC0;
 			update_gxfifo_irq(mem);
@@ -4063,7 +4412,7 @@ static void set_arm9_reg32(struct mem *mem, uint32_t addr, uint32_t v)
 				break;
 			}
 			struct gx_cmd *cmd = &mem->gx_cmd[mem->gx_cmd_nb - 1];
-			if (cmd->def != def)
+			if (cmd->id != cmd_id)
 			{
 				commit_gx_cmd(mem);
 				start_gx_cmd(mem, def);
@@ -4286,14 +4635,17 @@ static uint8_t get_arm9_reg8(struct mem *mem, uint32_t addr)
 		case MEM_ARM9_REG_TM2CNT_H + 1:
 		case MEM_ARM9_REG_TM3CNT_H:
 		case MEM_ARM9_REG_TM3CNT_H + 1:
-		case MEM_ARM9_REG_DISP3DCNT:
-		case MEM_ARM9_REG_DISP3DCNT + 1:
-		case MEM_ARM9_REG_DISP3DCNT + 2:
-		case MEM_ARM9_REG_DISP3DCNT + 3:
 		case MEM_ARM9_REG_DISPCAPCNT:
 		case MEM_ARM9_REG_DISPCAPCNT + 1:
 		case MEM_ARM9_REG_DISPCAPCNT + 2:
 		case MEM_ARM9_REG_DISPCAPCNT + 3:
+			return mem->arm9_regs[addr];
+		case MEM_ARM9_REG_DISP3DCNT + 1:
+			gx_sync(mem);
+			return mem->arm9_regs[addr] | (mem->nds->gpu->g3d.ram_overflow << 5);
+		case MEM_ARM9_REG_DISP3DCNT:
+		case MEM_ARM9_REG_DISP3DCNT + 2:
+		case MEM_ARM9_REG_DISP3DCNT + 3:
 		case MEM_ARM9_REG_VEC_RESULT:
 		case MEM_ARM9_REG_VEC_RESULT + 1:
 		case MEM_ARM9_REG_VEC_RESULT + 2:
@@ -4316,6 +4668,7 @@ static uint8_t get_arm9_reg8(struct mem *mem, uint32_t addr)
 		case MEM_ARM9_REG_POS_RESULT + 13:
 		case MEM_ARM9_REG_POS_RESULT + 14:
 		case MEM_ARM9_REG_POS_RESULT + 15:
+			gx_sync(mem);
 			return mem->arm9_regs[addr];
 		case MEM_ARM9_REG_DIV_RESULT:
 		case MEM_ARM9_REG_DIV_RESULT + 1:
@@ -4345,11 +4698,14 @@ static uint8_t get_arm9_reg8(struct mem *mem, uint32_t addr)
 			return mem->arm9_regs[addr];
 		case MEM_ARM9_REG_GXSTAT:
 		case MEM_ARM9_REG_GXSTAT + 1:
-		case MEM_ARM9_REG_GXSTAT + 2:
 #if 0
 			printf("[ARM9] [%08" PRIx32 "] GXSTAT[%08" PRIx32 "] read 0x%02" PRIx8 "\n",
 			       cpu_get_reg(mem->nds->arm9, CPU_REG_PC), addr, mem->arm9_regs[addr]);
 #endif
+			gx_sync(mem);
+			return mem->arm9_regs[addr]
+			     | (mem->nds->gpu->g3d.gxstat >> ((addr - MEM_ARM9_REG_GXSTAT) * 8));
+		case MEM_ARM9_REG_GXSTAT + 2:
 			return mem->arm9_regs[addr];
 		case MEM_ARM9_REG_GXSTAT + 3:
 		{
@@ -4377,21 +4733,21 @@ static uint8_t get_arm9_reg8(struct mem *mem, uint32_t addr)
 		case MEM_ARM9_REG_ROMDATA + 3:
 			return mbc_read(mem->mbc);
 		case MEM_ARM9_REG_TM0CNT_L:
-			return mem->arm9_timers[0].v >> 10;
+			return timer_get(mem, &mem->arm9_timers[0]) >> 10;
 		case MEM_ARM9_REG_TM0CNT_L + 1:
-			return mem->arm9_timers[0].v >> 18;
+			return timer_get(mem, &mem->arm9_timers[0]) >> 18;
 		case MEM_ARM9_REG_TM1CNT_L:
-			return mem->arm9_timers[1].v >> 10;
+			return timer_get(mem, &mem->arm9_timers[1]) >> 10;
 		case MEM_ARM9_REG_TM1CNT_L + 1:
-			return mem->arm9_timers[1].v >> 18;
+			return timer_get(mem, &mem->arm9_timers[1]) >> 18;
 		case MEM_ARM9_REG_TM2CNT_L:
-			return mem->arm9_timers[2].v >> 10;
+			return timer_get(mem, &mem->arm9_timers[2]) >> 10;
 		case MEM_ARM9_REG_TM2CNT_L + 1:
-			return mem->arm9_timers[2].v >> 18;
+			return timer_get(mem, &mem->arm9_timers[2]) >> 18;
 		case MEM_ARM9_REG_TM3CNT_L:
-			return mem->arm9_timers[3].v >> 10;
+			return timer_get(mem, &mem->arm9_timers[3]) >> 10;
 		case MEM_ARM9_REG_TM3CNT_L + 1:
-			return mem->arm9_timers[3].v >> 18;
+			return timer_get(mem, &mem->arm9_timers[3]) >> 18;
 		case MEM_ARM9_REG_KEYINPUT:
 		{
 			uint8_t v = 0;
@@ -4475,12 +4831,16 @@ static uint8_t get_arm9_reg8(struct mem *mem, uint32_t addr)
 				return mem->arm9_regs[addr] & ~(1 << 7);
 			return mem->arm9_regs[addr];
 		case MEM_ARM9_REG_RAM_COUNT:
+			gx_sync(mem);
 			return mem->nds->gpu->g3d.back->polygons_nb;
 		case MEM_ARM9_REG_RAM_COUNT + 1:
+			gx_sync(mem);
 			return mem->nds->gpu->g3d.back->polygons_nb >> 8;
 		case MEM_ARM9_REG_RAM_COUNT + 2:
+			gx_sync(mem);
 			return mem->nds->gpu->g3d.back->vertexes_nb;
 		case MEM_ARM9_REG_RAM_COUNT + 3:
+			gx_sync(mem);
 			return mem->nds->gpu->g3d.back->vertexes_nb >> 8;
 		default:
 			printf("[ARM9] [%08" PRIx32 "] unknown get register %08" PRIx32 "\n",
@@ -4498,40 +4858,42 @@ static uint16_t get_arm9_reg16(struct mem *mem, uint32_t addr)
 
 static uint32_t get_arm9_reg32(struct mem *mem, uint32_t addr)
 {
+	if (addr >= MEM_ARM9_REG_CLIPMTX_RESULT && addr < MEM_ARM9_REG_VECMTX_RESULT + 0x24)
+		gx_sync(mem);
 	switch (addr)
 	{
 		case MEM_ARM9_REG_CLIPMTX_RESULT:
-			return mem->nds->gpu->g3d.clip_matrix.x.x;
+			return gpu_g3d_clip_matrix(mem->nds->gpu)->x.x;
 		case MEM_ARM9_REG_CLIPMTX_RESULT + 0x04:
-			return mem->nds->gpu->g3d.clip_matrix.x.y;
+			return gpu_g3d_clip_matrix(mem->nds->gpu)->x.y;
 		case MEM_ARM9_REG_CLIPMTX_RESULT + 0x08:
-			return mem->nds->gpu->g3d.clip_matrix.x.z;
+			return gpu_g3d_clip_matrix(mem->nds->gpu)->x.z;
 		case MEM_ARM9_REG_CLIPMTX_RESULT + 0x0C:
-			return mem->nds->gpu->g3d.clip_matrix.x.w;
+			return gpu_g3d_clip_matrix(mem->nds->gpu)->x.w;
 		case MEM_ARM9_REG_CLIPMTX_RESULT + 0x10:
-			return mem->nds->gpu->g3d.clip_matrix.y.x;
+			return gpu_g3d_clip_matrix(mem->nds->gpu)->y.x;
 		case MEM_ARM9_REG_CLIPMTX_RESULT + 0x14:
-			return mem->nds->gpu->g3d.clip_matrix.y.y;
+			return gpu_g3d_clip_matrix(mem->nds->gpu)->y.y;
 		case MEM_ARM9_REG_CLIPMTX_RESULT + 0x18:
-			return mem->nds->gpu->g3d.clip_matrix.y.z;
+			return gpu_g3d_clip_matrix(mem->nds->gpu)->y.z;
 		case MEM_ARM9_REG_CLIPMTX_RESULT + 0x1C:
-			return mem->nds->gpu->g3d.clip_matrix.y.w;
+			return gpu_g3d_clip_matrix(mem->nds->gpu)->y.w;
 		case MEM_ARM9_REG_CLIPMTX_RESULT + 0x20:
-			return mem->nds->gpu->g3d.clip_matrix.z.x;
+			return gpu_g3d_clip_matrix(mem->nds->gpu)->z.x;
 		case MEM_ARM9_REG_CLIPMTX_RESULT + 0x24:
-			return mem->nds->gpu->g3d.clip_matrix.z.y;
+			return gpu_g3d_clip_matrix(mem->nds->gpu)->z.y;
 		case MEM_ARM9_REG_CLIPMTX_RESULT + 0x28:
-			return mem->nds->gpu->g3d.clip_matrix.z.z;
+			return gpu_g3d_clip_matrix(mem->nds->gpu)->z.z;
 		case MEM_ARM9_REG_CLIPMTX_RESULT + 0x2C:
-			return mem->nds->gpu->g3d.clip_matrix.z.w;
+			return gpu_g3d_clip_matrix(mem->nds->gpu)->z.w;
 		case MEM_ARM9_REG_CLIPMTX_RESULT + 0x30:
-			return mem->nds->gpu->g3d.clip_matrix.w.x;
+			return gpu_g3d_clip_matrix(mem->nds->gpu)->w.x;
 		case MEM_ARM9_REG_CLIPMTX_RESULT + 0x34:
-			return mem->nds->gpu->g3d.clip_matrix.w.y;
+			return gpu_g3d_clip_matrix(mem->nds->gpu)->w.y;
 		case MEM_ARM9_REG_CLIPMTX_RESULT + 0x38:
-			return mem->nds->gpu->g3d.clip_matrix.w.z;
+			return gpu_g3d_clip_matrix(mem->nds->gpu)->w.z;
 		case MEM_ARM9_REG_CLIPMTX_RESULT + 0x3C:
-			return mem->nds->gpu->g3d.clip_matrix.w.w;
+			return gpu_g3d_clip_matrix(mem->nds->gpu)->w.w;
 		case MEM_ARM9_REG_VECMTX_RESULT:
 			return mem->nds->gpu->g3d.dir_matrix.x.x;
 		case MEM_ARM9_REG_VECMTX_RESULT + 0x04:
@@ -4696,10 +5058,7 @@ void *get_arm9_vram_ptr(struct mem *mem, uint32_t addr)
 						case 0x2:
 						case 0x3:
 							if ((mem_arm9_get_reg8(mem, MEM_ARM9_REG_VRAMCNT_H) & 0x83) != 0x80)
-							{
-								printf("failed to get vram h %" PRIx32 "\n", addr);
 								return NULL;
-							}
 							return &mem->vram[MEM_VRAM_H_BASE + (addr & MEM_VRAM_H_MASK)];
 					}
 					break;
@@ -4713,6 +5072,72 @@ void *get_arm9_vram_ptr(struct mem *mem, uint32_t addr)
 	return NULL;
 }
 
+static void arm9_update_pages(struct mem *mem, uint32_t start, uint32_t end)
+{
+	for (uint32_t addr = start; addr < end; addr += MEM_PAGE_SIZE)
+	{
+		struct mem_page *page = &mem->arm9_pages[addr >> MEM_PAGE_SHIFT];
+		*page = (struct mem_page){0};
+		/* tcm smaller than a page is left to the slow path */
+		if ((addr & ~mem->itcm_mask & ~MEM_PAGE_MASK) == (mem->itcm_base & ~MEM_PAGE_MASK))
+		{
+			if (mem->itcm_mask >= MEM_PAGE_MASK)
+				*page = (struct mem_page){&mem->itcm[addr & 0x7FFF], MEM_CODE_ITCM + (addr & 0x7FFF),
+				                          MEM_PAGE_MASK, 1, MEM_WAIT_ARM9_TCM};
+			continue;
+		}
+		if ((addr & ~mem->dtcm_mask & ~MEM_PAGE_MASK) == (mem->dtcm_base & ~MEM_PAGE_MASK))
+		{
+			if (mem->dtcm_mask >= MEM_PAGE_MASK)
+				*page = (struct mem_page){&mem->dtcm[addr & 0x3FFF], MEM_CODE_NONE,
+				                          MEM_PAGE_MASK, 1, MEM_WAIT_ARM9_TCM};
+			continue;
+		}
+		switch ((addr >> 24) & 0xFF)
+		{
+			case 0x2: /* main memory */
+				*page = (struct mem_page){&mem->mram[addr & 0x3FFFFF], MEM_CODE_MRAM + (addr & 0x3FFFFF),
+				                          MEM_PAGE_MASK, 1, MEM_WAIT_ARM9_MRAM};
+				break;
+			case 0x3: /* shared wram */
+			{
+				if (!mem->arm9_wram_mask)
+					break;
+				uint32_t off = mem->arm9_wram_base + (addr & mem->arm9_wram_mask);
+				*page = (struct mem_page){&mem->wram[off], MEM_CODE_WRAM + off,
+				                          MEM_PAGE_MASK, 1, MEM_WAIT_ARM9_WRAM};
+				break;
+			}
+			case 0x5: /* palette */
+				*page = (struct mem_page){mem->palette, MEM_CODE_NONE, 0x7FF,
+				                          gpu_pages_write(mem), MEM_WAIT_ARM9_VRAM};
+				break;
+			case 0x6: /* vram */
+			{
+				uint8_t *ptr = get_arm9_vram_ptr(mem, addr & 0xFFFFFF);
+				if (!ptr)
+					break;
+				*page = (struct mem_page){ptr, MEM_CODE_NONE, MEM_PAGE_MASK,
+				                          gpu_pages_write(mem), MEM_WAIT_ARM9_VRAM};
+				break;
+			}
+			case 0x7: /* oam */
+				*page = (struct mem_page){mem->oam, MEM_CODE_NONE, 0x7FF,
+				                          gpu_pages_write(mem), MEM_WAIT_ARM9_WRAM};
+				break;
+		}
+	}
+#ifdef ENABLE_FASTMEM
+	if (mem->fastmem)
+		fastmem_update(mem->fastmem, true, start, end);
+#endif
+}
+
+void mem_arm9_update_pages(struct mem *mem)
+{
+	arm9_update_pages(mem, 0, MEM_PAGES_END);
+}
+
 #define MEM_ARM9_GET(size) \
 uint##size##_t mem_arm9_get##size(struct mem *mem, uint32_t addr, enum mem_type type) \
 { \
@@ -4722,6 +5147,15 @@ uint##size##_t mem_arm9_get##size(struct mem *mem, uint32_t addr, enum mem_type
 		addr &= ~1; \
 	if (size == 32) \
 		addr &= ~3; \
+	if (addr < MEM_PAGES_END) \
+	{ \
+		const struct mem_page *page = &mem->arm9_pages[addr >> MEM_PAGE_SHIFT]; \
+		if (page->ptr) \
+		{ \
+			arm9_instr_delay(mem, mem_wait_cycles[page->wait][size / 16], type); \
+			return *(uint##size##_t*)&page->ptr[addr & page->mask]; \
+		} \
+	} \
 	if (addr != MEM_DIRECT) \
 	{ \
 		if ((addr & ~mem->itcm_mask) == mem->itcm_base) \
@@ -4755,6 +5189,8 @@ uint##size##_t mem_arm9_get##size(struct mem *mem, uint32_t addr, enum mem_type
 			                                  + (addr & mem->arm9_wram_mask)]; \
 		case 0x4: /* io ports */ \
 			arm9_instr_delay(mem, arm9_wram_cycles_##size, type); \
+			if (!io_idle_safe(addr - 0x4000000)) \
+				mem->nds->arm9->idle_veto = 1; \
 			return get_arm9_reg##size(mem, addr - 0x4000000); \
 		case 0x5: /* palette */ \
 			arm9_instr_delay(mem, arm9_vram_cycles_##size, type); \
@@ -4870,11 +5306,25 @@ void mem_arm9_set##size(struct mem *mem, uint32_t addr, uint##size##_t v, enum m
 		addr &= ~1; \
 	if (size == 32) \
 		addr &= ~3; \
+	mem->nds->arm7->idle = 0; \
+	if (addr < MEM_PAGES_END) \
+	{ \
+		const struct mem_page *page = &mem->arm9_pages[addr >> MEM_PAGE_SHIFT]; \
+		if (page->write) \
+		{ \
+			*(uint##size##_t*)&page->ptr[addr & page->mask] = v; \
+			if (page->code != MEM_CODE_NONE) \
+				code_write(mem, page->code + (addr & page->mask)); \
+			arm9_instr_delay(mem, mem_wait_cycles[page->wait][size / 16], type); \
+			return; \
+		} \
+	} \
 	if (addr != MEM_DIRECT) \
 	{ \
 		if ((addr & ~mem->itcm_mask) == mem->itcm_base) \
 		{ \
 			*(uint##size##_t*)&mem->itcm[addr & 0x7FFF] = v; \
+			code_write(mem, MEM_CODE_ITCM + (addr & 0x7FFF)); \
 			arm9_instr_delay(mem, arm9_tcm_cycles_##size, type); \
 			return; \
 		} \
@@ -4889,6 +5339,7 @@ void mem_arm9_set##size(struct mem *mem, uint32_t addr, uint##size##_t v, enum m
 	{ \
 		case 0x2: /* main memory */ \
 			*(uint##size##_t*)&mem->mram[addr & 0x3FFFFF] = v; \
+			code_write(mem, MEM_CODE_MRAM + (addr & 0x3FFFFF)); \
 			arm9_instr_delay(mem, arm9_mram_cycles_##size, type); \
 			return; \
 		case 0x3: /* shared wram */ \
@@ -4896,6 +5347,8 @@ void mem_arm9_set##size(struct mem *mem, uint32_t addr, uint##size##_t v, enum m
 				return; \
 			*(uint##size##_t*)&mem->wram[mem->arm9_wram_base \
 			                           + (addr & mem->arm9_wram_mask)] = v; \
+			code_write(mem, MEM_CODE_WRAM + mem->arm9_wram_base \
+			                              + (addr & mem->arm9_wram_mask)); \
 			arm9_instr_delay(mem, arm9_wram_cycles_##size, type); \
 			return; \
 		case 0x4: /* io ports */ \
@@ -4904,6 +5357,7 @@ void mem_arm9_set##size(struct mem *mem, uint32_t addr, uint##size##_t v, enum m
 			return; \
 		case 0x5: /* palette */ \
 			/* printf("palette write [%08" PRIx32 "] = %x\n", addr, v); */ \
+			gpu_write(mem); \
 			*(uint##size##_t*)&mem->palette[addr & 0x7FF] = v; \
 			arm9_instr_delay(mem, arm9_vram_cycles_##size, type); \
 			return; \
@@ -4913,12 +5367,14 @@ void mem_arm9_set##size(struct mem *mem, uint32_t addr, uint##size##_t v, enum m
 			void *ptr = get_arm9_vram_ptr(mem, addr & 0xFFFFFF); \
 			if (!ptr) \
 				break; \
+			gpu_write(mem); \
 			arm9_instr_delay(mem, arm9_vram_cycles_##size, type); \
 			*(uint##size##_t*)ptr = v; \
 			return; \
 		} \
 		case 0x7: /* oam */ \
 			/* printf("oam write [%08" PRIx32 "] = %x\n", addr, v); */ \
+			gpu_write(mem); \
 			*(uint##size##_t*)&mem->oam[addr & 0x7FF] = v; \
 			arm9_instr_delay(mem, arm9_wram_cycles_##size, type); \
 			return; \
@@ -5,6 +5,16 @@
 #include <stddef.h>
 #include <time.h>
 
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#ifdef ENABLE_FASTMEM
+# define MEM_BACKED __attribute__((aligned(4096))) /* aliased by the fastmem views */
+#else
+# define MEM_BACKED
+#endif
+
 #define MEM_ARM9_REG_DISPCNT         0x000
 #define MEM_ARM9_REG_DISPSTAT        0x004
 #define MEM_ARM9_REG_VCOUNT          0x006
@@ -580,7 +590,7 @@ struct gx_cmd_def
 
 struct gx_cmd
 {
-	const struct gx_cmd_def *def;
+	uint8_t id; /* index in the command definitions */
 	uint32_t params[32];
 	uint8_t params_nb;
 };
@@ -611,6 +621,48 @@ struct wifi
 #define MEM_VRAM_I_BASE 0xA0000
 #define MEM_VRAM_I_MASK 0x03FFF
 
+/* flat view of the memories code can be cached from */
+#define MEM_CODE_MRAM       0x000000
+#define MEM_CODE_WRAM       0x400000
+#define MEM_CODE_ARM7_WRAM  0x408000
+#define MEM_CODE_ITCM       0x418000
+#define MEM_CODE_ARM9_BIOS  0x420000
+#define MEM_CODE_ARM7_BIOS  0x421000
+#define MEM_CODE_SIZE       0x425000
+#define MEM_CODE_NONE       0xFFFFFFFF
+#define MEM_CODE_PAGE_SHIFT 9
+#define MEM_CODE_PAGES      (MEM_CODE_SIZE >> MEM_CODE_PAGE_SHIFT)
+
+#define MEM_PAGE_SHIFT 12
+#define MEM_PAGE_SIZE  (1 << MEM_PAGE_SHIFT)
+#define MEM_PAGE_MASK  (MEM_PAGE_SIZE - 1)
+#define MEM_PAGES_END  0x8000000 /* gba slot and above always use the slow path */
+#define MEM_PAGES      (MEM_PAGES_END >> MEM_PAGE_SHIFT)
+
+enum mem_wait
+{
+	MEM_WAIT_ARM7_MRAM,
+	MEM_WAIT_ARM7_WRAM,
+	MEM_WAIT_ARM7_VRAM,
+	MEM_WAIT_ARM9_MRAM,
+	MEM_WAIT_ARM9_WRAM,
+	MEM_WAIT_ARM9_VRAM,
+	MEM_WAIT_ARM9_TCM,
+	MEM_WAIT_LAST,
+};
+
+/* 8, 16 and 32 bits wait states of each enum mem_wait */
+extern const uint8_t *const mem_wait_cycles[MEM_WAIT_LAST][3];
+
+struct mem_page
+{
+	uint8_t *ptr; /* host memory, NULL for the slow path */
+	uint32_t code; /* code address of the page, MEM_CODE_NONE if untracked */
+	uint16_t mask; /* offset mask inside ptr */
+	uint8_t write; /* stores can use ptr too */
+	uint8_t wait; /* enum mem_wait */
+};
+
 struct nds;
 struct mbc;
 
@@ -634,16 +686,16 @@ struct mem
 	uint8_t firmware[0x40000];
 	uint8_t arm7_regs[0x600];
 	uint8_t arm9_regs[0x1070];
-	uint8_t mram[0x400000];
-	uint8_t wram[0x8000];
-	uint8_t arm7_wram[0x10000];
+	uint8_t mram[0x400000] MEM_BACKED;
+	uint8_t wram[0x8000] MEM_BACKED;
+	uint8_t arm7_wram[0x10000] MEM_BACKED;
 	uint32_t arm7_wram_base;
 	uint32_t arm7_wram_mask;
 	uint32_t arm9_wram_base;
 	uint32_t arm9_wram_mask;
-	uint8_t dtcm[0x4000];
-	uint8_t itcm[0x8000];
-	uint8_t vram[0xA4000];
+	uint8_t dtcm[0x4000] MEM_BACKED;
+	uint8_t itcm[0x8000] MEM_BACKED;
+	uint8_t vram[0xA4000] MEM_BACKED;
 	uint8_t oam[0x800];
 	uint8_t palette[0x800];
 	int biosprot;
@@ -668,13 +720,25 @@ struct mem
 	uint32_t dtcm_mask;
 	struct gx_cmd gx_cmd[4];
 	uint8_t gx_cmd_nb;
+	uint8_t code_pages[MEM_CODE_PAGES]; /* pages holding cached code */
+	struct mem_page arm7_pages[MEM_PAGES];
+	struct mem_page arm9_pages[MEM_PAGES];
+#ifdef ENABLE_FASTMEM
+	struct fastmem *fastmem;
+#endif
+	uint64_t timers_cycle; /* cycle the timers were last updated at */
+	uint32_t vram_tex_gen; /* bumped when the texture slots are remapped */
+#ifdef ENABLE_MULTITHREAD
+	int gpu_async; /* 2d lines drawn by other threads: vram, palette and oam stores take the slow path */
+	int gx_async; /* gx commands executed by the gx thread, see nds_gx_push */
+#endif
 };
 
 struct mem *mem_new(struct nds *nds, struct mbc *mbc);
 void mem_del(struct mem *mem);
 
-void mem_timers(struct mem *mem, uint32_t cycles);
-void mem_dma(struct mem *mem, uint32_t cycles);
+void mem_timers(struct mem *mem);
+void mem_dma(struct mem *mem);
 void mem_vblank(struct mem *mem);
 void mem_hblank(struct mem *mem);
 void mem_dscard(struct mem *mem);
@@ -682,6 +746,14 @@ void mem_dscard(struct mem *mem);
 void mem_arm9_irq(struct mem *mem, uint32_t f);
 void mem_arm7_irq(struct mem *mem, uint32_t f);
 
+uint32_t mem_arm9_code_addr(struct mem *mem, uint32_t addr);
+uint32_t mem_arm7_code_addr(struct mem *mem, uint32_t addr);
+void mem_code_add(struct mem *mem, uint32_t page);
+void mem_code_invalidate(struct mem *mem, uint32_t page);
+
+void mem_arm7_update_pages(struct mem *mem);
+void mem_arm9_update_pages(struct mem *mem);
+
 uint8_t  mem_arm7_get8 (struct mem *mem, uint32_t addr, enum mem_type type);
 uint16_t mem_arm7_get16(struct mem *mem, uint32_t addr, enum mem_type type);
 uint32_t mem_arm7_get32(struct mem *mem, uint32_t addr, enum mem_type type);
@@ -5,11 +5,21 @@
 #include "cpu.h"
 #include "gpu.h"
 
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
-#define INACCURACY_SHIFT 3 /* the power of two of the "batch" size for cycles interpretation */
+#ifdef ENABLE_MULTITHREAD
+# include <limits.h>
+# include <sched.h>
+# include <unistd.h>
+# include <time.h>
+# ifdef __linux__
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+# endif
+#endif
 
 /*
  * 1130: bios call wrapper of 20BC (by 1164)
@@ -164,47 +174,353 @@
  * icon/title offset: 0x30C800
  */
 
-/* this multithreading looks stupid (and it is)
- * but it gives about 15% more fps on firmware titlescreen
- * it doesn't have any drawbacks (maybe some race conditions
- * if cpu changes vram mapping but nothing more)
- *
- * forgive me scheduler gods though...
+/* the 3d is drawn by the gpu thread while the emulation runs vblank,
+ * the 2d lines by a pool of workers (see gpu_worker_loop)
  */
 #ifdef ENABLE_MULTITHREAD
 
+static inline uint64_t get_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static inline bool sync_reached(int value, int v)
+{
+	return (int)((unsigned)value - (unsigned)v) >= 0; /* frames count wraps */
+}
+
+static void sync_wake(struct nds_sync *sync)
+{
+	if (__atomic_load_n(&sync->waiters, __ATOMIC_SEQ_CST))
+	{
+#ifdef __linux__
+		syscall(SYS_futex, &sync->value, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#endif
+	}
+}
+
+static void sync_set(struct nds_sync *sync, int v)
+{
+	__atomic_store_n(&sync->value, v, __ATOMIC_SEQ_CST);
+	sync_wake(sync);
+}
+
+static void sync_add(struct nds_sync *sync, int v)
+{
+	__atomic_add_fetch(&sync->value, v, __ATOMIC_SEQ_CST);
+	sync_wake(sync);
+}
+
+/* wait for the value to reach v: poll for a while (the other thread
+ * is usually a few µs away), then sleep until woken up
+ */
+static void sync_wait(struct nds *nds, struct nds_sync *sync, int v, uint64_t *wait_ns)
+{
+	int value = __atomic_load_n(&sync->value, __ATOMIC_SEQ_CST);
+	if (sync_reached(value, v))
+		return;
+	uint64_t start = get_ns();
+	for (uint32_t i = 0; i < nds->spin && !sync_reached(value, v); ++i)
+	{
+		cpu_relax();
+		value = __atomic_load_n(&sync->value, __ATOMIC_SEQ_CST);
+	}
+	while (!sync_reached(value, v))
+	{
+		__atomic_add_fetch(&sync->waiters, 1, __ATOMIC_SEQ_CST);
+		value = __atomic_load_n(&sync->value, __ATOMIC_SEQ_CST);
+		if (!sync_reached(value, v))
+		{
+#ifdef __linux__
+			syscall(SYS_futex, &sync->value, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+#else
+			sched_yield();
+#endif
+		}
+		__atomic_sub_fetch(&sync->waiters, 1, __ATOMIC_SEQ_CST);
+		value = __atomic_load_n(&sync->value, __ATOMIC_SEQ_CST);
+	}
+	if (!wait_ns)
+		return;
+	__atomic_add_fetch(wait_ns, get_ns() - start, __ATOMIC_RELAXED);
+}
+
+static void draw_band(struct nds *nds, uint32_t band)
+{
+	uint64_t start = get_ns();
+	gpu_g3d_draw_band(nds->gpu, 192 * band / nds->g3d_bands,
+	                  192 * (band + 1) / nds->g3d_bands);
+	nds->g3d_band_ns[band] = get_ns() - start;
+}
+
+static void *g3d_worker_loop(void *arg)
+{
+	struct nds_band *band = arg;
+	struct nds *nds = band->nds;
+	int frame = __atomic_load_n(&nds->g3d_start.value, __ATOMIC_SEQ_CST);
+	while (1)
+	{
+		sync_wait(nds, &nds->g3d_start, ++frame, NULL);
+		if (__atomic_load_n(&nds->g3d_quit, __ATOMIC_SEQ_CST))
+			break;
+		draw_band(nds, band->id);
+		sync_add(&nds->g3d_done, 1);
+	}
+	return NULL;
+}
+
+static void g3d_draw(struct nds *nds)
+{
+	gpu_g3d_bin(nds->gpu);
+	if (nds->g3d_bands < 2)
+	{
+		draw_band(nds, 0);
+		return;
+	}
+	int done = (unsigned)nds->g3d_done.value + nds->g3d_bands - 1;
+	sync_set(&nds->g3d_start, (unsigned)nds->g3d_start.value + 1);
+	draw_band(nds, 0);
+	sync_wait(nds, &nds->g3d_done, done, &nds->gpu_wait_ns);
+}
+
+static void stop_g3d_workers(struct nds *nds)
+{
+	if (nds->g3d_bands < 2)
+		return;
+	__atomic_store_n(&nds->g3d_quit, 1, __ATOMIC_SEQ_CST);
+	sync_set(&nds->g3d_start, (unsigned)nds->g3d_start.value + 1);
+	for (uint32_t i = 1; i < nds->g3d_bands; ++i)
+		pthread_join(nds->g3d_workers[i].thread, NULL);
+	__atomic_store_n(&nds->g3d_quit, 0, __ATOMIC_SEQ_CST);
+	nds->g3d_bands = 1;
+}
+
 static void *gpu_loop(void *arg)
 {
 	nds_t *nds = arg;
+	int frame = 0;
 	while (1)
 	{
-		pthread_mutex_lock(&nds->gpu_mutex);
-		pthread_cond_wait(&nds->gpu_cond, &nds->gpu_mutex);
-		__atomic_store_n(&nds->gpu_y, 0, __ATOMIC_SEQ_CST);
-		pthread_mutex_unlock(&nds->gpu_mutex);
-		for (uint8_t y = 0; y < 192; ++y)
-		{
-			gpu_draw(nds->gpu, y);
-			__atomic_store_n(&nds->gpu_y, y + 1, __ATOMIC_SEQ_CST);
-			while (__atomic_load_n(&nds->nds_y, __ATOMIC_SEQ_CST) < nds->gpu_y)
-				;
-		}
-		while (!__atomic_load_n(&nds->nds_g3d, __ATOMIC_SEQ_CST))
-			;
-		gpu_g3d_draw(nds->gpu);
-		__atomic_store_n(&nds->gpu_g3d, 1, __ATOMIC_SEQ_CST);
+		/* waiting for the next frame isn't counted: it's only throttling */
+		sync_wait(nds, &nds->gpu_frame, ++frame, NULL);
+		if (__atomic_load_n(&nds->gpu_quit, __ATOMIC_SEQ_CST))
+			break;
+		sync_wait(nds, &nds->nds_g3d, 1, &nds->gpu_wait_ns);
+		if (nds->gpu->g3d_observed)
+			g3d_draw(nds);
+		sync_set(&nds->gpu_g3d, 1);
+	}
+	return NULL;
+}
+
+/* the 2d lines are latched by the emulation thread and drawn in any
+ * order by the workers, as one job per engine: a store to vram, palette
+ * or oam waits for the jobs handed out before it (nds_gpu_sync), so they
+ * all see the memory the emulation had when their line was latched
+ */
+static void *gpu_worker_loop(void *arg)
+{
+	nds_t *nds = arg;
+	while (1)
+	{
+		unsigned ticket = __atomic_fetch_add(&nds->gpu_next, 1, __ATOMIC_SEQ_CST);
+		sync_wait(nds, &nds->gpu_jobs, ticket + 1, NULL);
+		if (__atomic_load_n(&nds->gpu_workers_quit, __ATOMIC_SEQ_CST))
+			break;
+		uint8_t y = nds->gpu_line_y[(uint8_t)(ticket >> 1)];
+		gpu_draw_eng(nds->gpu, (ticket & 1) ? &nds->gpu->engb : &nds->gpu->enga, y);
+		sync_add(&nds->gpu_done, 1);
+	}
+	return NULL;
+}
+
+void nds_gpu_sync(struct nds *nds)
+{
+	sync_wait(nds, &nds->gpu_done, nds->gpu_jobs.value, &nds->nds_wait_ns);
+}
+
+static void stop_gpu_workers(struct nds *nds)
+{
+	if (!nds->gpu_workers_nb)
+		return;
+	nds_gpu_sync(nds);
+	__atomic_store_n(&nds->gpu_workers_quit, 1, __ATOMIC_SEQ_CST);
+	/* each worker waits on one of the next tickets */
+	sync_set(&nds->gpu_jobs, (unsigned)nds->gpu_jobs.value + NDS_GPU_WORKERS);
+	for (uint32_t i = 0; i < nds->gpu_workers_nb; ++i)
+		pthread_join(nds->gpu_workers[i], NULL);
+	__atomic_store_n(&nds->gpu_workers_quit, 0, __ATOMIC_SEQ_CST);
+	/* the tickets taken on quit are dropped */
+	nds->gpu_next = nds->gpu_jobs.value;
+	sync_set(&nds->gpu_done, nds->gpu_jobs.value);
+	nds->gpu_workers_nb = 0;
+}
+
+/* the gx commands are queued in a ring of NDS_GX_FIFO entries like the
+ * hardware fifo + pipe, and executed in order by the gx thread while the
+ * emulation runs: only reads of what they produce (results, gxstat, ram
+ * counts) and the swap at vblank wait for it to be drained (nds_gx_sync)
+ */
+static void *gx_loop(void *arg)
+{
+	nds_t *nds = arg;
+	uint32_t params[32];
+	int tail = 0;
+	while (1)
+	{
+		sync_wait(nds, &nds->gx_head, tail + 1, NULL);
+		if (__atomic_load_n(&nds->gx_quit, __ATOMIC_SEQ_CST))
+			break;
+		struct nds_gx_entry *entry = &nds->gx_fifo[(unsigned)tail % NDS_GX_FIFO];
+		uint8_t cmd = entry->cmd;
+		uint8_t params_nb = entry->params;
+		for (uint8_t i = 0; i < params_nb; ++i)
+			params[i] = nds->gx_fifo[((unsigned)tail + i) % NDS_GX_FIFO].param;
+		gpu_gx_cmd(nds->gpu, cmd, params);
+		tail = (unsigned)tail + (params_nb ? params_nb : 1); /* wraps */
+		sync_set(&nds->gx_tail, tail);
 	}
 	return NULL;
 }
 
+/* a full fifo stalls the emulation until the command fits, as it does
+ * the cpu or the gxfifo dma on the hardware
+ */
+void nds_gx_push(struct nds *nds, uint8_t cmd, const uint32_t *params, uint8_t params_nb)
+{
+	unsigned head = nds->gx_head.value;
+	unsigned entries = params_nb ? params_nb : 1;
+	sync_wait(nds, &nds->gx_tail, head + entries - NDS_GX_FIFO, &nds->nds_wait_ns);
+	for (unsigned i = 0; i < entries; ++i)
+	{
+		struct nds_gx_entry *entry = &nds->gx_fifo[(head + i) % NDS_GX_FIFO];
+		entry->param = params_nb ? params[i] : 0;
+		entry->cmd = cmd;
+		entry->params = params_nb;
+	}
+	sync_set(&nds->gx_head, head + entries);
+}
+
+void nds_gx_sync(struct nds *nds)
+{
+	sync_wait(nds, &nds->gx_tail, nds->gx_head.value, &nds->nds_wait_ns);
+}
+
 #endif
 
-struct nds *nds_new(const void *rom_data, size_t rom_size)
+static void draw_line(struct nds *nds, uint8_t y)
+{
+	gpu_latch(nds->gpu, y);
+#ifdef ENABLE_MULTITHREAD
+	if (nds->gpu_workers_nb)
+	{
+		nds->gpu_line_y[(uint8_t)((unsigned)nds->gpu_jobs.value >> 1)] = y;
+		sync_set(&nds->gpu_jobs, (unsigned)nds->gpu_jobs.value + 2); /* wraps */
+		return;
+	}
+#endif
+	gpu_draw(nds->gpu, y);
+}
+
+/* state left by the bios and the firmware once the cartridge is loaded */
+static void boot_cpu(struct cpu *cpu, uint32_t entry, uint32_t sp_svc, uint32_t sp_irq, uint32_t sp)
+{
+	cpu->regs.r_svc[0] = sp_svc;
+	cpu->regs.r_irq[0] = sp_irq;
+	cpu->regs.cpsr = 0xDF;
+	cpu_update_mode(cpu);
+	cpu_set_reg(cpu, CPU_REG_SP, sp);
+	cpu_set_reg(cpu, 12, entry);
+	cpu_set_reg(cpu, CPU_REG_LR, entry);
+	cpu_set_reg(cpu, CPU_REG_PC, entry);
+}
+
+static bool boot_cartridge(struct nds *nds)
+{
+	struct mem *mem = nds->mem;
+	const uint8_t *data = nds->mbc->data;
+	size_t size = nds->mbc->data_size;
+	if (size < 0x200)
+		return false;
+	const uint32_t *hdr = (const uint32_t*)data;
+	uint32_t arm9_off   = hdr[0x20 / 4];
+	uint32_t arm9_entry = hdr[0x24 / 4];
+	uint32_t arm9_addr  = hdr[0x28 / 4];
+	uint32_t arm9_size  = (hdr[0x2C / 4] + 3) & ~3;
+	uint32_t arm7_off   = hdr[0x30 / 4];
+	uint32_t arm7_entry = hdr[0x34 / 4];
+	uint32_t arm7_addr  = hdr[0x38 / 4];
+	uint32_t arm7_size  = (hdr[0x3C / 4] + 3) & ~3;
+	if (arm9_off > size || arm9_size > size - arm9_off
+	 || arm7_off > size || arm7_size > size - arm7_off)
+		return false;
+
+	/* shared wram to the arm7, the binaries may be loaded there */
+	mem_arm9_set8(mem, 0x04000247, 0x03, MEM_DIRECT);
+	for (uint32_t i = 0; i < arm9_size; i += 4)
+		mem_arm9_set32(mem, arm9_addr + i, *(uint32_t*)&data[arm9_off + i], MEM_DIRECT);
+	for (uint32_t i = 0; i < arm7_size; i += 4)
+		mem_arm7_set32(mem, arm7_addr + i, *(uint32_t*)&data[arm7_off + i], MEM_DIRECT);
+	/* the "encryObj" id of a decrypted secure area is destroyed by the bios */
+	if (arm9_off == 0x4000 && arm9_size >= 8)
+	{
+		mem_arm9_set32(mem, arm9_addr + 0, 0xE7FFDEFF, MEM_DIRECT);
+		mem_arm9_set32(mem, arm9_addr + 4, 0xE7FFDEFF, MEM_DIRECT);
+	}
+
+	uint32_t chipid = nds->mbc->chipid[0]
+	                | (nds->mbc->chipid[1] << 8)
+	                | (nds->mbc->chipid[2] << 16)
+	                | ((uint32_t)nds->mbc->chipid[3] << 24);
+	for (uint32_t i = 0; i < 0x170; i += 4)
+		mem_arm9_set32(mem, 0x027FFE00 + i, hdr[i / 4], MEM_DIRECT);
+	mem_arm9_set32(mem, 0x027FF800, chipid, MEM_DIRECT);
+	mem_arm9_set32(mem, 0x027FF804, chipid, MEM_DIRECT);
+	mem_arm9_set16(mem, 0x027FF808, *(uint16_t*)&data[0x15E], MEM_DIRECT);
+	mem_arm9_set16(mem, 0x027FF80A, *(uint16_t*)&data[0x6C], MEM_DIRECT);
+	mem_arm9_set16(mem, 0x027FF850, 0x5835, MEM_DIRECT);
+	mem_arm9_set32(mem, 0x027FFC00, chipid, MEM_DIRECT);
+	mem_arm9_set32(mem, 0x027FFC04, chipid, MEM_DIRECT);
+	mem_arm9_set16(mem, 0x027FFC08, *(uint16_t*)&data[0x15E], MEM_DIRECT);
+	mem_arm9_set16(mem, 0x027FFC0A, *(uint16_t*)&data[0x6C], MEM_DIRECT);
+	mem_arm9_set16(mem, 0x027FFC10, 0x5835, MEM_DIRECT);
+	mem_arm9_set16(mem, 0x027FFC30, 0xFFFF, MEM_DIRECT);
+	mem_arm9_set16(mem, 0x027FFC40, 0x0001, MEM_DIRECT); /* booted from cartridge */
+
+	mem_arm9_set8(mem, 0x04000300, 0x01, MEM_DIRECT); /* POSTFLG */
+	mem_arm7_set8(mem, 0x04000300, 0x01, MEM_DIRECT);
+	mem_arm7_set32(mem, 0x04000308, 0x1204, MEM_DIRECT); /* BIOSPROT */
+
+	/* the cartridge is left in KEY2 mode */
+	nds->mbc->enc = 2;
+
+	cp15_write(nds->arm9, 9, 1, 0, 0x0300000A); /* dtcm */
+	cp15_write(nds->arm9, 9, 1, 1, 0x00000020); /* itcm */
+	cp15_write(nds->arm9, 1, 0, 0, 0x0005707D);
+	boot_cpu(nds->arm9, arm9_entry, 0x03003FC0, 0x03003F80, 0x03002F7C);
+	boot_cpu(nds->arm7, arm7_entry, 0x0380FFC0, 0x0380FF80, 0x0380FD80);
+	return true;
+}
+
+struct nds *nds_new(const void *rom_data, size_t rom_size, int direct_boot)
 {
 	struct nds *nds = calloc(sizeof(*nds), 1);
 	if (!nds)
 		return NULL;
 
+	for (size_t i = 0; i < NDS_EVENT_LAST; ++i)
+		nds->events[i] = UINT64_MAX;
+	nds->next_event = UINT64_MAX;
+
 	nds->mbc = mbc_new(nds, rom_data, rom_size);
 	if (!nds->mbc)
 		return NULL;
@@ -229,11 +545,28 @@ struct nds *nds_new(const void *rom_data, size_t rom_size)
 	if (!nds->gpu)
 		return NULL;
 
+	if (direct_boot)
+	{
+		nds->direct_boot = boot_cartridge(nds);
+		if (!nds->direct_boot)
+			printf("invalid cartridge header, booting the firmware\n");
+	}
+
 #ifdef ENABLE_MULTITHREAD
-	if (pthread_cond_init(&nds->gpu_cond, NULL)
-	 || pthread_mutex_init(&nds->gpu_mutex, NULL)
-	 || pthread_create(&nds->gpu_thread, NULL, gpu_loop, nds))
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nds_set_spin(nds, NDS_SPIN_AUTO);
+	if (pthread_create(&nds->gpu_thread, NULL, gpu_loop, nds))
 		return NULL;
+	nds->g3d_bands = 1;
+	nds_set_g3d_threads(nds, NDS_G3D_THREADS_AUTO);
+	nds_set_gpu_threads(nds, NDS_GPU_THREADS_AUTO);
+	/* a gx thread sharing the core would only add switches */
+	if (cpus > 1)
+	{
+		if (pthread_create(&nds->gx_thread, NULL, gx_loop, nds))
+			return NULL;
+		nds->mem->gx_async = 1;
+	}
 #endif
 	return nds;
 }
@@ -242,6 +575,19 @@ void nds_del(struct nds *nds)
 {
 	if (!nds)
 		return;
+#ifdef ENABLE_MULTITHREAD
+	__atomic_store_n(&nds->gpu_quit, 1, __ATOMIC_SEQ_CST);
+	sync_set(&nds->gpu_frame, nds->gpu_frame.value + 1);
+	pthread_join(nds->gpu_thread, NULL);
+	stop_g3d_workers(nds);
+	stop_gpu_workers(nds);
+	if (nds->mem->gx_async)
+	{
+		__atomic_store_n(&nds->gx_quit, 1, __ATOMIC_SEQ_CST);
+		sync_set(&nds->gx_head, (unsigned)nds->gx_head.value + 1);
+		pthread_join(nds->gx_thread, NULL);
+	}
+#endif
 	mbc_del(nds->mbc);
 	mem_del(nds->mem);
 	apu_del(nds->apu);
@@ -251,44 +597,110 @@ void nds_del(struct nds *nds)
 	free(nds);
 }
 
-static void nds_cycles(struct nds *nds, uint32_t cycles)
+void nds_schedule(struct nds *nds, enum nds_event event, uint64_t cycle)
+{
+	nds->events[event] = cycle;
+	if (cycle < nds->next_event)
+		nds->next_event = cycle;
+}
+
+static void run_event(struct nds *nds, enum nds_event event)
 {
-	for (; cycles; cycles -= 4)
+	switch (event)
 	{
-		nds->cycle += 4;
-		if (!(nds->cycle & ((0x8 << INACCURACY_SHIFT) - 1)))
+		case NDS_EVENT_DMA:
+			nds->arm7->idle = 0;
+			nds->arm9->idle = 0;
+			mem_dma(nds->mem);
+			break;
+		case NDS_EVENT_TIMERS:
+			mem_timers(nds->mem);
+			break;
+		case NDS_EVENT_APU:
 		{
-			mem_dma(nds->mem, 0x1 << INACCURACY_SHIFT);
-			mem_timers(nds->mem, 0x4 << INACCURACY_SHIFT);
-			apu_cycles(nds->apu, 0x2 << INACCURACY_SHIFT);
-			apu_sample(nds->apu, 0x8 << INACCURACY_SHIFT);
+			/* sound channels run at a quarter of the arm9 clock */
+			uint32_t clock = nds->cycle - nds->frame_cycle;
+			apu_cycles(nds->apu, (clock >> 2) - (nds->apu->clock >> 2));
+			apu_sample(nds->apu, clock - nds->apu->clock);
+			nds_schedule(nds, NDS_EVENT_APU, nds->frame_cycle + nds->apu->next_sample);
+			break;
 		}
-		if (!nds->arm7->irq_wait)
+		default:
+			break;
+	}
+}
+
+static void run_events(struct nds *nds)
+{
+	for (size_t i = 0; i < NDS_EVENT_LAST; ++i)
+	{
+		if (nds->events[i] > nds->cycle)
+			continue;
+		nds->events[i] = UINT64_MAX;
+		run_event(nds, i);
+	}
+	nds->next_event = UINT64_MAX;
+	for (size_t i = 0; i < NDS_EVENT_LAST; ++i)
+	{
+		if (nds->events[i] < nds->next_event)
+			nds->next_event = nds->events[i];
+	}
+}
+
+static bool cpu_sleeping(struct cpu *cpu)
+{
+	return cpu->irq_wait || cpu->idle;
+}
+
+/* run the cpu until it used the cycles it was given: instr_delay holds
+ * the cycles it's ahead of (or behind) time, each cpu_cycle call costs
+ * one plus the wait states of what it ran
+ */
+static void run_cpu(struct cpu *cpu, uint32_t cycles, uint32_t *idle_cycles)
+{
+	cpu->instr_delay -= cycles;
+	while (cpu->instr_delay < 0)
+	{
+		if (cpu_sleeping(cpu))
 		{
-			if (nds->arm7->instr_delay <= 0)
-			{
-				cpu_cycle(nds->arm7);
-				cpu_cycle(nds->arm7);
-			}
-			else
-			{
-				nds->arm7->instr_delay -= 2;
-			}
+			if (cpu->idle)
+				*idle_cycles += -cpu->instr_delay;
+			cpu->instr_delay = 0;
+			return;
 		}
-		if (!nds->arm9->irq_wait)
+		cpu->instr_delay++;
+		cpu_cycle(cpu);
+	}
+}
+
+/* the cpus run by slices ending at the next event: events are only
+ * handled between two slices
+ */
+static void nds_cycles(struct nds *nds, uint32_t cycles)
+{
+	uint64_t end = nds->cycle + cycles;
+	/* the caller changed the scanline state */
+	nds->arm7->idle = 0;
+	nds->arm9->idle = 0;
+	if (nds->cycle >= nds->next_event)
+		run_events(nds);
+	while (nds->cycle < end)
+	{
+		uint64_t slice_end = end;
+		/* both cpus wait on something: jump right to the next event */
+		if (!cpu_sleeping(nds->arm7) || !cpu_sleeping(nds->arm9))
 		{
-			if (nds->arm9->instr_delay <= 0)
-			{
-				cpu_cycle(nds->arm9);
-				cpu_cycle(nds->arm9);
-				cpu_cycle(nds->arm9);
-				cpu_cycle(nds->arm9);
-			}
-			else
-			{
-				nds->arm9->instr_delay -= 4;
-			}
+			if (slice_end > nds->cycle + NDS_CPU_SLICE)
+				slice_end = nds->cycle + NDS_CPU_SLICE;
 		}
+		if (slice_end > nds->next_event)
+			slice_end = (nds->next_event + 3) & ~(uint64_t)3;
+		uint32_t slice = slice_end - nds->cycle;
+		run_cpu(nds->arm9, slice, &nds->arm9_idle_cycles);
+		run_cpu(nds->arm7, slice / 2, &nds->arm7_idle_cycles);
+		nds->cycle = slice_end;
+		if (nds->cycle >= nds->next_event)
+			run_events(nds);
 	}
 }
 
@@ -319,19 +731,25 @@ void nds_frame(struct nds *nds, uint8_t *video_top_buf, uint32_t video_top_pitch
 	nds->apu->sample = 0;
 	nds->apu->clock = 0;
 	nds->apu->next_sample = nds->apu->clock;
+	nds->frame_cycle = nds->cycle;
+	nds_schedule(nds, NDS_EVENT_APU, nds->cycle);
+	nds->arm7_idle_cycles = 0;
+	nds->arm9_idle_cycles = 0;
 	nds->joypad = joypad;
 	nds->touch = touch;
 	nds->touch_x = touch_x;
 	nds->touch_y = touch_y;
 	gpu_commit_bgpos(nds->gpu);
 #ifdef ENABLE_MULTITHREAD
-	pthread_mutex_lock(&nds->gpu_mutex);
-	__atomic_store_n(&nds->nds_g3d, 0, __ATOMIC_SEQ_CST);
-	__atomic_store_n(&nds->nds_y, 0, __ATOMIC_SEQ_CST);
-	pthread_cond_signal(&nds->gpu_cond);
-	pthread_mutex_unlock(&nds->gpu_mutex);
+	/* the gpu thread is parked until the frame is started */
+	nds->nds_wait_ns = 0;
+	nds->gpu_wait_ns = 0;
+	__atomic_store_n(&nds->nds_g3d.value, 0, __ATOMIC_SEQ_CST);
+	sync_set(&nds->gpu_frame, nds->gpu_frame.value + 1);
 #else
-	gpu_g3d_draw(nds->gpu);
+	nds->gpu->g3d_observed = gpu_g3d_is_observed(nds->gpu);
+	if (nds->gpu->g3d_observed)
+		gpu_g3d_draw(nds->gpu);
 #endif
 	for (uint8_t y = 0; y < 192; ++y)
 	{
@@ -349,13 +767,7 @@ void nds_frame(struct nds *nds, uint8_t *video_top_buf, uint32_t video_top_pitch
 			mem_arm7_irq(nds->mem, 1 << 2);
 
 		nds_cycles(nds, 256 * 12);
-#ifdef ENABLE_MULTITHREAD
-		while (__atomic_load_n(&nds->gpu_y, __ATOMIC_SEQ_CST) < y + 1)
-			;
-#else
-		/* draw */
-		gpu_draw(nds->gpu, y);
-#endif
+		draw_line(nds, y);
 
 		/* hblank */
 		mem_arm9_set_reg16(nds->mem, MEM_ARM9_REG_DISPSTAT, (mem_arm9_get_reg16(nds->mem, MEM_ARM9_REG_DISPSTAT) & 0xFFFC) | 0x2);
@@ -367,11 +779,13 @@ void nds_frame(struct nds *nds, uint8_t *video_top_buf, uint32_t video_top_pitch
 		mem_hblank(nds->mem);
 
 		nds_cycles(nds, 99 * 12);
-#ifdef ENABLE_MULTITHREAD
-		__atomic_store_n(&nds->nds_y, y + 1, __ATOMIC_SEQ_CST);
-#endif
 	}
 
+#ifdef ENABLE_MULTITHREAD
+	nds_gpu_sync(nds);
+	/* SWAP_BUFFERS takes effect at vblank: its commands have to be run */
+	nds_gx_sync(nds);
+#endif
 	mem_arm9_set_reg32(nds->mem, MEM_ARM9_REG_DISPCAPCNT,
 	                   mem_arm9_get_reg32(nds->mem, MEM_ARM9_REG_DISPCAPCNT) & ~(1 << 31));
 	gpu_g3d_swap_buffers(nds->gpu);
@@ -411,18 +825,141 @@ void nds_frame(struct nds *nds, uint8_t *video_top_buf, uint32_t video_top_pitch
 #ifdef ENABLE_MULTITHREAD
 		if (y == 216)
 		{
-			__atomic_store_n(&nds->gpu_g3d, 0, __ATOMIC_SEQ_CST);
-			__atomic_store_n(&nds->nds_g3d, 1, __ATOMIC_SEQ_CST);
+			/* the next frame is drawn ahead: its registers are mostly
+			 * set by the vblank handlers at this point
+			 */
+			nds->gpu->g3d_observed = gpu_g3d_is_observed(nds->gpu);
+			__atomic_store_n(&nds->gpu_g3d.value, 0, __ATOMIC_SEQ_CST);
+			sync_set(&nds->nds_g3d, 1);
 		}
 #endif
 	}
 
 #ifdef ENABLE_MULTITHREAD
-	while (!__atomic_load_n(&nds->gpu_g3d, __ATOMIC_SEQ_CST))
-		;
+	sync_wait(nds, &nds->gpu_g3d, 1, &nds->nds_wait_ns);
+#endif
+#if 0
+	printf("idle cycles: arm7 %" PRIu32 " arm9 %" PRIu32 "\n",
+	       nds->arm7_idle_cycles, nds->arm9_idle_cycles);
+#endif
+}
+
+void nds_set_exec(struct nds *nds, enum nds_exec exec)
+{
+	enum cpu_exec cpu_exec;
+	switch (exec)
+	{
+		case NDS_EXEC_CACHED:
+			cpu_exec = CPU_EXEC_CACHED;
+			break;
+		case NDS_EXEC_JIT:
+			cpu_exec = CPU_EXEC_JIT;
+			break;
+		default:
+			cpu_exec = CPU_EXEC_INTERPRETER;
+			break;
+	}
+	cpu_set_exec(nds->arm7, cpu_exec);
+	cpu_set_exec(nds->arm9, cpu_exec);
+}
+
+void nds_set_spin(struct nds *nds, uint32_t spin)
+{
+#ifdef ENABLE_MULTITHREAD
+	/* spinning only delays the other thread if they share the core */
+	if (spin == NDS_SPIN_AUTO)
+		spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? NDS_SPIN_DEFAULT : 0;
+	nds->spin = spin;
+#else
+	(void)nds;
+	(void)spin;
+#endif
+}
+
+/* draw the 2d lines with as many threads (NDS_GPU_THREADS_AUTO for one
+ * per cpu but one, 0 to draw them inline), only to be called between
+ * frames
+ */
+void nds_set_gpu_threads(struct nds *nds, uint32_t threads)
+{
+#ifdef ENABLE_MULTITHREAD
+	/* one core is left to the emulation */
+	if (threads == NDS_GPU_THREADS_AUTO)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 1 ? cpus - 1 : 0;
+	}
+	if (threads > NDS_GPU_WORKERS)
+		threads = NDS_GPU_WORKERS;
+	if (threads == nds->gpu_workers_nb)
+		return;
+	stop_gpu_workers(nds);
+	while (nds->gpu_workers_nb < threads)
+	{
+		if (pthread_create(&nds->gpu_workers[nds->gpu_workers_nb], NULL, gpu_worker_loop, nds))
+		{
+			printf("failed to create 2d thread\n");
+			break;
+		}
+		nds->gpu_workers_nb++;
+	}
+	/* 0 workers: the lines are drawn inline by the emulation thread */
+	nds->mem->gpu_async = nds->gpu_workers_nb != 0;
+	mem_arm7_update_pages(nds->mem);
+	mem_arm9_update_pages(nds->mem);
+#else
+	(void)nds;
+	(void)threads;
+#endif
+}
+
+/* split the 3d in as many bands, drawn by as many threads
+ * (NDS_G3D_THREADS_AUTO for one per cpu, up to 4), only to be called
+ * between frames
+ */
+void nds_set_g3d_threads(struct nds *nds, uint32_t threads)
+{
+#ifdef ENABLE_MULTITHREAD
+	if (threads == NDS_G3D_THREADS_AUTO)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus < 4 ? cpus : 4;
+	}
+	if (threads < 1)
+		threads = 1;
+	if (threads > NDS_G3D_BANDS)
+		threads = NDS_G3D_BANDS;
+	if (threads == nds->g3d_bands)
+		return;
+	stop_g3d_workers(nds);
+	for (uint32_t i = 0; i < NDS_G3D_BANDS; ++i)
+		nds->g3d_band_ns[i] = 0;
+	uint32_t bands = 1;
+	while (bands < threads)
+	{
+		struct nds_band *band = &nds->g3d_workers[bands];
+		band->nds = nds;
+		band->id = bands;
+		if (pthread_create(&band->thread, NULL, g3d_worker_loop, band))
+		{
+			printf("failed to create 3d thread\n");
+			break;
+		}
+		bands++;
+	}
+	nds->g3d_bands = bands;
+#else
+	(void)nds;
+	(void)threads;
 #endif
 }
 
+void nds_set_hle_bios(struct nds *nds, int enable)
+{
+	nds->arm7->hle_bios = enable;
+	nds->arm9->hle_bios = enable;
+}
+
 void nds_set_arm7_bios(struct nds *nds, const uint8_t *data)
 {
 	memcpy(nds->mem->arm7_bios, data, 0x4000);
@@ -437,6 +974,20 @@ void nds_set_firmware(struct nds *nds, const uint8_t *data)
 {
 	memcpy(nds->mem->firmware, data, 0x40000);
 	memcpy(nds->mem->sram, data, 0x40000);
+	if (nds->direct_boot)
+	{
+		/* user settings, from the most recent of the two copies */
+		uint32_t user = (data[0x20] | (data[0x21] << 8)) * 8;
+		if (user + 0x174 <= 0x40000)
+		{
+			uint16_t count0 = *(uint16_t*)&data[user + 0x70];
+			uint16_t count1 = *(uint16_t*)&data[user + 0x170];
+			if (((count1 - count0) & 0x7F) == 1)
+				user += 0x100;
+			for (uint32_t i = 0; i < 0x70; i += 4)
+				mem_arm9_set32(nds->mem, 0x027FFC80 + i, *(uint32_t*)&data[user + i], MEM_DIRECT);
+		}
+	}
 }
 
 void nds_get_mbc_ram(struct nds *nds, uint8_t **data, size_t *size)
@@ -1,6 +1,7 @@
 #ifndef NDS_H
 #define NDS_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -34,6 +35,65 @@ enum nds_button
 	NDS_BUTTON_START  = (1 << 11),
 };
 
+/* dma transfers are run by bursts, trading accuracy for speed */
+#define NDS_DMA_PERIOD 64 /* cycles between two dma bursts */
+#define NDS_DMA_BURST  8  /* transfers per burst */
+
+/* the cpus run by slices, checking the events only between two of them */
+#define NDS_CPU_SLICE 64 /* most cycles per slice */
+
+#define NDS_GX_FIFO 256 /* gx fifo + pipe entries (one per command param) */
+
+enum nds_event
+{
+	NDS_EVENT_DMA,
+	NDS_EVENT_TIMERS,
+	NDS_EVENT_APU,
+	NDS_EVENT_LAST,
+};
+
+enum nds_exec
+{
+	NDS_EXEC_INTERPRETER,
+	NDS_EXEC_CACHED,
+	NDS_EXEC_JIT,
+};
+
+#define NDS_SPIN_AUTO UINT32_MAX /* nds_set_spin: spin only with several cores */
+#define NDS_GPU_THREADS_AUTO UINT32_MAX /* nds_set_gpu_threads: one core left to the emulation */
+#define NDS_G3D_THREADS_AUTO UINT32_MAX /* nds_set_g3d_threads: one band per core, up to 4 */
+
+#ifdef ENABLE_MULTITHREAD
+#define NDS_SPIN_DEFAULT 2000
+#define NDS_GPU_WORKERS  4 /* most threads drawing 2d lines */
+#define NDS_G3D_BANDS    8 /* most threads drawing the 3d */
+
+/* value one thread waits for the other to raise */
+struct nds_sync
+{
+	int value;
+	int waiters;
+};
+
+/* thread drawing a horizontal band of the 3d */
+struct nds_band
+{
+	struct nds *nds;
+	pthread_t thread;
+	uint32_t id;
+};
+
+/* gx fifo entry: a command takes one per param (one if it has none),
+ * its id and params count are stored in the first one
+ */
+struct nds_gx_entry
+{
+	uint32_t param;
+	uint8_t cmd;
+	uint8_t params;
+};
+#endif
+
 typedef struct nds
 {
 	struct mbc *mbc;
@@ -44,31 +104,74 @@ typedef struct nds
 	struct gpu *gpu;
 	uint32_t joypad;
 	uint64_t cycle;
+	uint64_t frame_cycle; /* cycle of the current frame start */
+	uint64_t events[NDS_EVENT_LAST]; /* deadlines, UINT64_MAX if unscheduled */
+	uint64_t next_event;
+	uint32_t arm7_idle_cycles; /* cycles skipped in idle loops during the last frame */
+	uint32_t arm9_idle_cycles;
 	uint8_t touch_x;
 	uint8_t touch_y;
 	uint8_t touch;
+	int direct_boot; /* started from the cartridge entry points */
 #ifdef ENABLE_MULTITHREAD
 	pthread_t gpu_thread;
-	pthread_cond_t gpu_cond;
-	pthread_mutex_t gpu_mutex;
-	int gpu_y;
-	int nds_y;
-	int gpu_g3d;
-	int nds_g3d;
+	pthread_t gpu_workers[NDS_GPU_WORKERS];
+	uint32_t gpu_workers_nb; /* 0 if lines are drawn by the emulation thread */
+	struct nds_sync gpu_frame; /* frames started, the gpu thread waits on it */
+	struct nds_sync gpu_jobs; /* 2d jobs (an engine line each) handed out to the workers */
+	struct nds_sync gpu_done; /* 2d jobs done */
+	int gpu_next; /* next job ticket taken by a worker */
+	uint8_t gpu_line_y[256]; /* line of each pair of tickets */
+	struct nds_sync gpu_g3d;
+	struct nds_sync nds_g3d;
+	struct nds_band g3d_workers[NDS_G3D_BANDS]; /* band 0 is drawn by the gpu thread */
+	uint32_t g3d_bands; /* bands the 3d is split in */
+	struct nds_sync g3d_start; /* frames handed out to the band workers */
+	struct nds_sync g3d_done; /* bands drawn by the workers */
+	uint64_t g3d_band_ns[NDS_G3D_BANDS]; /* time drawing each band during the last frame */
+	pthread_t gx_thread; /* executes the gx commands in order */
+	struct nds_gx_entry gx_fifo[NDS_GX_FIFO];
+	struct nds_sync gx_head; /* entries pushed by the emulation */
+	struct nds_sync gx_tail; /* entries executed by the gx thread */
+	int g3d_quit;
+	int gpu_quit;
+	int gpu_workers_quit;
+	int gx_quit;
+	uint32_t spin; /* polls before sleeping in a wait */
+	uint64_t nds_wait_ns; /* time waiting for the other thread during the last frame */
+	uint64_t gpu_wait_ns;
 #endif
 } nds_t;
 
-nds_t *nds_new(const void *rom_data, size_t rom_size);
+nds_t *nds_new(const void *rom_data, size_t rom_size, int direct_boot);
 void nds_del(nds_t *nds);
 
 void nds_frame(struct nds *nds, uint8_t *video_top_buf, uint32_t video_top_pitch,
                uint8_t *video_bot_buf, uint32_t video_bot_pitch, int16_t *audio_buf,
                uint32_t joypad, uint8_t touch_x, uint8_t touch_y, uint8_t touch);
 
+void nds_set_exec(nds_t *nds, enum nds_exec exec);
+void nds_set_hle_bios(nds_t *nds, int enable);
+void nds_set_spin(nds_t *nds, uint32_t spin);
+void nds_set_gpu_threads(nds_t *nds, uint32_t threads);
+void nds_set_g3d_threads(nds_t *nds, uint32_t threads);
+
+void nds_schedule(nds_t *nds, enum nds_event event, uint64_t cycle);
+
+#ifdef ENABLE_MULTITHREAD
+void nds_gpu_sync(nds_t *nds);
+void nds_gx_push(nds_t *nds, uint8_t cmd, const uint32_t *params, uint8_t params_nb);
+void nds_gx_sync(nds_t *nds);
+#endif
+
 void nds_set_arm7_bios(nds_t *nds, const uint8_t *data);
 void nds_set_arm9_bios(nds_t *nds, const uint8_t *data);
 void nds_set_firmware(nds_t *nds, const uint8_t *data);
 
+size_t nds_state_size(nds_t *nds);
+bool nds_save_state(nds_t *nds, void *data, size_t size);
+bool nds_load_state(nds_t *nds, const void *data, size_t size);
+
 void nds_get_mbc_ram(nds_t *nds, uint8_t **data, size_t *size);
 void nds_get_mbc_rtc(nds_t *nds, uint8_t **data, size_t *size);
 
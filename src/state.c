@@ -0,0 +1,209 @@
+#include "nds.h"
+#include "mbc.h"
+#include "mem.h"
+#include "apu.h"
+#include "cpu.h"
+#include "gpu.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+/*
+ * machine snapshots
+ * the same walk over the emulated state measures, saves and loads it,
+ * so the three can't get out of sync
+ * host pointers are never stored: they are kept on load, and everything
+ * derived from the state (pages, code caches, banked registers) is rebuilt
+ */
+
+#define STATE_MAGIC   0x5353444E /* "NDSS" */
+#define STATE_VERSION 10
+
+struct state_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t sram_size;
+};
+
+struct state
+{
+	uint8_t *data; /* NULL when only measuring */
+	size_t size;
+	size_t pos;
+	bool load;
+};
+
+static void sync(struct state *state, void *ptr, size_t size)
+{
+	if (state->data && state->pos + size <= state->size)
+	{
+		if (state->load)
+			memcpy(ptr, &state->data[state->pos], size);
+		else
+			memcpy(&state->data[state->pos], ptr, size);
+	}
+	state->pos += size;
+}
+
+#define SYNC(state, v) sync(state, &(v), sizeof(v))
+
+/* fields [first, end) of a struct */
+#define SYNC_RANGE(state, s, type, first, end) \
+	sync(state, &(s)->first, offsetof(type, end) - offsetof(type, first))
+
+static void sync_cpu(struct state *state, struct cpu *cpu)
+{
+	SYNC_RANGE(state, &cpu->regs, struct cpu_regs, r, rptr);
+	SYNC(state, cpu->cp15);
+	SYNC(state, cpu->instr_opcode);
+	SYNC(state, cpu->instr_delay);
+	SYNC(state, cpu->state);
+	SYNC(state, cpu->irq_wait);
+	SYNC(state, cpu->irq_line);
+	SYNC(state, cpu->next_thumb);
+	SYNC(state, cpu->has_next_thumb);
+}
+
+static void sync_mem(struct state *state, struct mem *mem)
+{
+	uint8_t *sram = mem->sram;
+	/* everything but the pages and the code tracking, rebuilt on load */
+	SYNC_RANGE(state, mem, struct mem, arm7_timers, code_pages);
+	mem->sram = sram;
+	sync(state, mem->sram, mem->sram_size);
+	SYNC(state, mem->timers_cycle);
+}
+
+static void sync_gpu(struct state *state, struct gpu *gpu)
+{
+	SYNC_RANGE(state, &gpu->enga, struct gpu_eng, bg2x, engb);
+	SYNC_RANGE(state, &gpu->engb, struct gpu_eng, bg2x, engb);
+	for (size_t i = 0; i < 2; ++i)
+	{
+		struct gpu_g3d_buf *buf = &gpu->g3d.bufs[i];
+		SYNC(state, buf->data);
+		SYNC(state, buf->zbuf);
+		sync(state, buf->vertexes, sizeof(*buf->vertexes) * GPU_VERTEXES);
+		sync(state, buf->polygons, sizeof(*buf->polygons) * GPU_POLYGONS);
+		SYNC(state, buf->vertexes_nb);
+		SYNC(state, buf->polygons_nb);
+		SYNC(state, buf->cleared);
+		SYNC(state, buf->clear_color);
+		SYNC(state, buf->clear_offset);
+		SYNC(state, buf->clear_image);
+		SYNC(state, buf->hiz);
+		SYNC(state, buf->hiz_dirty);
+	}
+	uint8_t front = gpu->g3d.front == &gpu->g3d.bufs[1];
+	SYNC(state, front);
+	gpu->g3d.front = &gpu->g3d.bufs[front];
+	gpu->g3d.back = &gpu->g3d.bufs[!front];
+	sync(state, &gpu->g3d.proj_stack,
+	     sizeof(gpu->g3d) - offsetof(struct gpu_g3d, proj_stack));
+	SYNC(state, gpu->clear_data);
+	SYNC(state, gpu->clear_zbuf);
+}
+
+static void sync_apu(struct state *state, struct apu *apu)
+{
+	SYNC(state, apu->channels);
+	SYNC(state, apu->clock);
+	SYNC(state, apu->sample);
+	SYNC(state, apu->next_sample);
+}
+
+static void sync_mbc(struct state *state, struct mbc *mbc)
+{
+	SYNC_RANGE(state, mbc, struct mbc, cmd, backup_type);
+}
+
+static void sync_nds(struct state *state, struct nds *nds)
+{
+	SYNC(state, nds->cycle);
+	SYNC(state, nds->frame_cycle);
+	SYNC(state, nds->events);
+	SYNC(state, nds->next_event);
+	SYNC(state, nds->joypad);
+	SYNC(state, nds->touch_x);
+	SYNC(state, nds->touch_y);
+	SYNC(state, nds->touch);
+	SYNC(state, nds->direct_boot);
+	sync_cpu(state, nds->arm7);
+	sync_cpu(state, nds->arm9);
+	sync_mem(state, nds->mem);
+	sync_gpu(state, nds->gpu);
+	sync_apu(state, nds->apu);
+	sync_mbc(state, nds->mbc);
+}
+
+size_t nds_state_size(struct nds *nds)
+{
+	struct state state = {NULL, 0, sizeof(struct state_header), false};
+	sync_nds(&state, nds);
+	return state.pos;
+}
+
+bool nds_save_state(struct nds *nds, void *data, size_t size)
+{
+#ifdef ENABLE_MULTITHREAD
+	nds_gx_sync(nds); /* the gx state is saved once its queued commands ran */
+#endif
+	size_t state_size = nds_state_size(nds);
+	if (size < state_size)
+		return false;
+	struct state_header header;
+	header.magic = STATE_MAGIC;
+	header.version = STATE_VERSION;
+	header.size = state_size;
+	header.sram_size = nds->mem->sram_size;
+	memcpy(data, &header, sizeof(header));
+	struct state state = {data, size, sizeof(header), false};
+	sync_nds(&state, nds);
+	return true;
+}
+
+bool nds_load_state(struct nds *nds, const void *data, size_t size)
+{
+#ifdef ENABLE_MULTITHREAD
+	nds_gx_sync(nds);
+#endif
+	struct state_header header;
+	if (size < sizeof(header))
+		return false;
+	memcpy(&header, data, sizeof(header));
+	if (header.magic != STATE_MAGIC
+	 || header.version != STATE_VERSION
+	 || header.sram_size != nds->mem->sram_size
+	 || header.size != nds_state_size(nds)
+	 || size < header.size)
+	{
+		printf("invalid state\n");
+		return false;
+	}
+
+	struct mem *mem = nds->mem;
+	for (uint32_t i = 0; i < MEM_CODE_PAGES; ++i)
+	{
+		if (mem->code_pages[i])
+			mem_code_invalidate(mem, i);
+	}
+	struct state state = {(uint8_t*)data, size, sizeof(header), true};
+	sync_nds(&state, nds);
+
+	mem_arm7_update_pages(mem);
+	mem_arm9_update_pages(mem);
+	mem->vram_tex_gen++;
+	struct cpu *cpus[2] = {nds->arm7, nds->arm9};
+	for (size_t i = 0; i < 2; ++i)
+	{
+		cpu_update_mode(cpus[i]);
+		cpus[i]->idle = 0;
+		cpus[i]->block_exit = 0;
+		cpu_flush_code(cpus[i]);
+	}
+	return true;
+}